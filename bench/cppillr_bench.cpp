@@ -0,0 +1,584 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+// Benchmark of each phase of cppillr (read, lex, fast-parse, body
+// parse, docs, and run) with a synthetic corpus of C++ files that is
+// generated in a deterministic way (same options + seed = same files).
+// It also compares the plain token layout with the compact one
+// (-compacttokens): memory, and the throughput of scanning the
+// tokens, docs, and fast-parse with each layout.
+//
+//   cppillr_bench [-files N] [-minsize KB] [-maxsize KB]
+//                 [-comments F] [-funcs N] [-nesting N] [-seed N]
+//                 [-threads 1,2,4] [-repeat N] [-corpus dir]
+//                 [-json file.json]
+
+#include "cppillr/docs.h"
+#include "cppillr/keywords.h"
+#include "cppillr/lexer.h"
+#include "cppillr/options.h"
+#include "cppillr/parser.h"
+#include "cppillr/program.h"
+#include "cppillr/run.h"
+#include "cppillr/token_cursor.h"
+#include "utils/hash.h"
+#include "utils/scoped_fclose.h"
+#include "utils/thread_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <sys/stat.h>
+#ifndef _WIN32
+  #include <sys/resource.h>
+#endif
+
+#ifdef _WIN32
+  #include <direct.h>
+#endif
+
+struct BenchOptions {
+  int files = 200;
+  int min_size = 4;             // KB
+  int max_size = 64;            // KB
+  double comments = 0.3;        // Probability of a doc comment before each function
+  int funcs = 4;                // Functions per KB
+  int nesting = 4;              // Max nesting level of expressions
+  uint64_t seed = 1;
+  std::vector<int> threads;
+  int repeat = 3;
+  std::string corpus = "cppillr_bench_corpus";
+  std::string json;
+};
+
+struct Corpus {
+  std::vector<std::string> files;
+  std::vector<std::string> contents; // For the calibration phase
+  uint64_t bytes = 0;
+  uint64_t tokens = 0;
+};
+
+// Returns the peak resident set size of the process in KB (or 0 if
+// it's not available)
+static long peak_rss_kb()
+{
+#ifdef _WIN32
+  return 0;
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0)
+    return 0;
+  #ifdef __APPLE__
+    return long(usage.ru_maxrss / 1024); // Bytes in macOS
+  #else
+    return long(usage.ru_maxrss);
+  #endif
+#endif
+}
+
+enum Phase {
+  Calibrate, Read, Lex, FastParse, BodyParse, Docs, Run,
+  Scan, Compress, ScanCompact, DocsCompact, FastParseCompact,
+  NumPhases
+};
+static const char* phase_names[NumPhases] = {
+  "calibrate", "read", "lex", "fast-parse", "body-parse", "docs", "run",
+  "scan", "compress", "scan-compact", "docs-compact", "fast-parse-compact"
+};
+
+// Memory used by the tokens of all files (LexData::tokens vs
+// LexData::compact_tokens)
+struct TokenMemory {
+  uint64_t plain = 0;
+  uint64_t compact = 0;
+};
+
+struct Result {
+  int threads;
+  double secs[NumPhases];
+};
+
+//////////////////////////////////////////////////////////////////////
+// Corpus generator
+
+// xorshift64* (we don't use <random> distributions because their
+// output can be different between standard library implementations)
+class Random {
+  uint64_t state;
+public:
+  Random(uint64_t seed) : state(seed ? seed: 0x9e3779b97f4a7c15ull) { }
+  uint64_t next() {
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545f4914f6cdd1dull;
+  }
+  // Integer in [a, b]
+  int range(int a, int b) { return a + int(next() % uint64_t(b-a+1)); }
+  // Real in [0, 1)
+  double real() { return double(next() >> 11) / double(1ull << 53); }
+};
+
+static const char* words[] = {
+  "returns", "the", "value", "of", "a", "given", "token", "file",
+  "lexer", "parser", "function", "number", "computes", "result",
+  "index", "size", "buffer", "node", "with", "from", "each", "list"
+};
+
+static void gen_expr(Random& rnd, int depth, std::string& out)
+{
+  static const char ops[] = "+-*";
+  const int n = rnd.range(1, 3);
+  for (int i=0; i<n; ++i) {
+    if (i > 0) {
+      out.push_back(' ');
+      out.push_back(ops[rnd.range(0, 2)]);
+      out.push_back(' ');
+    }
+    if (depth > 0 && rnd.range(0, 2) == 0) {
+      out.push_back('(');
+      gen_expr(rnd, depth-1, out);
+      out.push_back(')');
+    }
+    else
+      out += std::to_string(rnd.range(0, 999));
+  }
+}
+
+// Generates a file that can be parsed by the cppillr parser: a list
+// of function definitions with "return expr;" statements.
+static std::string gen_file(const BenchOptions& opts, Random& rnd, int file_i)
+{
+  // Log-uniform distribution of file sizes
+  const double lmin = std::log(double(std::max(1, opts.min_size)));
+  const double lmax = std::log(double(std::max(opts.min_size, opts.max_size)));
+  const size_t size = size_t(std::exp(lmin + (lmax-lmin)*rnd.real()) * 1024);
+  const int fn_bytes = 1024 / std::max(1, opts.funcs);
+
+  std::string out;
+  out.reserve(size + 1024);
+  if (file_i == 0)
+    out += "int main() { return 0; }\n";
+
+  for (int fn_i=0; out.size() < size; ++fn_i) {
+    if (rnd.real() < opts.comments) {
+      out += "// ";
+      for (int i=rnd.range(4, 16); i>0; --i) {
+        out += words[rnd.range(0, int(sizeof(words)/sizeof(words[0]))-1)];
+        out.push_back(i > 1 ? ' ': '\n');
+      }
+    }
+
+    out += "int f" + std::to_string(file_i) + "_" + std::to_string(fn_i);
+    out += "(int a, int b)\n{\n";
+    const size_t end = out.size() + fn_bytes;
+    do {
+      out += "  return ";
+      gen_expr(rnd, rnd.range(0, opts.nesting), out);
+      out += ";\n";
+    } while (out.size() < end);
+    out += "}\n\n";
+  }
+  return out;
+}
+
+static bool generate_corpus(const BenchOptions& opts, Corpus& corpus)
+{
+#ifdef _WIN32
+  _mkdir(opts.corpus.c_str());
+#else
+  mkdir(opts.corpus.c_str(), 0755);
+#endif
+
+  Random rnd(opts.seed);
+  for (int i=0; i<opts.files; ++i) {
+    std::string fn = opts.corpus + "/f" + std::to_string(i) + ".cpp";
+    std::string content = gen_file(opts, rnd, i);
+
+    std::FILE* f = std::fopen(fn.c_str(), "wb");
+    if (!f) {
+      std::printf("%s: cannot write file\n", fn.c_str());
+      return false;
+    }
+    Scoped_fclose fc(f);
+    std::fwrite(content.data(), 1, content.size(), f);
+
+    corpus.files.push_back(fn);
+    corpus.bytes += content.size();
+    corpus.contents.push_back(std::move(content));
+  }
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Phases
+
+using Clock = std::chrono::high_resolution_clock;
+
+static double seconds_since(const Clock::time_point& start)
+{
+  return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// The parser stops at the first comment (it doesn't know what to do
+// with them), so the parsing phases use the tokens without comments.
+static LexData without_comments(const LexData& data)
+{
+  LexData result = data;
+  result.tokens.erase(
+    std::remove_if(result.tokens.begin(), result.tokens.end(),
+                   [](const Token& tok) { return tok.kind == TokenKind::Comment; }),
+    result.tokens.end());
+  result.comment_toks.clear();
+  return result;
+}
+
+// Visits all tokens like KeywordStats and count_lines do
+static void scan_tokens(thread_pool& pool, const Program& prog,
+                        std::atomic<uint64_t>& result)
+{
+  for (const auto& data : prog.lex_data) {
+    pool.execute(
+      [&data, &result]{
+        uint64_t keywords = 0, lines = 0;
+        int line = 0;
+        for (TokenCursor it(data); !it.at_end(); ++it) {
+          if (it->kind == TokenKind::Keyword)
+            ++keywords;
+          if (line != it->pos.line) {
+            line = it->pos.line;
+            ++lines;
+          }
+        }
+        result += keywords + lines;
+      });
+  }
+  pool.wait_all();
+}
+
+static void run_phases(const Corpus& corpus, const int nthreads,
+                       uint64_t& tokens, double secs[NumPhases],
+                       TokenMemory& memory)
+{
+  thread_pool pool(nthreads);
+  const int n = int(corpus.files.size());
+
+  // Calibrate: hashes the content of the files (already in memory),
+  // a simple loop used as a reference of the speed of the machine to
+  // compare the other phases between different machines (see
+  // tests/perf.sh)
+  auto t0 = Clock::now();
+  std::atomic<uint64_t> checksum(0);
+  for (const auto& content : corpus.contents) {
+    pool.execute(
+      [&content, &checksum]{
+        checksum ^= fnv1a(content);
+      });
+  }
+  pool.wait_all();
+  secs[Calibrate] = seconds_since(t0);
+
+  // Read
+  t0 = Clock::now();
+  std::atomic<uint64_t> readed(0);
+  for (const auto& fn : corpus.files) {
+    pool.execute(
+      [&fn, &readed]{
+        std::FILE* f = std::fopen(fn.c_str(), "rb");
+        if (!f)
+          return;
+        Scoped_fclose fc(f);
+        std::vector<char> buf(64*1024);
+        size_t bytes;
+        while ((bytes = std::fread(buf.data(), 1, buf.size(), f)) > 0)
+          readed += bytes;
+      });
+  }
+  pool.wait_all();
+  secs[Read] = seconds_since(t0);
+
+  // Lex
+  Program prog;
+  prog.lex_data.resize(n);
+  t0 = Clock::now();
+  for (int i=0; i<n; ++i) {
+    pool.execute(
+      [&corpus, &prog, i]{
+        Lexer lexer;
+        lexer.lex(corpus.files[i]);
+        prog.lex_data[i] = lexer.move_data();
+      });
+  }
+  pool.wait_all();
+  secs[Lex] = seconds_since(t0);
+
+  tokens = 0;
+  for (const auto& data : prog.lex_data)
+    tokens += data.tokens.size();
+
+  // Docs
+  Options options;
+  options.threads = nthreads;
+  t0 = Clock::now();
+  docs::run(options, pool, prog);
+  secs[Docs] = seconds_since(t0);
+
+  // Fast-parse
+  Program parse_prog;
+  parse_prog.lex_data.resize(n);
+  parse_prog.parser_data.resize(n);
+  for (int i=0; i<n; ++i)
+    parse_prog.lex_data[i] = without_comments(prog.lex_data[i]);
+
+  t0 = Clock::now();
+  for (int i=0; i<n; ++i) {
+    pool.execute(
+      [&parse_prog, i]{
+        Parser parser(i);
+        parser.parse(parse_prog.lex_data[i]);
+        parse_prog.parser_data[i] = parser.move_data();
+      });
+  }
+  pool.wait_all();
+  secs[FastParse] = seconds_since(t0);
+
+  // Body parse
+  t0 = Clock::now();
+  for (int i=0; i<n; ++i) {
+    pool.execute(
+      [&parse_prog, i]{
+        const LexData& data = parse_prog.lex_data[i];
+        Parser parser(i);
+        for (FunctionNode* f : parse_prog.parser_data[i].functions)
+          parser.parse_function_body(data, f);
+      });
+  }
+  pool.wait_all();
+  secs[BodyParse] = seconds_since(t0);
+
+  // Run
+  t0 = Clock::now();
+  run::run(options, pool, parse_prog);
+  secs[Run] = seconds_since(t0);
+
+  // Plain vs compact tokens
+  std::atomic<uint64_t> scanned(0);
+  t0 = Clock::now();
+  scan_tokens(pool, prog, scanned);
+  secs[Scan] = seconds_since(t0);
+
+  memory = TokenMemory();
+  for (const auto& data : prog.lex_data)
+    memory.plain += data.tokens.capacity() * sizeof(Token);
+
+  t0 = Clock::now();
+  for (int i=0; i<n; ++i) {
+    pool.execute(
+      [&prog, i]{
+        compress_tokens(prog.lex_data[i]);
+      });
+  }
+  pool.wait_all();
+  secs[Compress] = seconds_since(t0);
+
+  for (const auto& data : prog.lex_data)
+    memory.compact += data.compact_tokens.memory();
+
+  std::atomic<uint64_t> scanned_compact(0);
+  t0 = Clock::now();
+  scan_tokens(pool, prog, scanned_compact);
+  secs[ScanCompact] = seconds_since(t0);
+  if (scanned != scanned_compact)
+    std::printf("compact tokens: different scan results\n");
+
+  t0 = Clock::now();
+  docs::run(options, pool, prog);
+  secs[DocsCompact] = seconds_since(t0);
+
+  for (int i=0; i<n; ++i)
+    compress_tokens(parse_prog.lex_data[i]);
+  t0 = Clock::now();
+  for (int i=0; i<n; ++i) {
+    pool.execute(
+      [&parse_prog, i]{
+        Parser parser(i);
+        parser.parse(parse_prog.lex_data[i]);
+      });
+  }
+  pool.wait_all();
+  secs[FastParseCompact] = seconds_since(t0);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Report
+
+static void print_results(const Corpus& corpus,
+                          const TokenMemory& memory,
+                          const std::vector<Result>& results)
+{
+  const double mb = double(corpus.bytes) / (1024.0*1024.0);
+  std::printf("corpus: %d files, %.2f MB, %llu tokens\n",
+              int(corpus.files.size()), mb,
+              (unsigned long long)corpus.tokens);
+  std::printf("peak RSS: %ld KB\n", peak_rss_kb());
+  std::printf("tokens memory: plain %.2f MB, compact %.2f MB (%.1f%%, %.2f bytes/token)\n",
+              double(memory.plain) / (1024.0*1024.0),
+              double(memory.compact) / (1024.0*1024.0),
+              100.0 * double(memory.compact) / double(std::max<uint64_t>(memory.plain, 1)),
+              double(memory.compact) / double(std::max<uint64_t>(corpus.tokens, 1)));
+  for (const Result& r : results) {
+    std::printf("threads=%d\n", r.threads);
+    for (int p=0; p<NumPhases; ++p) {
+      const double secs = std::max(r.secs[p], 1e-9);
+      std::printf("  %-18s %10.3f ms %10.1f MB/s %14.0f tokens/s\n",
+                  phase_names[p], secs*1000.0,
+                  mb / secs, double(corpus.tokens) / secs);
+    }
+  }
+}
+
+static bool write_json(const std::string& fn,
+                       const BenchOptions& opts,
+                       const Corpus& corpus,
+                       const TokenMemory& memory,
+                       const std::vector<Result>& results)
+{
+  std::FILE* f = std::fopen(fn.c_str(), "wb");
+  if (!f) {
+    std::printf("%s: cannot write file\n", fn.c_str());
+    return false;
+  }
+  Scoped_fclose fc(f);
+
+  const double mb = double(corpus.bytes) / (1024.0*1024.0);
+  std::fprintf(f, "{\n");
+  std::fprintf(f, "  \"corpus\": {\"files\": %d, \"bytes\": %llu, \"tokens\": %llu, "
+               "\"seed\": %llu, \"minsize\": %d, \"maxsize\": %d, "
+               "\"comments\": %g, \"funcs\": %d, \"nesting\": %d},\n",
+               int(corpus.files.size()),
+               (unsigned long long)corpus.bytes,
+               (unsigned long long)corpus.tokens,
+               (unsigned long long)opts.seed,
+               opts.min_size, opts.max_size,
+               opts.comments, opts.funcs, opts.nesting);
+  std::fprintf(f, "  \"repeat\": %d,\n", opts.repeat);
+  std::fprintf(f, "  \"peak_rss_kb\": %ld,\n", peak_rss_kb());
+  std::fprintf(f, "  \"tokens_memory\": {\"plain\": %llu, \"compact\": %llu},\n",
+               (unsigned long long)memory.plain,
+               (unsigned long long)memory.compact);
+  std::fprintf(f, "  \"results\": [\n");
+  for (size_t i=0; i<results.size(); ++i) {
+    const Result& r = results[i];
+    std::fprintf(f, "    {\"threads\": %d, \"phases\": {\n", r.threads);
+    for (int p=0; p<NumPhases; ++p) {
+      const double secs = std::max(r.secs[p], 1e-9);
+      std::fprintf(f, "      \"%s\": {\"ms\": %.3f, \"mb_s\": %.3f, \"tokens_s\": %.0f}%s\n",
+                   phase_names[p], secs*1000.0,
+                   mb / secs, double(corpus.tokens) / secs,
+                   p+1 < NumPhases ? ",": "");
+    }
+    std::fprintf(f, "    }}%s\n", i+1 < results.size() ? ",": "");
+  }
+  std::fprintf(f, "  ]\n}\n");
+  return true;
+}
+
+//////////////////////////////////////////////////////////////////////
+
+static void parse_threads(const char* arg, std::vector<int>& threads)
+{
+  threads.clear();
+  for (const char* p=arg; *p; ) {
+    int n = std::atoi(p);
+    if (n > 0)
+      threads.push_back(n);
+    p = std::strchr(p, ',');
+    if (!p)
+      break;
+    ++p;
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  BenchOptions opts;
+
+  for (int i=1; i<argc; ++i) {
+    if (i+1 >= argc) {
+      std::printf("%s: missing argument\n", argv[i]);
+      return 1;
+    }
+    else if (std::strcmp(argv[i], "-files") == 0)
+      opts.files = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "-minsize") == 0)
+      opts.min_size = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "-maxsize") == 0)
+      opts.max_size = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "-comments") == 0)
+      opts.comments = std::atof(argv[++i]);
+    else if (std::strcmp(argv[i], "-funcs") == 0)
+      opts.funcs = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "-nesting") == 0)
+      opts.nesting = std::atoi(argv[++i]);
+    else if (std::strcmp(argv[i], "-seed") == 0)
+      opts.seed = std::strtoull(argv[++i], nullptr, 10);
+    else if (std::strcmp(argv[i], "-threads") == 0)
+      parse_threads(argv[++i], opts.threads);
+    else if (std::strcmp(argv[i], "-repeat") == 0)
+      opts.repeat = std::max(1, std::atoi(argv[++i]));
+    else if (std::strcmp(argv[i], "-corpus") == 0)
+      opts.corpus = argv[++i];
+    else if (std::strcmp(argv[i], "-json") == 0)
+      opts.json = argv[++i];
+    else {
+      std::printf("%s: unknown option\n", argv[i]);
+      return 1;
+    }
+  }
+
+  if (opts.threads.empty()) {
+    const int hw = std::max(1, int(std::thread::hardware_concurrency()));
+    for (int n=1; n<hw; n*=2)
+      opts.threads.push_back(n);
+    opts.threads.push_back(hw);
+  }
+
+  create_keyword_tables();
+
+  Corpus corpus;
+  if (!generate_corpus(opts, corpus))
+    return 1;
+
+  // The best time of each phase for each number of threads
+  std::vector<Result> results;
+  TokenMemory memory;
+  for (int nthreads : opts.threads) {
+    Result r;
+    r.threads = nthreads;
+    std::fill(r.secs, r.secs+NumPhases, 1e9);
+    for (int k=0; k<opts.repeat; ++k) {
+      double secs[NumPhases];
+      run_phases(corpus, nthreads, corpus.tokens, secs, memory);
+      for (int p=0; p<NumPhases; ++p)
+        r.secs[p] = std::min(r.secs[p], secs[p]);
+    }
+    results.push_back(r);
+  }
+
+  print_results(corpus, memory, results);
+  if (!opts.json.empty() &&
+      !write_json(opts.json, opts, corpus, memory, results))
+    return 1;
+  return 0;
+}
@@ -3,168 +3,361 @@
 // This file is released under the terms of the MIT license.
 // Read LICENSE.txt for more information.
 
+#include "cppillr/ctok.h"
+#include "cppillr/depindex.h"
 #include "cppillr/docs.h"
+#include "cppillr/docs_index.h"
+#include "cppillr/find.h"
+#include "cppillr/includes.h"
 #include "cppillr/keywords.h"
 #include "cppillr/options.h"
+#include "cppillr/preprocessor.h"
 #include "cppillr/program.h"
 #include "cppillr/run.h"
-#include "utils/stopwatch.h"
+#include "cppillr/serve.h"
+#include "cppillr/stats.h"
+#include "cppillr/token_cursor.h"
+#include "cppillr/token_index.h"
+#include "cppillr/watch.h"
+#include "utils/alloc_profile.h"
+#include "utils/out_buffer.h"
+#include "utils/perf_counters.h"
 #include "utils/thread_pool.h"
+#include "utils/timers.h"
+#include "utils/trace.h"
 
+#include <condition_variable>
 #include <cstring>
 #include <fstream>
+#include <functional>
+#include <mutex>
 
 //////////////////////////////////////////////////////////////////////
 // tools
 
-void show_tokens(const LexData& data)
+// Formats the tokens of the given file in "out" (without allocating
+// memory for each token, so several files can be formatted in
+// parallel)
+void format_tokens(const LexData& data, OutBuffer& out)
 {
-  std::printf("%s: tokens=%d\n",
-              data.fn.c_str(),
-              int(data.tokens.size()));
-
-  int i = 0;
-  for (auto& tok : data.tokens) {
-    std::printf("%s:%d:%d: [%d] ",
-                data.fn.c_str(),
-                tok.pos.line, tok.pos.col, i);
+  // Approximated size of the output to avoid reallocations
+  out.reserve(out.size() +
+              data.ntokens() * (data.fn.size() + 24) +
+              data.ids.size() + data.comments.size());
+
+  out.write(data.fn);
+  out.write(": tokens=");
+  out.write_int(data.ntokens());
+  out.put('\n');
+
+  for (TokenCursor it(data); !it.at_end(); ++it) {
+    const Token& tok = *it;
+    out.write(data.fn);
+    out.put(':');
+    out.write_int(tok.pos.line);
+    out.put(':');
+    out.write_int(tok.pos.col);
+    out.write(": [");
+    out.write_int(it.index());
+    out.write("] ");
     switch (tok.kind) {
       case TokenKind::PPBegin:
-        std::printf("PP { \n");
+        out.write("PP { \n");
         break;
       case TokenKind::PPKeyword:
-        std::printf("PPKEY %s\n", pp_keywords_id[tok.i].c_str());
+        out.write("PPKEY ");
+        out.write(pp_keywords_id[tok.i]);
+        out.put('\n');
         break;
       case TokenKind::PPHeaderName:
-        std::printf("PP.H ");
-        for (int i=tok.i; i<tok.j; ++i)
-          std::putc(data.ids[i], stdout);
-        std::putc('\n', stdout);
+        out.write("PP.H ");
+        out.write(&data.ids[0]+tok.i, &data.ids[0]+tok.j);
+        out.put('\n');
         break;
       case TokenKind::PPEnd:
-        std::printf("} PP\n");
+        out.write("} PP\n");
         break;
       case TokenKind::Comment:
-        std::printf("COMMENT ");
-        for (int i=tok.i; i<tok.j; ++i)
-          std::putc(data.comments[i], stdout);
-        std::putc('\n', stdout);
+        out.write("COMMENT ");
+        out.write(&data.comments[0]+tok.i, &data.comments[0]+tok.j);
+        out.put('\n');
         break;
       case TokenKind::Identifier:
-        std::printf("ID ");
-        for (int i=tok.i; i<tok.j; ++i)
-          std::putc(data.ids[i], stdout);
-        std::putc('\n', stdout);
+        out.write("ID ");
+        out.write(&data.ids[0]+tok.i, &data.ids[0]+tok.j);
+        out.put('\n');
         break;
       case TokenKind::Literal:
-        std::printf("LIT ");
-        for (int i=tok.i; i<tok.j; ++i)
-          std::putc(data.ids[i], stdout);
-        std::putc('\n', stdout);
+        out.write("LIT ");
+        out.write(&data.ids[0]+tok.i, &data.ids[0]+tok.j);
+        out.put('\n');
         break;
       case TokenKind::CharConstant:
-        std::printf("CHR ");
-        for (int i=tok.i; i<tok.j; ++i)
-          std::putc(data.ids[i], stdout);
-        std::putc('\n', stdout);
+        out.write("CHR ");
+        out.write(&data.ids[0]+tok.i, &data.ids[0]+tok.j);
+        out.put('\n');
         break;
       case TokenKind::NumericConstant:
-        std::printf("NUM ");
-        for (int i=tok.i; i<tok.j; ++i)
-          std::putc(data.ids[i], stdout);
-        std::putc('\n', stdout);
+        out.write("NUM ");
+        out.write(&data.ids[0]+tok.i, &data.ids[0]+tok.j);
+        out.put('\n');
         break;
       case TokenKind::Keyword:
-        std::printf("KEY %s\n", keywords_id[tok.i].c_str());
+        out.write("KEY ");
+        out.write(keywords_id[tok.i]);
+        out.put('\n');
         break;
       case TokenKind::Punctuator:
+        out.write("OP ");
+        out.put((char)tok.i);
         if (tok.j)
-          std::printf("OP %c%c\n", (char)tok.i, (char)tok.j);
-        else
-          std::printf("OP %c\n", (char)tok.i);
+          out.put((char)tok.j);
+        out.put('\n');
         break;
     }
-    ++i;
   }
 }
 
+static const char* token_kind_name(TokenKind kind)
+{
+  switch (kind) {
+    case TokenKind::PPBegin:         return "pp_begin";
+    case TokenKind::PPKeyword:       return "pp_keyword";
+    case TokenKind::PPHeaderName:    return "pp_header_name";
+    case TokenKind::PPEnd:           return "pp_end";
+    case TokenKind::Comment:         return "comment";
+    case TokenKind::Identifier:      return "identifier";
+    case TokenKind::Keyword:         return "keyword";
+    case TokenKind::CharConstant:    return "char";
+    case TokenKind::Literal:         return "literal";
+    case TokenKind::NumericConstant: return "number";
+    case TokenKind::Punctuator:      return "punctuator";
+    case TokenKind::Eof:             return "eof";
+  }
+  return "";
+}
+
+// Same as format_tokens() but with one JSON object per line for each
+// token, e.g.
+// {"type":"token","file":"a.cpp","line":1,"col":3,"index":0,"kind":"identifier","text":"a"}
+void format_tokens_jsonl(const LexData& data, OutBuffer& out)
+{
+  out.reserve(out.size() +
+              data.ntokens() * (data.fn.size() + 80) +
+              data.ids.size() + data.comments.size());
+
+  for (TokenCursor it(data); !it.at_end(); ++it) {
+    const Token& tok = *it;
+    out.write("{\"type\":\"token\",\"file\":");
+    out.write_json_string(data.fn);
+    out.write(",\"line\":");
+    out.write_int(tok.pos.line);
+    out.write(",\"col\":");
+    out.write_int(tok.pos.col);
+    out.write(",\"index\":");
+    out.write_int(it.index());
+    out.write(",\"kind\":\"");
+    out.write(token_kind_name(tok.kind));
+    out.put('"');
+    switch (tok.kind) {
+      case TokenKind::PPKeyword:
+        out.write(",\"text\":");
+        out.write_json_string(pp_keywords_id[tok.i]);
+        break;
+      case TokenKind::Comment:
+        out.write(",\"text\":");
+        out.write_json_string(&data.comments[0]+tok.i, &data.comments[0]+tok.j);
+        break;
+      case TokenKind::PPHeaderName:
+      case TokenKind::Identifier:
+      case TokenKind::Literal:
+      case TokenKind::CharConstant:
+      case TokenKind::NumericConstant:
+        out.write(",\"text\":");
+        out.write_json_string(&data.ids[0]+tok.i, &data.ids[0]+tok.j);
+        break;
+      case TokenKind::Keyword:
+        out.write(",\"text\":");
+        out.write_json_string(keywords_id[tok.i]);
+        break;
+      case TokenKind::Punctuator: {
+        const char op[2] = { (char)tok.i, (char)tok.j };
+        out.write(",\"text\":");
+        out.write_json_string(op, op + (tok.j ? 2: 1));
+        break;
+      }
+    }
+    out.write("}\n");
+  }
+}
+
+// Formats n elements in parallel (one task per element), and writes
+// them to stdout in order as soon as each one is ready.
+void write_in_order(thread_pool& pool, const int n,
+                    const std::function<void(int, OutBuffer&)>& format)
+{
+  std::vector<OutBuffer> outs(n);
+  std::vector<bool> ready(n, false);
+  std::mutex mutex;
+  std::condition_variable cv;
+
+  for (int i=0; i<n; ++i) {
+    ALLOC_TAG("write task");
+    pool.execute(
+      [i, &format, &outs, &ready, &mutex, &cv]{
+        format(i, outs[i]);
+        std::unique_lock<std::mutex> lock(mutex);
+        ready[i] = true;
+        cv.notify_all();
+      });
+  }
+
+  std::fflush(stdout);
+  for (int i=0; i<n; ++i) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [i, &ready]{ return ready[i]; });
+    }
+    outs[i].flush(stdout);
+    outs[i] = OutBuffer();      // Free memory
+  }
+  pool.wait_all();
+}
+
+void show_tokens(const Options& options,
+                 thread_pool& pool,
+                 const Program& prog)
+{
+  const std::vector<const LexData*> files =
+    in_input_order(options.parse_files, prog.lex_data);
+  const bool jsonl = options.jsonl();
+  write_in_order(
+    pool, int(files.size()),
+    [&files, jsonl](int i, OutBuffer& out){
+      if (jsonl)
+        format_tokens_jsonl(*files[i], out);
+      else
+        format_tokens(*files[i], out);
+    });
+}
+
 struct PPIf {
   std::string id;
   bool def;
 };
 
-void show_includes(const LexData& data)
+// Calls f(tok, stack) for each #include of the file, where "tok" is
+// the PPHeaderName token and "stack" the #if conditions where the
+// #include is.
+template<typename F>
+void for_each_include(const LexData& data, F&& f)
 {
   std::vector<PPIf> stack;
 
-  std::printf("%s: includes\n",
-              data.fn.c_str());
-
-  for (int i=0; i+2<int(data.tokens.size()); ++i) {
-    if (data.tokens[i].kind == TokenKind::PPBegin &&
-        data.tokens[i+1].kind == TokenKind::PPKeyword) {
-      if (data.tokens[i+1].i == pp_key_if ||
-          data.tokens[i+1].i == pp_key_ifdef ||
-          data.tokens[i+1].i == pp_key_ifndef) {
-        PPIf ppif;
-        switch (data.tokens[i+1].i) {
-          case pp_key_if: {
-            bool first = false;
-            ppif.id = "#if (";
-            for (i+=2; i<int(data.tokens.size()) &&
-                   data.tokens[i].kind != TokenKind::PPEnd; ++i) {
-              if (data.tokens[i].kind == TokenKind::Identifier ||
-                  data.tokens[i].kind == TokenKind::Literal) {
-                std::string lit(data.ids.begin()+data.tokens[i].i,
-                                data.ids.begin()+data.tokens[i].j);
-                if (first)
-                  first = false;
-                else
-                  ppif.id.push_back(' ');
-                ppif.id += lit;
-              }
+  const int n = data.ntokens();
+  for (TokenCursor it(data); it.index()+2 < n; ++it) {
+    if (it->kind != TokenKind::PPBegin)
+      continue;
+    TokenCursor key(it);
+    ++key;
+    if (key->kind != TokenKind::PPKeyword)
+      continue;
+    TokenCursor arg(key);
+    ++arg;
+
+    if (key->i == pp_key_if ||
+        key->i == pp_key_ifdef ||
+        key->i == pp_key_ifndef) {
+      PPIf ppif;
+      switch (key->i) {
+        case pp_key_if: {
+          bool first = false;
+          ppif.id = "#if (";
+          for (it = arg; !it.at_end() &&
+                 it->kind != TokenKind::PPEnd; ++it) {
+            if (it->kind == TokenKind::Identifier ||
+                it->kind == TokenKind::Literal) {
+              std::string lit(data.id_text(*it));
+              if (first)
+                first = false;
+              else
+                ppif.id.push_back(' ');
+              ppif.id += lit;
             }
-            ppif.id += ")";
-            ppif.def = true;
-            break;
-          }
-          case pp_key_ifndef:
-          case pp_key_ifdef: {
-            std::string id(data.ids.begin()+data.tokens[i+2].i,
-                           data.ids.begin()+data.tokens[i+2].j);
-            ppif.id = id;
-            ppif.def = (data.tokens[i+1].i == pp_key_ifdef);
-            break;
           }
+          ppif.id += ")";
+          ppif.def = true;
+          break;
         }
-        stack.push_back(ppif);
-      }
-      else if (data.tokens[i+1].i == pp_key_endif) {
-        if (!stack.empty())
-          stack.erase(--stack.end());
-      }
-      else if (data.tokens[i+1].i == pp_key_include &&
-               data.tokens[i+2].kind == TokenKind::PPHeaderName) {
-        std::string str(data.ids.begin()+data.tokens[i+2].i,
-                        data.ids.begin()+data.tokens[i+2].j);
-        std::printf("  %s", str.c_str());
-        if (!stack.empty()) {
-          std::printf(" (");
-          for (int i=0; i<int(stack.size()); ++i) {
-            if (i > 0)
-              std::printf(" && ");
-            std::printf("%s%s",
-                        stack[i].def ? "": "!",
-                        stack[i].id.c_str());
-          }
-          std::printf(")");
+        case pp_key_ifndef:
+        case pp_key_ifdef: {
+          ppif.id = data.id_text(*arg);
+          ppif.def = (key->i == pp_key_ifdef);
+          break;
         }
-        std::printf("\n");
       }
+      stack.push_back(ppif);
+    }
+    else if (key->i == pp_key_endif) {
+      if (!stack.empty())
+        stack.erase(--stack.end());
+    }
+    else if (key->i == pp_key_include &&
+             arg->kind == TokenKind::PPHeaderName) {
+      f(*arg, stack);
     }
   }
 }
 
+// Returns the #if conditions of the stack as a text, e.g. "A && !B"
+std::string includes_condition(const std::vector<PPIf>& stack)
+{
+  std::string cond;
+  for (int i=0; i<int(stack.size()); ++i) {
+    if (i > 0)
+      cond += " && ";
+    if (!stack[i].def)
+      cond += "!";
+    cond += stack[i].id;
+  }
+  return cond;
+}
+
+void show_includes(const LexData& data)
+{
+  std::printf("%s: includes\n",
+              data.fn.c_str());
+
+  for_each_include(
+    data,
+    [&data](const Token& tok, const std::vector<PPIf>& stack){
+      std::string str(data.ids.begin()+tok.i,
+                      data.ids.begin()+tok.j);
+      std::printf("  %s", str.c_str());
+      if (!stack.empty())
+        std::printf(" (%s)", includes_condition(stack).c_str());
+      std::printf("\n");
+    });
+}
+
+// {"type":"include","file":"a.cpp","line":1,"header":"<vector>","condition":""}
+void format_includes_jsonl(const LexData& data, OutBuffer& out)
+{
+  for_each_include(
+    data,
+    [&data, &out](const Token& tok, const std::vector<PPIf>& stack){
+      out.write("{\"type\":\"include\",\"file\":");
+      out.write_json_string(data.fn);
+      out.write(",\"line\":");
+      out.write_int(tok.pos.line);
+      out.write(",\"header\":");
+      out.write_json_string(&data.ids[0]+tok.i, &data.ids[0]+tok.j);
+      out.write(",\"condition\":");
+      out.write_json_string(stack.empty() ? std::string(): includes_condition(stack));
+      out.write("}\n");
+    });
+}
+
 void show_ast_node(Node* n, int indent)
 {
   for (int i=0; i<indent; ++i)
@@ -247,43 +440,38 @@ void show_functions(const ParserData& data,
   }
 }
 
-
-int count_lines(const LexData& data)
+// {"type":"function","file":"a.cpp","name":"f","return_type":"int",
+//  "body_tokens":[10,20],"params":[{"type":"int","name":"a"}]}
+void format_functions_jsonl(const ParserData& data, OutBuffer& out)
 {
-  int nlines = 0;
-  int line = 0;
-  for (auto& tok : data.tokens) {
-    if (line != tok.pos.line) {
-      line = tok.pos.line;
-      ++nlines;
+  for (FunctionNode* f : data.functions) {
+    out.write("{\"type\":\"function\",\"file\":");
+    out.write_json_string(data.fn);
+    out.write(",\"name\":");
+    out.write_json_string(f->name);
+    out.write(",\"return_type\":");
+    out.write_json_string(keywords_id[f->builtin_type]);
+    out.write(",\"body_tokens\":[");
+    out.write_int(f->body->beg_tok);
+    out.put(',');
+    out.write_int(f->body->end_tok);
+    out.write("],\"params\":[");
+    bool first = true;
+    for (ParamNode* p : f->params->params) {
+      if (first)
+        first = false;
+      else
+        out.put(',');
+      out.write("{\"type\":");
+      out.write_json_string(keywords_id[p->builtin_type]);
+      out.write(",\"name\":");
+      out.write_json_string(p->name);
+      out.put('}');
     }
+    out.write("]}\n");
   }
-  return nlines;
 }
 
-//////////////////////////////////////////////////////////////////////
-// KeywordStats
-
-class KeywordStats {
-  std::array<size_t, MaxKeyword> keywords;
-public:
-  KeywordStats() { keywords.fill(0); }
-
-  void add(const LexData& data) {
-    for (auto& tok : data.tokens) {
-      if (tok.kind == TokenKind::Keyword)
-        ++keywords[tok.i];
-    }
-  }
-
-  void print() {
-    for (int i=0; i<int(MaxKeyword); ++i) {
-      if (keywords[i] > 0)
-        std::printf("%d\t%s\n", keywords[i], keywords_id[i].c_str());
-    }
-  }
-};
-
 //////////////////////////////////////////////////////////////////////
 // main
 
@@ -294,6 +482,11 @@ bool parse_options(int argc, char* argv[], Options& options)
     if (argv[i][0] != '-') {
       if (options.command.empty())
         options.command = argv[i];
+      // The first argument of "find"/"index-query" is the pattern
+      else if ((options.command == "find" ||
+                options.command == "index-query") &&
+               options.pattern.empty())
+        options.pattern = argv[i];
       else
         options.parse_files.push_back(argv[i]);
       continue;
@@ -317,15 +510,85 @@ bool parse_options(int argc, char* argv[], Options& options)
         }
       }
     }
+    else if (std::strcmp(argv[i], "-I") == 0) {
+      ++i;
+      if (i < argc) {
+        options.include_paths.push_back(argv[i]);
+      }
+    }
+    else if (std::strncmp(argv[i], "-I", 2) == 0) {
+      options.include_paths.push_back(argv[i]+2);
+    }
+    else if (std::strcmp(argv[i], "-isystem") == 0) {
+      ++i;
+      if (i < argc) {
+        options.system_include_paths.push_back(argv[i]);
+      }
+    }
+    else if (std::strcmp(argv[i], "-D") == 0) {
+      ++i;
+      if (i < argc) {
+        options.macros.add_define_arg(argv[i]);
+        options.macros.enabled = true;
+      }
+    }
+    else if (std::strncmp(argv[i], "-D", 2) == 0) {
+      options.macros.add_define_arg(argv[i]+2);
+      options.macros.enabled = true;
+    }
+    else if (std::strcmp(argv[i], "-U") == 0) {
+      ++i;
+      if (i < argc) {
+        options.macros.undef(argv[i]);
+        options.macros.enabled = true;
+      }
+    }
+    else if (std::strncmp(argv[i], "-U", 2) == 0) {
+      options.macros.undef(argv[i]+2);
+      options.macros.enabled = true;
+    }
+    else if (std::strcmp(argv[i], "-skipdisabled") == 0) {
+      options.macros.enabled = true;
+    }
+    else if (std::strcmp(argv[i], "-preprocess") == 0) {
+      options.preprocess = true;
+    }
     else if (std::strcmp(argv[i], "-print") == 0) {
       ++i;
       if (i < argc) {
         options.print = argv[i];
       }
     }
+    else if (std::strcmp(argv[i], "-doccache") == 0) {
+      ++i;
+      if (i < argc) {
+        options.docs_cache = argv[i];
+      }
+    }
+    else if (std::strcmp(argv[i], "-index") == 0) {
+      ++i;
+      if (i < argc) {
+        options.docs_index = argv[i];
+      }
+    }
+    else if (std::strcmp(argv[i], "-depindex") == 0) {
+      ++i;
+      if (i < argc) {
+        options.dep_index = argv[i];
+      }
+    }
+    else if (std::strcmp(argv[i], "-tokindex") == 0) {
+      ++i;
+      if (i < argc) {
+        options.token_index = argv[i];
+      }
+    }
     else if (std::strcmp(argv[i], "-showtime") == 0) {
       options.show_time = true;
     }
+    else if (std::strcmp(argv[i], "-compacttokens") == 0) {
+      options.compact_tokens = true;
+    }
     else if (std::strcmp(argv[i], "-showtokens") == 0) {
       options.show_tokens = true;
     }
@@ -353,6 +616,49 @@ bool parse_options(int argc, char* argv[], Options& options)
         options.threads = std::strtol(argv[i], nullptr, 10);
       }
     }
+    else if (std::strcmp(argv[i], "-showcounters") == 0) {
+      options.show_counters = true;
+    }
+    else if (std::strcmp(argv[i], "-showpool") == 0) {
+      options.show_pool = true;
+    }
+    else if (std::strcmp(argv[i], "-format") == 0) {
+      ++i;
+      if (i < argc) {
+        options.format = argv[i];
+        if (options.format != "text" &&
+            options.format != "jsonl") {
+          std::printf("%s: invalid format %s (use text or jsonl)\n",
+                      argv[0], argv[i]);
+          return false;
+        }
+      }
+    }
+    else if (std::strcmp(argv[i], "-dumptokens") == 0) {
+      ++i;
+      if (i < argc) {
+        options.dump_tokens = argv[i];
+      }
+    }
+    else if (std::strcmp(argv[i], "-socket") == 0 ||
+             std::strcmp(argv[i], "--socket") == 0) {
+      ++i;
+      if (i < argc) {
+        options.socket = argv[i];
+      }
+    }
+    else if (std::strcmp(argv[i], "-trace") == 0) {
+      ++i;
+      if (i < argc) {
+        options.trace = argv[i];
+      }
+    }
+    else if (std::strcmp(argv[i], "-top") == 0) {
+      ++i;
+      if (i < argc) {
+        options.top = std::strtol(argv[i], nullptr, 10);
+      }
+    }
     else if (std::strcmp(argv[i], "--") == 0) {
       ++i;
       options.parse_files.push_back(std::string()); // parse stdin
@@ -365,49 +671,118 @@ bool parse_options(int argc, char* argv[], Options& options)
   return true;
 }
 
-int run_with_options(const Options& options)
+int run_with_options(const Options& options, thread_pool& pool)
 {
-  std::printf("running command \"%s\"\n", options.command.c_str());
+  // JSON Lines output contains only JSON objects
+  if (!options.jsonl())
+    std::printf("running command \"%s\"\n", options.command.c_str());
   int ret_value = 0;
 
-  Stopwatch t;
-  thread_pool pool(options.threads);
   Program prog;
 
-  for (const auto& fn : options.parse_files) {
-    pool.execute(
-      [&pool, fn, &prog]{
-        Lexer lexer;
-        lexer.lex(fn);
-
-        int i = prog.add_lex(lexer.move_data());
-
-        pool.execute(
-          [i, &prog]{
-            LexData data;
-            prog.get_lex(i, data);
-
-            Parser parser(i);
-            parser.parse(data);
-
-            prog.add_parser_data(parser.move_data());
-          });
-      });
+  // Queries don't need to lex the input, the given "files" are the
+  // terms to search in the index
+  if (options.command == "docs-query")
+    return docs::query(options);
+  else if (options.command == "dependents")
+    return depindex::query(options);
+  // The dependencies index lexes only the modified files
+  else if (options.command == "depindex")
+    return depindex::build(options, pool);
+  // The server keeps its own Program updated between requests
+  else if (options.command == "serve")
+    return serve::run(options, pool);
+  // Watch mode keeps only the stats of each file between updates
+  else if (options.command == "watch")
+    return watch::run(options, pool);
+  // Pattern search lexes (only the candidate files) and matches
+  // each file in the same task
+  else if (options.command == "find")
+    return find::run(options, pool);
+  // The token index lexes only the modified files, and its queries
+  // use the tokens stored in the index
+  else if (options.command == "index")
+    return tokindex::build(options, pool);
+  else if (options.command == "index-query")
+    return tokindex::query(options, pool);
+
+  // Incremental docs generation lexes only the modified files
+  if (options.command == "docs" && !options.docs_cache.empty()) {
+    timers::Scope timer_command("command");
+    docs::run_incremental(options, pool);
+    return ret_value;
   }
-  pool.wait_all();
 
-  if (options.show_time)
-    t.watch("parse files");
+  {
+    timers::Scope timer_files("parse files");
+    trace::Scope trace_files("parse files");
+    for (const auto& fn : options.parse_files) {
+      const int64_t queued = trace::queued();
+      ALLOC_TAG("lex task");
+      pool.execute(
+        [&options, &pool, fn, &prog, queued]{
+          timers::Scope timer_lex("lex", &fn);
+          trace::Scope trace_lex("lex", fn, queued);
+          perf::Scope perf_lex(perf::Lex);
+          ALLOC_PHASE(alloc::Lex);
+          Lexer lexer(options.lexer_macros());
+          lexer.lex(fn);
+
+          LexData lex_data = lexer.move_data();
+          if (options.preprocess) {
+            timers::Scope timer_pp("preprocess");
+            Preprocessor pp(&options.macros);
+            pp.process(lex_data);
+          }
+          if (options.compact_tokens)
+            compress_tokens(lex_data);
+          const int bytes = lex_data.readed_bytes;
+          trace_lex.set_bytes(bytes);
+          int i = prog.add_lex(std::move(lex_data));
+
+          const int64_t parse_queued = trace::queued();
+          ALLOC_TAG("parse task");
+          pool.execute(
+            [i, &prog, fn, bytes, parse_queued]{
+              timers::Scope timer_parse("parse", &fn);
+              trace::Scope trace_parse("parse", fn, parse_queued);
+              trace_parse.set_bytes(bytes);
+              perf::Scope perf_parse(perf::Parse);
+              ALLOC_PHASE(alloc::Parse);
+
+              LexData data;
+              prog.get_lex(i, data);
+
+              Parser parser(i);
+              parser.parse(data);
+
+              prog.add_parser_data(parser.move_data());
+            });
+        });
+    }
+    pool.wait_all();
+  }
 
-  if (options.command == "docs")
+  timers::Scope timer_command("command");
+  perf::Scope perf_analysis(perf::Analysis);
+  ALLOC_PHASE(alloc::Analysis);
+  if (options.command == "docs") {
+    trace::Scope trace_docs("generate docs");
     docs::run(options, pool, prog);
-  else if (options.command == "run")
+  }
+  else if (options.command == "run") {
+    trace::Scope trace_run("run");
     ret_value = run::run(options, pool, prog);
+  }
+  else if (options.command == "includes")
+    ret_value = includes::run(options, pool, prog);
+  else if (options.command == "includecost")
+    ret_value = includes::run_cost(options, pool, prog);
 
   if (options.count_tokens) {
     int total_tokens = 0;
     for (auto& data : prog.lex_data)
-      total_tokens += data.tokens.size();
+      total_tokens += data.ntokens();
 
     std::printf("total tokens %d\n", total_tokens);
   }
@@ -428,9 +803,13 @@ int run_with_options(const Options& options)
     keyword_stats.print();
   }
 
-  if (options.show_tokens) {
-    for (auto& data : prog.lex_data)
-      show_tokens(data);
+  if (options.show_tokens)
+    show_tokens(options, pool, prog);
+
+  if (!options.dump_tokens.empty() &&
+      !write_ctok(options.dump_tokens, in_input_order(options.parse_files, prog.lex_data))) {
+    std::printf("%s: cannot write tokens file\n", options.dump_tokens.c_str());
+    ret_value = 1;
   }
 
   if (options.show_ast) {
@@ -439,13 +818,33 @@ int run_with_options(const Options& options)
   }
 
   if (options.show_includes) {
-    for (auto& data : prog.lex_data)
-      show_includes(data);
+    if (options.jsonl()) {
+      const std::vector<const LexData*> files =
+        in_input_order(options.parse_files, prog.lex_data);
+      write_in_order(pool, int(files.size()),
+                     [&files](int i, OutBuffer& out){
+                       format_includes_jsonl(*files[i], out);
+                     });
+    }
+    else {
+      for (auto& data : prog.lex_data)
+        show_includes(data);
+    }
   }
 
   if (options.show_functions) {
-    for (const auto& data : prog.parser_data)
-      show_functions(data, options.show_tokens);
+    if (options.jsonl()) {
+      const std::vector<const ParserData*> files =
+        in_input_order(options.parse_files, prog.parser_data);
+      write_in_order(pool, int(files.size()),
+                     [&files](int i, OutBuffer& out){
+                       format_functions_jsonl(*files[i], out);
+                     });
+    }
+    else {
+      for (const auto& data : prog.parser_data)
+        show_functions(data, options.show_tokens);
+    }
   }
 
   return ret_value;
@@ -463,6 +862,38 @@ int main(int argc, char* argv[])
   if (!parse_options(argc, argv, options))
     return 0;
 
+  if (!options.trace.empty()) {
+    trace::Tracer& tracer = trace::Tracer::instance();
+    tracer.enabled = true;
+    tracer.buffer();            // The main thread is the first one
+  }
+
+  if (options.show_counters)
+    perf::Counters::instance().init();
+  if (options.show_time)
+    timers::Timers::instance().enable();
+
   create_keyword_tables();
-  return run_with_options(options);
+  thread_pool pool(options.threads, options.show_pool);
+  int ret_value = run_with_options(options, pool);
+
+  if (options.show_time)
+    timers::Timers::instance().print(options.top > 0 ? options.top: 5);
+  if (options.show_counters)
+    perf::Counters::instance().print();
+  if (options.show_pool)
+    pool.print_metrics();
+
+#ifdef CPPILLR_ALLOC_PROFILE
+  alloc::print();
+#endif
+#ifdef CPPILLR_LEXER_STATS
+  LexerStats::print();
+#endif
+
+  if (!options.trace.empty() &&
+      !trace::Tracer::instance().write(options.trace)) {
+    std::printf("%s: cannot write trace file\n", options.trace.c_str());
+  }
+  return ret_value;
 }
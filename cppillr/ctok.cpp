@@ -0,0 +1,136 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/ctok.h"
+
+#include "cppillr/keywords.h"
+#include "cppillr/lexer.h"
+#include "cppillr/token_cursor.h"
+#include "utils/scoped_fclose.h"
+
+#include <cstdio>
+
+static_assert(int(TokenKind::Eof) == ctok_eof,
+              "CtokKind must have the same values as TokenKind");
+static_assert(sizeof(CtokFileEntry) % 8 == 0,
+              "CtokFileEntry must keep the alignment of uint64_t");
+
+namespace {
+
+uint64_t align8(uint64_t offset)
+{
+  return (offset + 7) & ~uint64_t(7);
+}
+
+void write_padding(std::FILE* f, uint64_t from, uint64_t to)
+{
+  static const uint8_t zeros[8] = { 0 };
+  if (to > from)
+    std::fwrite(zeros, 1, to - from, f);
+}
+
+} // anonymous namespace
+
+bool write_ctok(const std::string& fn,
+                const std::vector<const LexData*>& files)
+{
+  std::string strings(1, '\0');    // Offset 0 is the empty string
+  auto add_string = [&strings](const std::string& s) -> uint32_t {
+    if (s.empty())
+      return 0;
+    uint32_t offset = uint32_t(strings.size());
+    strings += s;
+    strings.push_back(0);
+    return offset;
+  };
+
+  std::vector<uint32_t> keywords;
+  for (const auto& id : keywords_id)
+    keywords.push_back(add_string(id));
+  for (const auto& id : pp_keywords_id)
+    keywords.push_back(add_string(id));
+
+  std::vector<CtokFileEntry> entries(files.size());
+  uint64_t ntokens = 0, ids_size = 0, comments_size = 0;
+  for (std::size_t i=0; i<files.size(); ++i) {
+    const LexData* data = files[i];
+    CtokFileEntry& e = entries[i];
+    e.first_token = ntokens;
+    e.ids = ids_size;
+    e.comments = comments_size;
+    e.ntokens = uint32_t(data->ntokens());
+    e.ids_size = uint32_t(data->ids.size());
+    e.comments_size = uint32_t(data->comments.size());
+    e.fn = add_string(data->fn);
+    e.include_guard = add_string(data->include_guard);
+    e.readed_bytes = uint32_t(data->readed_bytes);
+    e.flags = (data->pragma_once ? ctok_pragma_once: 0);
+    e.reserved = 0;
+
+    ntokens += e.ntokens;
+    ids_size += e.ids_size;
+    comments_size += e.comments_size;
+  }
+
+  CtokHeader h;
+  h.magic = ctok_magic;
+  h.version = ctok_version;
+  h.nfiles = uint32_t(files.size());
+  h.nkeywords = uint32_t(keywords_id.size());
+  h.npp_keywords = uint32_t(pp_keywords_id.size());
+  h.reserved = 0;
+  h.ntokens = ntokens;
+  h.files_offset = align8(sizeof(CtokHeader));
+  h.keywords_offset = align8(h.files_offset + files.size()*sizeof(CtokFileEntry));
+  h.tokens_offset = align8(h.keywords_offset + keywords.size()*4);
+  h.ids_offset = align8(h.tokens_offset + ntokens*sizeof(CtokToken));
+  h.ids_size = ids_size;
+  h.comments_offset = align8(h.ids_offset + ids_size);
+  h.comments_size = comments_size;
+  h.strings_offset = align8(h.comments_offset + comments_size);
+  h.strings_size = strings.size();
+
+  std::FILE* f = std::fopen(fn.c_str(), "wb");
+  if (!f)
+    return false;
+  Scoped_fclose fc(f);
+
+  std::fwrite(&h, sizeof(h), 1, f);
+  write_padding(f, sizeof(h), h.files_offset);
+  std::fwrite(entries.data(), sizeof(CtokFileEntry), entries.size(), f);
+  write_padding(f, h.files_offset + entries.size()*sizeof(CtokFileEntry),
+                h.keywords_offset);
+  std::fwrite(keywords.data(), 4, keywords.size(), f);
+  write_padding(f, h.keywords_offset + keywords.size()*4, h.tokens_offset);
+
+  // Tokens are converted in chunks to write them with few fwrite()s
+  std::vector<CtokToken> chunk;
+  chunk.reserve(4096);
+  for (const LexData* data : files) {
+    for (TokenCursor it(*data); !it.at_end(); ++it) {
+      const Token& tok = *it;
+      chunk.push_back(CtokToken{ uint32_t(tok.kind),
+                                 tok.pos.line, tok.pos.col,
+                                 tok.i, tok.j });
+      if (chunk.size() == chunk.capacity()) {
+        std::fwrite(chunk.data(), sizeof(CtokToken), chunk.size(), f);
+        chunk.clear();
+      }
+    }
+  }
+  std::fwrite(chunk.data(), sizeof(CtokToken), chunk.size(), f);
+  write_padding(f, h.tokens_offset + ntokens*sizeof(CtokToken), h.ids_offset);
+
+  for (const LexData* data : files)
+    std::fwrite(data->ids.data(), 1, data->ids.size(), f);
+  write_padding(f, h.ids_offset + ids_size, h.comments_offset);
+
+  for (const LexData* data : files)
+    std::fwrite(data->comments.data(), 1, data->comments.size(), f);
+  write_padding(f, h.comments_offset + comments_size, h.strings_offset);
+
+  std::fwrite(strings.data(), 1, strings.size(), f);
+  return !std::ferror(f);
+}
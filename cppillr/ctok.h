@@ -0,0 +1,252 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+// Binary token dump generated with -dumptokens file.ctok, and a
+// header-only reader that maps the file in memory (tools that only
+// need the tokens can include this file and utils/mapped_file.h
+// without linking cppillr).
+//
+// All offsets are in bytes from the beginning of the file, each
+// section starts at a multiple of 8. Values are stored in the native
+// byte order. Strings in the strings pool are zero-terminated.
+//
+//   CtokHeader
+//   CtokFileEntry[nfiles]
+//   uint32_t keywords[nkeywords + npp_keywords] (strings offsets)
+//   CtokToken[ntokens]   (tokens of all files, one file after other)
+//   uint8_t ids[]        (LexData::ids of all files)
+//   uint8_t comments[]   (LexData::comments of all files)
+//   char strings[]
+
+#include "utils/mapped_file.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct LexData;
+
+const uint32_t ctok_magic = 0x4b4f5443; // "CTOK"
+const uint32_t ctok_version = 1;
+
+struct CtokHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nfiles;
+  uint32_t nkeywords;
+  uint32_t npp_keywords;
+  uint32_t reserved;
+  uint64_t ntokens;
+  uint64_t files_offset;
+  uint64_t keywords_offset;
+  uint64_t tokens_offset;
+  uint64_t ids_offset, ids_size;
+  uint64_t comments_offset, comments_size;
+  uint64_t strings_offset, strings_size;
+};
+
+enum CtokFileFlags {
+  ctok_pragma_once = 1,
+};
+
+struct CtokFileEntry {
+  uint64_t first_token;         // Index in the tokens array
+  uint64_t ids;                 // Offset of this file's ids in the ids pool
+  uint64_t comments;            // Offset in the comments pool
+  uint32_t ntokens;
+  uint32_t ids_size;
+  uint32_t comments_size;
+  uint32_t fn;                  // Offset in the strings pool
+  uint32_t include_guard;       // Offset in the strings pool ("" if none)
+  uint32_t readed_bytes;
+  uint32_t flags;               // CtokFileFlags
+  uint32_t reserved;
+};
+
+// Same values as TokenKind
+enum CtokKind {
+  ctok_pp_begin,
+  ctok_pp_keyword,
+  ctok_pp_header_name,
+  ctok_pp_end,
+  ctok_comment,
+  ctok_identifier,
+  ctok_keyword,
+  ctok_char_constant,
+  ctok_literal,
+  ctok_numeric_constant,
+  ctok_punctuator,
+  ctok_eof,
+};
+
+// Same fields as Token: "i" and "j" are relative to the ids/comments
+// of the file (or the keyword index, or the punctuator chars)
+struct CtokToken {
+  uint32_t kind;                // CtokKind
+  int32_t line, col;
+  int32_t i, j;
+};
+
+// View of one file of the dump with the same accessors as LexData
+class CtokFileView {
+  const CtokFileEntry* e;
+  const CtokToken* tokens_;
+  const uint8_t* ids_;
+  const uint8_t* comments_;
+  const char* strings;
+public:
+  CtokFileView(const CtokFileEntry* e,
+               const CtokToken* tokens,
+               const uint8_t* ids,
+               const uint8_t* comments,
+               const char* strings)
+    : e(e)
+    , tokens_(tokens + e->first_token)
+    , ids_(ids + e->ids)
+    , comments_(comments + e->comments)
+    , strings(strings) { }
+
+  const char* fn() const { return strings + e->fn; }
+  const char* include_guard() const { return strings + e->include_guard; }
+  bool pragma_once() const { return (e->flags & ctok_pragma_once) != 0; }
+  int readed_bytes() const { return int(e->readed_bytes); }
+
+  int ntokens() const { return int(e->ntokens); }
+  const CtokToken* begin() const { return tokens_; }
+  const CtokToken* end() const { return tokens_ + e->ntokens; }
+  const CtokToken& operator[](int i) const { return tokens_[i]; }
+
+  const uint8_t* ids() const { return ids_; }
+  const uint8_t* comments() const { return comments_; }
+
+  // The text of tokens with an invalid range is empty
+  std::string id_text(const CtokToken& tok) const {
+    if (tok.i < 0 || tok.i > tok.j || uint32_t(tok.j) > e->ids_size)
+      return std::string();
+    return std::string((const char*)ids_+tok.i,
+                       (const char*)ids_+tok.j);
+  }
+
+  std::string comment_text(const CtokToken& tok) const {
+    if (tok.i < 0 || tok.i > tok.j || uint32_t(tok.j) > e->comments_size)
+      return std::string();
+    return std::string((const char*)comments_+tok.i,
+                       (const char*)comments_+tok.j);
+  }
+};
+
+// Maps a .ctok file in memory. open() checks the header, the bounds
+// of each section, and the ranges of each file entry and keyword;
+// the tokens are used as they are (only the ranges of their text are
+// checked in id_text()/comment_text()).
+class CtokReader {
+  MappedFile file;
+  const CtokHeader* h = nullptr;
+  const CtokFileEntry* files = nullptr;
+  const uint32_t* keywords = nullptr;
+  const CtokToken* tokens = nullptr;
+  const uint8_t* ids = nullptr;
+  const uint8_t* comments = nullptr;
+  const char* strings = nullptr;
+
+  bool in_bounds(uint64_t offset, uint64_t size) const {
+    return (offset % 8 == 0 &&
+            offset <= file.size() && size <= file.size() - offset);
+  }
+
+  static bool in_range(uint64_t offset, uint64_t size, uint64_t total) {
+    return (offset <= total && size <= total - offset);
+  }
+
+  bool valid_string(uint32_t offset) const {
+    return (offset < h->strings_size);
+  }
+
+  bool valid_entry(const CtokFileEntry& e) const {
+    return (in_range(e.first_token, e.ntokens, h->ntokens) &&
+            in_range(e.ids, e.ids_size, h->ids_size) &&
+            in_range(e.comments, e.comments_size, h->comments_size) &&
+            valid_string(e.fn) &&
+            valid_string(e.include_guard));
+  }
+
+public:
+  bool open(const std::string& fn) {
+    h = nullptr;
+    if (!file.open(fn) ||
+        file.size() < sizeof(CtokHeader))
+      return false;
+
+    const uint8_t* base = file.data();
+    const CtokHeader* hdr = (const CtokHeader*)base;
+    const uint64_t nkeywords = uint64_t(hdr->nkeywords) + hdr->npp_keywords;
+    if (hdr->magic != ctok_magic ||
+        hdr->version != ctok_version ||
+        hdr->ntokens > file.size() / sizeof(CtokToken) ||
+        !in_bounds(hdr->files_offset, uint64_t(hdr->nfiles) * sizeof(CtokFileEntry)) ||
+        !in_bounds(hdr->keywords_offset, 4 * nkeywords) ||
+        !in_bounds(hdr->tokens_offset, hdr->ntokens * sizeof(CtokToken)) ||
+        !in_bounds(hdr->ids_offset, hdr->ids_size) ||
+        !in_bounds(hdr->comments_offset, hdr->comments_size) ||
+        !in_bounds(hdr->strings_offset, hdr->strings_size) ||
+        // Strings must be zero-terminated
+        hdr->strings_size == 0 ||
+        base[hdr->strings_offset + hdr->strings_size - 1] != 0)
+      return false;
+
+    h = hdr;
+    files = (const CtokFileEntry*)(base + h->files_offset);
+    keywords = (const uint32_t*)(base + h->keywords_offset);
+    tokens = (const CtokToken*)(base + h->tokens_offset);
+    ids = base + h->ids_offset;
+    comments = base + h->comments_offset;
+    strings = (const char*)(base + h->strings_offset);
+
+    bool ok = true;
+    for (uint32_t i=0; i<h->nfiles && ok; ++i)
+      ok = valid_entry(files[i]);
+    for (uint64_t i=0; i<nkeywords && ok; ++i)
+      ok = valid_string(keywords[i]);
+    if (!ok) {
+      h = nullptr;
+      return false;
+    }
+    return true;
+  }
+
+  int nfiles() const { return (h ? int(h->nfiles): 0); }
+
+  CtokFileView file_view(int i) const {
+    return CtokFileView(files+i, tokens, ids, comments, strings);
+  }
+
+  // Returns the index of the given file or -1 if it's not in the dump
+  int find(const std::string& fn) const {
+    for (int i=0; i<nfiles(); ++i)
+      if (fn == strings + files[i].fn)
+        return i;
+    return -1;
+  }
+
+  // Names of the values of ctok_keyword/ctok_pp_keyword tokens
+  // (an empty string if the index is out of range)
+  const char* keyword(int i) const {
+    if (i < 0 || uint32_t(i) >= h->nkeywords)
+      return "";
+    return strings + keywords[i];
+  }
+  const char* pp_keyword(int i) const {
+    if (i < 0 || uint32_t(i) >= h->npp_keywords)
+      return "";
+    return strings + keywords[h->nkeywords + i];
+  }
+};
+
+// Writes the tokens of the given files in a .ctok file, returns false
+// if the file cannot be written.
+bool write_ctok(const std::string& fn,
+                const std::vector<const LexData*>& files);
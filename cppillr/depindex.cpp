@@ -0,0 +1,341 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/depindex.h"
+
+#include "cppillr/includes.h"
+#include "cppillr/options.h"
+#include "utils/hash.h"
+#include "utils/mapped_file.h"
+#include "utils/scoped_fclose.h"
+#include "utils/thread_pool.h"
+#include "utils/timers.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace depindex {
+
+using namespace includes;
+
+namespace {
+
+uint64_t config_hash(const Options& options)
+{
+  uint64_t h = fnv1a_basis;
+  for (const auto& path : options.include_paths)
+    h = fnv1a("I" + path + "\n", h);
+  for (const auto& path : options.system_include_paths)
+    h = fnv1a("S" + path + "\n", h);
+  return fnv1a(options.macros.key(), h);
+}
+
+// Mapped index file
+class DepIndexFile {
+  MappedFile file;
+public:
+  const DepIndexHeader* h = nullptr;
+  const DepIndexNode* nodes = nullptr;
+  const DepIndexName* names = nullptr;
+  const uint32_t* edges = nullptr;
+  const char* strings = nullptr;
+
+  bool open(const std::string& fn) {
+    if (!file.open(fn) ||
+        file.size() < sizeof(DepIndexHeader))
+      return false;
+
+    const uint8_t* base = file.data();
+    h = (const DepIndexHeader*)base;
+    if (h->magic != depindex_magic ||
+        h->version != depindex_version ||
+        !is_valid())
+      return false;
+
+    nodes = (const DepIndexNode*)(base + h->nodes_offset);
+    names = (const DepIndexName*)(base + h->names_offset);
+    edges = (const uint32_t*)(base + h->edges_offset);
+    strings = (const char*)(base + h->strings_offset);
+    return is_valid_graph();
+  }
+
+  int find(const std::string& fn) const {
+    const uint64_t hash = fnv1a(fn);
+    auto it = std::lower_bound(
+      names, names+h->nnodes, hash,
+      [](const DepIndexName& n, uint64_t hash) { return n.hash < hash; });
+    for (; it != names+h->nnodes && it->hash == hash; ++it)
+      if (fn == strings + nodes[it->node].fn)
+        return int(it->node);
+    return -1;
+  }
+
+private:
+  // Checks that the sections are inside the file and the strings
+  // pool is zero-terminated
+  bool is_valid() const {
+    const uint64_t size = file.size();
+    auto in_file = [size](uint64_t offset, uint64_t bytes) {
+      return (offset <= size && bytes <= size - offset);
+    };
+    return (h->nodes_offset % 8 == 0 &&
+            h->names_offset % 8 == 0 &&
+            h->edges_offset % 4 == 0 &&
+            h->nodes_offset >= sizeof(DepIndexHeader) &&
+            in_file(h->nodes_offset, uint64_t(h->nnodes) * sizeof(DepIndexNode)) &&
+            in_file(h->names_offset, uint64_t(h->nnodes) * sizeof(DepIndexName)) &&
+            in_file(h->edges_offset, uint64_t(h->nedges) * 4) &&
+            h->strings_offset <= size &&
+            (h->strings_offset == size || file.data()[size-1] == 0));
+  }
+
+  // Checks that all the edges and string offsets of the nodes are
+  // valid, so the graph can be traversed (or loaded) without checks
+  bool is_valid_graph() const {
+    const uint32_t n = h->nnodes;
+    const uint32_t nedges = h->nedges;
+    const uint64_t strings_size = file.size() - h->strings_offset;
+    auto valid_range = [nedges](uint32_t first, uint32_t count) {
+      return (first <= nedges && count <= nedges - first);
+    };
+    for (uint32_t i=0; i<n; ++i) {
+      const DepIndexNode& d = nodes[i];
+      if (d.fn >= strings_size ||
+          names[i].node >= n ||
+          !valid_range(d.includes, d.nincludes) ||
+          !valid_range(d.includers, d.nincluders) ||
+          !valid_range(d.unresolved, d.nunresolved))
+        return false;
+      for (uint32_t j=0; j<d.nincludes; ++j)
+        if (edges[d.includes+j] >= n)
+          return false;
+      for (uint32_t j=0; j<d.nincluders; ++j)
+        if (edges[d.includers+j] >= n)
+          return false;
+      for (uint32_t j=0; j<d.nunresolved; ++j)
+        if (edges[d.unresolved+j] >= strings_size)
+          return false;
+    }
+    return true;
+  }
+};
+
+// Loads the index file as an IncludeGraph to update it
+bool load_graph(const std::string& fn,
+                const uint64_t config,
+                IncludeGraph& graph)
+{
+  // open() validates the edges, so the node indexes in "includes"
+  // are always in the graph
+  DepIndexFile file;
+  if (!file.open(fn) || file.h->config != config)
+    return false;
+
+  graph.checked = file.h->checked;
+
+  for (uint32_t i=0; i<file.h->nnodes; ++i) {
+    const DepIndexNode& n = file.nodes[i];
+    auto node = std::make_unique<IncludeNode>();
+    node->fn = file.strings + n.fn;
+    node->tu = (n.flags & dep_tu ? true: false);
+    node->guarded = (n.flags & dep_guarded ? true: false);
+    node->error = (n.flags & dep_error ? true: false);
+    node->bytes = int(n.bytes);
+    node->tokens = int(n.tokens);
+    node->stamp.size = n.size;
+    node->stamp.mtime = n.mtime;
+    node->stamp.hash = n.hash;
+    for (uint32_t j=0; j<n.nincludes; ++j)
+      node->includes.push_back(int(file.edges[n.includes+j]));
+    for (uint32_t j=0; j<n.nunresolved; ++j)
+      node->unresolved.push_back(file.strings + file.edges[n.unresolved+j]);
+    graph.add_node(std::move(node));
+  }
+  return true;
+}
+
+// Returns false if the file cannot be written
+bool write_graph(const std::string& fn,
+                 const uint64_t config,
+                 const IncludeGraph& graph)
+{
+  const int n = int(graph.nodes.size());
+
+  // Reverse edges (once per includer, unguarded headers can be
+  // included several times from the same file)
+  std::vector<std::vector<uint32_t>> includers(n);
+  for (int i=0; i<n; ++i)
+    for (int j : graph.nodes[i]->includes)
+      if (includers[j].empty() || includers[j].back() != uint32_t(i))
+        includers[j].push_back(uint32_t(i));
+
+  std::string strings;
+  auto add_string = [&strings](const std::string& s) -> uint32_t {
+    uint32_t off = uint32_t(strings.size());
+    strings += s;
+    strings.push_back(0);
+    return off;
+  };
+
+  std::vector<DepIndexNode> nodes(n);
+  std::vector<DepIndexName> names(n);
+  std::vector<uint32_t> edges;
+  for (int i=0; i<n; ++i) {
+    const IncludeNode* node = graph.nodes[i].get();
+    DepIndexNode& d = nodes[i];
+    d.size = node->stamp.size;
+    d.mtime = node->stamp.mtime;
+    d.hash = node->stamp.hash;
+    d.fn = add_string(node->fn);
+    d.flags = ((node->tu ? dep_tu: 0) |
+               (node->guarded ? dep_guarded: 0) |
+               (node->error ? dep_error: 0));
+    d.bytes = uint32_t(node->bytes);
+    d.tokens = uint32_t(node->tokens);
+
+    d.includes = uint32_t(edges.size());
+    d.nincludes = uint32_t(node->includes.size());
+    edges.insert(edges.end(), node->includes.begin(), node->includes.end());
+
+    d.includers = uint32_t(edges.size());
+    d.nincluders = uint32_t(includers[i].size());
+    edges.insert(edges.end(), includers[i].begin(), includers[i].end());
+
+    d.unresolved = uint32_t(edges.size());
+    d.nunresolved = uint32_t(node->unresolved.size());
+    for (const auto& name : node->unresolved)
+      edges.push_back(add_string(name));
+
+    names[i].hash = fnv1a(node->fn);
+    names[i].node = uint32_t(i);
+    names[i].reserved = 0;
+  }
+  std::sort(names.begin(), names.end(),
+            [](const DepIndexName& a, const DepIndexName& b) {
+              return a.hash < b.hash;
+            });
+
+  DepIndexHeader h;
+  h.magic = depindex_magic;
+  h.version = depindex_version;
+  h.nnodes = uint32_t(n);
+  h.nedges = uint32_t(edges.size());
+  h.nodes_offset = sizeof(DepIndexHeader);
+  h.names_offset = h.nodes_offset + n*sizeof(DepIndexNode);
+  h.edges_offset = h.names_offset + n*sizeof(DepIndexName);
+  h.strings_offset = h.edges_offset + h.nedges*4;
+  h.config = config;
+  h.checked = graph.checked;
+
+  // Write a temporary file and replace the index at the end, so a
+  // failed write doesn't leave a broken index
+  const std::string tmp = fn + ".tmp";
+  std::FILE* f = std::fopen(tmp.c_str(), "wb");
+  if (!f)
+    return false;
+  {
+    Scoped_fclose fc(f);
+    std::fwrite(&h, sizeof(h), 1, f);
+    std::fwrite(nodes.data(), sizeof(DepIndexNode), nodes.size(), f);
+    std::fwrite(names.data(), sizeof(DepIndexName), names.size(), f);
+    std::fwrite(edges.data(), 4, edges.size(), f);
+    std::fwrite(strings.data(), 1, strings.size(), f);
+    if (std::ferror(f))
+      return false;
+  }
+
+  if (std::rename(tmp.c_str(), fn.c_str()) != 0) {
+    // rename() cannot replace an existing file on Windows
+    std::remove(fn.c_str());
+    if (std::rename(tmp.c_str(), fn.c_str()) != 0)
+      return false;
+  }
+  return true;
+}
+
+} // anonymous namespace
+
+int build(const Options& options, thread_pool& pool)
+{
+  if (options.dep_index.empty()) {
+    std::printf("depindex: specify the index file with -depindex file\n");
+    return 1;
+  }
+
+  const uint64_t config = config_hash(options);
+  IncludeGraph previous;
+  const bool update = load_graph(options.dep_index, config, previous);
+
+  IncludeGraph graph;
+  graph.checked = file_stamp_now();
+  graph.build_files(options, pool, options.parse_files,
+                    update ? &previous: nullptr);
+  if (!write_graph(options.dep_index, config, graph)) {
+    std::printf("%s: cannot write dependencies index\n",
+                options.dep_index.c_str());
+    return 1;
+  }
+
+  std::printf("%s: %d files, %d lexed\n",
+              options.dep_index.c_str(),
+              int(graph.nodes.size()),
+              graph.lexed_files());
+  return 0;
+}
+
+int query(const Options& options)
+{
+  timers::Scope timer_query("query");
+  DepIndexFile file;
+  if (options.dep_index.empty() ||
+      !file.open(options.dep_index)) {
+    std::printf("dependents: cannot open index file (use -depindex file)\n");
+    return 1;
+  }
+
+  int ret_value = 0;
+  std::vector<char> visited(file.h->nnodes, 0);
+  std::vector<uint32_t> queue;
+  for (const auto& fn : options.parse_files) {
+    int i = file.find(normalize_path(fn));
+    if (i < 0) {
+      std::printf("%s: not found in the index\n", fn.c_str());
+      ret_value = 1;
+      continue;
+    }
+
+    // Transitive closure of the includers
+    std::fill(visited.begin(), visited.end(), 0);
+    queue.clear();
+    queue.push_back(uint32_t(i));
+    visited[i] = 1;
+    for (int k=0; k<int(queue.size()); ++k) {
+      const DepIndexNode& n = file.nodes[queue[k]];
+      for (uint32_t e=0; e<n.nincluders; ++e) {
+        uint32_t j = file.edges[n.includers+e];
+        if (!visited[j]) {
+          visited[j] = 1;
+          queue.push_back(j);
+        }
+      }
+    }
+
+    int ntus = 0;
+    for (uint32_t j : queue)
+      if (file.nodes[j].flags & dep_tu)
+        ++ntus;
+
+    std::printf("%s: %d dependents, %d translation units\n",
+                fn.c_str(), int(queue.size())-1, ntus);
+    for (uint32_t j : queue)
+      if (file.nodes[j].flags & dep_tu)
+        std::printf("  %s\n", file.strings + file.nodes[j].fn);
+  }
+
+  return ret_value;
+}
+
+} // namespace depindex
@@ -0,0 +1,76 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+#include <cstdint>
+
+class thread_pool;
+struct Options;
+
+namespace depindex {
+
+// Layout of the dependencies index file generated with the
+// "depindex" command. It contains the include graph with the direct
+// #includes and the direct includers of each file (reverse edges), so
+// we can know which translation units depend on a header without
+// lexing anything. All offsets are in bytes from the beginning of the
+// file, and all strings are zero-terminated in the strings pool.
+//
+//   DepIndexHeader
+//   DepIndexNode[nnodes]
+//   DepIndexName[nnodes]   (sorted by hash of the filename)
+//   uint32_t edges[nedges] (node indexes or strings offsets)
+//   char strings[]
+struct DepIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nnodes;
+  uint32_t nedges;
+  uint32_t nodes_offset;
+  uint32_t names_offset;
+  uint32_t edges_offset;
+  uint32_t strings_offset;
+  uint64_t config;              // Hash of -I/-isystem/-D/-U options
+  int64_t checked;              // When the FileStamps were taken
+};
+
+enum DepIndexFlags {
+  dep_tu = 1,
+  dep_guarded = 2,
+  dep_error = 4,
+};
+
+struct DepIndexNode {
+  uint64_t size;                // FileStamp
+  int64_t mtime;
+  uint64_t hash;
+  uint32_t fn;                  // Offset in the strings pool
+  uint32_t flags;               // DepIndexFlags
+  uint32_t bytes, tokens;
+  uint32_t includes, nincludes; // First edge + number of edges
+  uint32_t includers, nincluders;
+  uint32_t unresolved, nunresolved; // Edges are strings offsets
+};
+
+struct DepIndexName {
+  uint64_t hash;
+  uint32_t node;
+  uint32_t reserved;
+};
+
+const uint32_t depindex_magic = 0x50444443; // "CDDP"
+const uint32_t depindex_version = 2;
+
+// "depindex" command: creates/updates the -depindex file with the
+// include graph of the given files (only modified files are lexed
+// again if the index already exists).
+int build(const Options& options, thread_pool& pool);
+
+// "dependents" command: prints the translation units that depend
+// (transitively) on the given files.
+int query(const Options& options);
+
+} // namespace depindex
@@ -4,13 +4,23 @@
 // Read LICENSE.txt for more information.
 
 #include "cppillr/docs.h"
+#include "cppillr/docs_index.h"
 #include "cppillr/options.h"
 #include "cppillr/program.h"
+#include "cppillr/token_cursor.h"
+#include "utils/alloc_profile.h"
+#include "utils/binary_io.h"
+#include "utils/file_stamp.h"
+#include "utils/perf_counters.h"
+#include "utils/scoped_fclose.h"
 #include "utils/string.h"
 #include "utils/thread_pool.h"
+#include "utils/timers.h"
+#include "utils/trace.h"
 
+#include <atomic>
 #include <cstdarg>
-#include <mutex>
+#include <unordered_map>
 
 namespace docs {
 
@@ -39,11 +49,11 @@ static DocSection make_section(const LexData& data,
 class DocsParser {
   const LexData& data;
   Token tok;
-  std::vector<Token>::const_iterator tok_it, tok_end;
+  TokenCursor tok_it;           // Next token to read
 
   // Reads next token
   Token& next_token() {
-    if (tok_it != tok_end) {
+    if (!tok_it.at_end()) {
       tok = *tok_it;
       ++tok_it;
     }
@@ -77,17 +87,19 @@ public:
   DocsParser(const LexData& data)
     : data(data)
     , tok(TokenKind::Eof, TextPos{0, 0})
-    , tok_it(data.tokens.begin())
-    , tok_end(data.tokens.end()) { }
+    , tok_it(data) { }
 
   void createDoc(Doc& doc) {
-    while (next_token().kind != TokenKind::Eof) {
-      // Discard tokens until we find a comment, which might be
-      // included in the docs.
-      if (!is(TokenKind::Comment))
+    // Visit only the comments (collected by the lexer in
+    // LexData::comment_toks) and the few tokens after each one.
+    for (int comment_i : data.comment_toks) {
+      // Skip comments that were already consumed by the previous
+      // declaration.
+      if (comment_i < tok_it.index())
         continue;
 
-      Token commentTok = tok;
+      tok_it.seek(comment_i);
+      Token commentTok = next_token();
       tok = next_token();
       if (eof()) // end of tokens (a comment at the end of file, maybe commenting the file?)
         break;
@@ -101,17 +113,18 @@ public:
             case key_enum:
             case key_union:
             case key_namespace: {
+              const Token keyTok = tok;
               Token idTok = next_token();
               if (!is(TokenKind::Identifier)) {
                 error("expecting identifier after %s",
-                      keywords_id[int(tok.i)].c_str());
+                      keywords_id[keyTok.i].c_str());
                 break;
               }
 
               doc.sections.push_back(
                 make_section(data, commentTok,
                              data.id_text(idTok),
-                             keywords_id[int(tok.i)]));
+                             keywords_id[keyTok.i]));
               break;
             }
               // Variables or functions
@@ -146,6 +159,7 @@ public:
             case key_void:
             case key_volatile:
             case key_wchar_t: {
+              const Token keyTok = tok;
               Token id_tok = next_token();
               if (!is(TokenKind::Identifier))
                 error("expecting identifier");
@@ -153,7 +167,7 @@ public:
               doc.sections.push_back(
                 make_section(data, commentTok,
                              data.id_text(id_tok),
-                             keywords_id[int(tok.i)]));
+                             keywords_id[keyTok.i]));
               break;
             }
           }
@@ -221,28 +235,51 @@ public:
 
 static Doc process_file(const LexData& data)
 {
+  ALLOC_TAG("docs");
   Doc doc;
+  doc.fn = data.fn;
   DocsParser parser(data);
   parser.createDoc(doc);
   return std::move(doc);
 }
 
+static void print_doc(const Options& options, const Doc& doc)
+{
+  for (const DocSection& sec : doc.sections) {
+    std::string templ = options.print;
+    replace_string(templ, "{id}", sec.id);
+    replace_string(templ, "{type}", sec.type);
+    replace_string(templ, "{line}", sec.line);
+    replace_string(templ, "{desc}", sec.desc);
+    if (!templ.empty())
+      std::puts(templ.c_str());
+  }
+}
+
 void run(
   const Options& options,
   thread_pool& pool,
   const Program& prog)
 {
-  std::mutex docs_mutex;
-  std::vector<Doc> docs;
-
-  for (const auto& data : prog.lex_data) {
+  // The docs are generated in the order of the input files, so the
+  // output (and the section ids of the index) doesn't depend on the
+  // order in which the files were lexed
+  const std::vector<const LexData*> files =
+    in_input_order(options.parse_files, prog.lex_data);
+  std::vector<Doc> docs(files.size());
+
+  for (int i=0; i<int(files.size()); ++i) {
+    const LexData& data = *files[i];
+    const int64_t queued = trace::queued();
+    ALLOC_TAG("docs task");
     pool.execute(
-      [&data, &docs_mutex, &docs]() {
-        Doc doc = process_file(data);
-        {
-          std::unique_lock<std::mutex> l(docs_mutex);
-          docs.emplace_back(std::move(doc));
-        }
+      [i, &data, &docs, queued]() {
+        timers::Scope timer_docs("docs", &data.fn);
+        trace::Scope trace_docs("docs", data.fn, queued);
+        trace_docs.set_bytes(data.readed_bytes);
+        perf::Scope perf_docs(perf::Analysis);
+        ALLOC_PHASE(alloc::Analysis);
+        docs[i] = process_file(data);
       });
   }
 
@@ -250,17 +287,173 @@ void run(
 
   // Generate markdown file
 
-  for (const Doc& doc : docs) {
-    for (const DocSection& sec : doc.sections) {
-      std::string templ = options.print;
-      replace_string(templ, "{id}", sec.id);
-      replace_string(templ, "{type}", sec.type);
-      replace_string(templ, "{line}", sec.line);
-      replace_string(templ, "{desc}", sec.desc);
-      if (!templ.empty())
-        std::puts(templ.c_str());
+  for (const Doc& doc : docs)
+    print_doc(options, doc);
+
+  if (!options.docs_index.empty())
+    write_index(options.docs_index, pool, docs);
+}
+
+//////////////////////////////////////////////////////////////////////
+// Incremental docs (-doccache file)
+
+// Magic number + version of the docs cache file
+const uint32_t cache_magic = 0x43445043; // "CPDC"
+const uint32_t cache_version = 2;
+
+struct CacheEntry {
+  FileStamp stamp;
+  Doc doc;
+};
+
+static void write_cache(const std::string& fn,
+                        const std::string& templ,
+                        const int64_t checked,
+                        const std::vector<std::string>& files,
+                        const std::vector<CacheEntry>& entries)
+{
+  std::FILE* f = std::fopen(fn.c_str(), "wb");
+  if (!f) {
+    std::printf("%s: cannot write docs cache\n", fn.c_str());
+    return;
+  }
+  Scoped_fclose fc(f);
+
+  write_u32(f, cache_magic);
+  write_u32(f, cache_version);
+  write_string(f, templ);
+  write_u64(f, uint64_t(checked));
+  write_u32(f, uint32_t(entries.size()));
+  for (int i=0; i<int(entries.size()); ++i) {
+    const CacheEntry& e = entries[i];
+    write_string(f, files[i]);
+    write_u64(f, e.stamp.size);
+    write_u64(f, uint64_t(e.stamp.mtime));
+    write_u64(f, e.stamp.hash);
+    write_u32(f, uint32_t(e.doc.sections.size()));
+    for (const DocSection& sec : e.doc.sections) {
+      write_u32(f, uint32_t(sec.level));
+      write_string(f, sec.id);
+      write_string(f, sec.type);
+      write_string(f, sec.line);
+      write_string(f, sec.desc);
     }
   }
 }
 
+// Returns the cached entries by filename and the time when their
+// stamps were taken. The whole cache is discarded if it was generated
+// with a different -print template.
+static std::unordered_map<std::string, CacheEntry>
+read_cache(const std::string& fn,
+           const std::string& templ,
+           int64_t& checked)
+{
+  std::unordered_map<std::string, CacheEntry> entries;
+  std::vector<uint8_t> buf;
+  if (!read_file(fn, buf))
+    return entries;
+
+  BinaryReader r(buf.data(), buf.size());
+  if (r.u32() != cache_magic ||
+      r.u32() != cache_version ||
+      r.string() != templ)
+    return entries;
+  checked = int64_t(r.u64());
+
+  uint32_t n = r.u32();
+  for (uint32_t i=0; i<n && r.ok(); ++i) {
+    std::string file = r.string();
+    CacheEntry e;
+    e.doc.fn = file;
+    e.stamp.size = r.u64();
+    e.stamp.mtime = int64_t(r.u64());
+    e.stamp.hash = r.u64();
+    uint32_t nsecs = r.u32();
+    for (uint32_t j=0; j<nsecs && r.ok(); ++j) {
+      DocSection sec;
+      sec.level = int(r.u32());
+      sec.id = r.string();
+      sec.type = r.string();
+      sec.line = r.string();
+      sec.desc = r.string();
+      e.doc.sections.emplace_back(std::move(sec));
+    }
+    if (r.ok())
+      entries[file] = std::move(e);
+  }
+  return entries;
+}
+
+void run_incremental(
+  const Options& options,
+  thread_pool& pool)
+{
+  const auto& files = options.parse_files;
+  // The cache depends on the -print template and the -D/-U options
+  const std::string cache_key = options.print + '\n' + options.macros.key();
+  int64_t cache_checked = 0;
+  const auto cache = read_cache(options.docs_cache, cache_key, cache_checked);
+  const int64_t checked = file_stamp_now();
+  std::vector<CacheEntry> entries(files.size());
+  std::atomic<int> relexed(0);
+
+  for (int i=0; i<int(files.size()); ++i) {
+    ALLOC_TAG("docs task");
+    pool.execute(
+      [i, &options, &files, &cache, cache_checked, &entries, &relexed]() {
+        const std::string& fn = files[i];
+        CacheEntry& e = entries[i];
+        auto it = cache.find(fn);
+
+        // Unchanged files (same size and modification time) cost
+        // only a stat() call (unless they were modified just before
+        // the cache was generated).
+        if (!get_file_stamp(fn, e.stamp))
+          return;
+        if (it != cache.end() &&
+            it->second.stamp.size == e.stamp.size &&
+            it->second.stamp.mtime == e.stamp.mtime &&
+            !is_racy_stamp(it->second.stamp, cache_checked)) {
+          e = it->second;
+          return;
+        }
+
+        // The file was touched, but maybe its content is the same.
+        if (!hash_file_content(fn, e.stamp))
+          return;
+        if (it != cache.end() &&
+            it->second.stamp.hash == e.stamp.hash) {
+          e.doc = it->second.doc;
+          return;
+        }
+
+        Lexer lexer(options.lexer_macros());
+        if (lexer.lex(fn) != Lexer::Result::OK)
+          return;
+        e.doc = process_file(lexer.move_data());
+        ++relexed;
+      });
+  }
+
+  pool.wait_all();
+
+  // Generate markdown file in the same order of the input files
+  for (const CacheEntry& e : entries)
+    print_doc(options, e.doc);
+
+  write_cache(options.docs_cache, cache_key, checked, files, entries);
+
+  if (!options.docs_index.empty()) {
+    std::vector<Doc> docs;
+    for (const CacheEntry& e : entries)
+      docs.push_back(e.doc);
+    write_index(options.docs_index, pool, docs);
+  }
+
+  if (options.show_time)
+    std::printf("docs cache: %d/%d files re-extracted\n",
+                int(relexed), int(files.size()));
+}
+
 } // namespace docs
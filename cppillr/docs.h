@@ -20,6 +20,7 @@ struct DocSection {
 };
 
 struct Doc {
+  std::string fn;
   std::vector<DocSection> sections;
 };
 
@@ -28,4 +29,11 @@ void run(
   thread_pool& pool,
   const Program& prog);
 
+// Like run() but lexes only the files that changed since the last
+// execution, using the cache file specified with -doccache. The
+// output is generated in the same order of the input files.
+void run_incremental(
+  const Options& options,
+  thread_pool& pool);
+
 } // namespace docs
@@ -0,0 +1,363 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/docs_index.h"
+
+#include "cppillr/options.h"
+#include "utils/alloc_profile.h"
+#include "utils/hash.h"
+#include "utils/mapped_file.h"
+#include "utils/scoped_fclose.h"
+#include "utils/string.h"
+#include "utils/thread_pool.h"
+#include "utils/timers.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <unordered_map>
+
+namespace docs {
+
+namespace {
+
+// A term found in a section (before merging)
+struct TermHit {
+  uint64_t hash;
+  std::string term;
+  uint32_t section;
+};
+
+struct MergedTerm {
+  uint64_t hash;
+  std::string term;
+  std::vector<uint32_t> postings;
+};
+
+// Strings pool of the index file (repeated strings like filenames or
+// types are stored only once).
+class StringsPool {
+  std::string pool;
+  std::unordered_map<std::string, uint32_t> offsets;
+public:
+  uint32_t add(const std::string& s) {
+    auto it = offsets.find(s);
+    if (it != offsets.end())
+      return it->second;
+    uint32_t off = uint32_t(pool.size());
+    pool += s;
+    pool.push_back(0);
+    offsets[s] = off;
+    return off;
+  }
+  const std::string& data() const { return pool; }
+};
+
+int parse_line_number(const Doc& doc, const DocSection& sec)
+{
+  // DocSection::line has the "fn:line:col" format
+  if (sec.line.size() > doc.fn.size()+1)
+    return std::strtol(sec.line.c_str()+doc.fn.size()+1, nullptr, 10);
+  return 0;
+}
+
+// Checks that all tables, the postings of each term, and all string
+// offsets are inside the file, so the index can be used without
+// checking each access.
+bool is_valid_index(const MappedFile& file, const IndexHeader& h)
+{
+  const uint64_t size = file.size();
+  auto in_file = [size](uint64_t offset, uint64_t bytes) {
+    return (offset <= size && bytes <= size - offset);
+  };
+  if (h.terms_offset % 8 != 0 ||
+      h.postings_offset % 4 != 0 ||
+      h.sections_offset % 4 != 0 ||
+      h.files_offset % 4 != 0 ||
+      h.postings_offset < h.terms_offset ||
+      h.sections_offset < h.postings_offset ||
+      !in_file(h.terms_offset, uint64_t(h.nterms) * sizeof(IndexTerm)) ||
+      !in_file(h.postings_offset, h.sections_offset - h.postings_offset) ||
+      !in_file(h.sections_offset, uint64_t(h.nsections) * sizeof(IndexSection)) ||
+      !in_file(h.files_offset, uint64_t(h.nfiles) * 4) ||
+      // Strings must be zero-terminated
+      h.strings_offset > size ||
+      (h.strings_offset < size && file.data()[size-1] != 0))
+    return false;
+
+  const uint8_t* base = file.data();
+  const uint64_t npostings = (h.sections_offset - h.postings_offset) / 4;
+  const uint64_t strings_size = size - h.strings_offset;
+
+  auto terms = (const IndexTerm*)(base + h.terms_offset);
+  for (uint32_t i=0; i<h.nterms; ++i) {
+    const IndexTerm& t = terms[i];
+    if (t.str >= strings_size ||
+        t.postings > npostings ||
+        t.npostings > npostings - t.postings)
+      return false;
+  }
+
+  auto postings = (const uint32_t*)(base + h.postings_offset);
+  for (uint64_t i=0; i<npostings; ++i)
+    if (postings[i] >= h.nsections)
+      return false;
+
+  auto sections = (const IndexSection*)(base + h.sections_offset);
+  for (uint32_t i=0; i<h.nsections; ++i) {
+    const IndexSection& sec = sections[i];
+    if (sec.file >= h.nfiles ||
+        sec.id >= strings_size ||
+        sec.type >= strings_size ||
+        sec.loc >= strings_size)
+      return false;
+  }
+
+  auto files = (const uint32_t*)(base + h.files_offset);
+  for (uint32_t i=0; i<h.nfiles; ++i)
+    if (files[i] >= strings_size)
+      return false;
+  return true;
+}
+
+} // anonymous namespace
+
+void tokenize_terms(const std::string& text,
+                    const int min_len,
+                    std::vector<std::string>& terms)
+{
+  std::string term;
+  for (int i=0; i<=int(text.size()); ++i) {
+    int chr = (i < int(text.size()) ? (uint8_t)text[i]: 0);
+    if (std::isalnum(chr) || chr == '_') {
+      term.push_back(std::tolower(chr));
+    }
+    else if (!term.empty()) {
+      if (int(term.size()) >= min_len)
+        terms.push_back(term);
+      term.clear();
+    }
+  }
+}
+
+void write_index(const std::string& fn,
+                 thread_pool& pool,
+                 const std::vector<Doc>& docs)
+{
+  // Global index of the first section of each file
+  std::vector<uint32_t> base(docs.size()+1, 0);
+  for (int i=0; i<int(docs.size()); ++i)
+    base[i+1] = base[i] + uint32_t(docs[i].sections.size());
+
+  // Collect the terms of each file in parallel, bucketed by the
+  // partition of the hash space where they will be merged
+  const int nparts = 64;
+  std::vector<std::vector<std::vector<TermHit>>> hits(docs.size());
+  for (int i=0; i<int(docs.size()); ++i) {
+    ALLOC_TAG("docs index task");
+    pool.execute(
+      [i, &docs, &base, &hits]() {
+        const Doc& doc = docs[i];
+        auto& buckets = hits[i];
+        buckets.resize(nparts);
+        std::vector<std::string> terms;
+        for (int j=0; j<int(doc.sections.size()); ++j) {
+          const DocSection& sec = doc.sections[j];
+          terms.clear();
+          tokenize_terms(sec.id, 1, terms);
+          tokenize_terms(sec.type, 1, terms);
+          tokenize_terms(sec.desc, 2, terms);
+          std::sort(terms.begin(), terms.end());
+          terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+          for (auto& term : terms) {
+            const uint64_t hash = fnv1a(term);
+            buckets[hash % nparts].push_back(TermHit{ hash, term, base[i]+j });
+          }
+        }
+      });
+  }
+  pool.wait_all();
+
+  // Merge the terms of all files, each partition of the hash space
+  // is merged in parallel. As we iterate the files in order, the
+  // postings of each term are already sorted.
+  std::vector<std::vector<MergedTerm>> parts(nparts);
+  for (int p=0; p<nparts; ++p) {
+    ALLOC_TAG("docs index task");
+    pool.execute(
+      [p, &hits, &parts]() {
+        std::unordered_map<std::string, int> found;
+        auto& merged = parts[p];
+        for (const auto& file_hits : hits) {
+          for (const TermHit& hit : file_hits[p]) {
+            auto it = found.find(hit.term);
+            if (it == found.end()) {
+              found[hit.term] = int(merged.size());
+              merged.push_back(MergedTerm{ hit.hash, hit.term, { hit.section } });
+            }
+            else
+              merged[it->second].postings.push_back(hit.section);
+          }
+        }
+      });
+  }
+  pool.wait_all();
+
+  std::vector<MergedTerm> terms;
+  for (auto& part : parts)
+    for (auto& term : part)
+      terms.emplace_back(std::move(term));
+  std::sort(terms.begin(), terms.end(),
+            [](const MergedTerm& a, const MergedTerm& b) {
+              return (a.hash < b.hash ||
+                      (a.hash == b.hash && a.term < b.term));
+            });
+
+  // Layout of the file
+  StringsPool strings;
+  std::vector<IndexTerm> index_terms;
+  std::vector<uint32_t> postings;
+  for (const auto& term : terms) {
+    IndexTerm t;
+    t.hash = term.hash;
+    t.str = strings.add(term.term);
+    t.postings = uint32_t(postings.size());
+    t.npostings = uint32_t(term.postings.size());
+    t.reserved = 0;
+    index_terms.push_back(t);
+    postings.insert(postings.end(), term.postings.begin(), term.postings.end());
+  }
+
+  std::vector<IndexSection> sections;
+  std::vector<uint32_t> files;
+  for (int i=0; i<int(docs.size()); ++i) {
+    const Doc& doc = docs[i];
+    files.push_back(strings.add(doc.fn));
+    for (const DocSection& sec : doc.sections) {
+      IndexSection s;
+      s.file = uint32_t(i);
+      s.line = uint32_t(parse_line_number(doc, sec));
+      s.id = strings.add(sec.id);
+      s.type = strings.add(sec.type);
+      s.loc = strings.add(sec.line);
+      sections.push_back(s);
+    }
+  }
+
+  IndexHeader h;
+  h.magic = index_magic;
+  h.version = index_version;
+  h.nterms = uint32_t(index_terms.size());
+  h.nsections = uint32_t(sections.size());
+  h.nfiles = uint32_t(files.size());
+  h.terms_offset = sizeof(IndexHeader);
+  h.postings_offset = h.terms_offset + h.nterms*sizeof(IndexTerm);
+  h.sections_offset = h.postings_offset + uint32_t(postings.size()*4);
+  h.files_offset = h.sections_offset + h.nsections*sizeof(IndexSection);
+  h.strings_offset = h.files_offset + h.nfiles*4;
+
+  std::FILE* f = std::fopen(fn.c_str(), "wb");
+  if (!f) {
+    std::printf("%s: cannot write docs index\n", fn.c_str());
+    return;
+  }
+  Scoped_fclose fc(f);
+  std::fwrite(&h, sizeof(h), 1, f);
+  std::fwrite(index_terms.data(), sizeof(IndexTerm), index_terms.size(), f);
+  std::fwrite(postings.data(), 4, postings.size(), f);
+  std::fwrite(sections.data(), sizeof(IndexSection), sections.size(), f);
+  std::fwrite(files.data(), 4, files.size(), f);
+  std::fwrite(strings.data().data(), 1, strings.data().size(), f);
+}
+
+int query(const Options& options)
+{
+  MappedFile file;
+  if (options.docs_index.empty() ||
+      !file.open(options.docs_index)) {
+    std::printf("docs-query: cannot open index file (use -index file)\n");
+    return 1;
+  }
+
+  timers::Scope timer_query("query");
+  const uint8_t* base = file.data();
+  IndexHeader h;
+  if (file.size() < sizeof(h)) {
+    std::printf("%s: invalid index file\n", options.docs_index.c_str());
+    return 1;
+  }
+  std::memcpy(&h, base, sizeof(h));
+  if (h.magic != index_magic ||
+      h.version != index_version ||
+      !is_valid_index(file, h)) {
+    std::printf("%s: invalid index file\n", options.docs_index.c_str());
+    return 1;
+  }
+
+  auto terms = (const IndexTerm*)(base + h.terms_offset);
+  auto postings = (const uint32_t*)(base + h.postings_offset);
+  auto sections = (const IndexSection*)(base + h.sections_offset);
+  auto strings = (const char*)(base + h.strings_offset);
+
+  std::vector<std::string> query_terms;
+  for (const auto& arg : options.parse_files)
+    tokenize_terms(arg, 1, query_terms);
+
+  // Intersect the postings of all terms
+  std::vector<uint32_t> result, tmp;
+  bool first = true;
+  for (const auto& term : query_terms) {
+    const uint64_t hash = fnv1a(term);
+    auto it = std::lower_bound(
+      terms, terms+h.nterms, hash,
+      [](const IndexTerm& t, uint64_t hash) { return t.hash < hash; });
+    for (; it != terms+h.nterms && it->hash == hash; ++it)
+      if (term == strings + it->str)
+        break;
+
+    if (it == terms+h.nterms || it->hash != hash) {
+      result.clear();
+      break;
+    }
+
+    const uint32_t* beg = postings + it->postings;
+    const uint32_t* end = beg + it->npostings;
+    if (first) {
+      result.assign(beg, end);
+      first = false;
+    }
+    else {
+      tmp.clear();
+      std::set_intersection(result.begin(), result.end(),
+                            beg, end, std::back_inserter(tmp));
+      std::swap(result, tmp);
+    }
+    if (result.empty())
+      break;
+  }
+
+  for (uint32_t i : result) {
+    const IndexSection& sec = sections[i];
+    if (options.print.empty()) {
+      std::printf("%s: %s %s\n",
+                  strings + sec.loc,
+                  strings + sec.type,
+                  strings + sec.id);
+    }
+    else {
+      std::string templ = options.print;
+      replace_string(templ, "{id}", strings + sec.id);
+      replace_string(templ, "{type}", strings + sec.type);
+      replace_string(templ, "{line}", strings + sec.loc);
+      replace_string(templ, "{desc}", "");
+      std::puts(templ.c_str());
+    }
+  }
+  return (result.empty() ? 1: 0);
+}
+
+} // namespace docs
@@ -0,0 +1,75 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+#include "cppillr/docs.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class thread_pool;
+struct Options;
+
+namespace docs {
+
+// Layout of the inverted index file generated with "docs -index
+// file". All offsets are in bytes from the beginning of the file, and
+// all strings are zero-terminated in the strings pool, so the file
+// can be used directly from memory (mmap) without parsing it.
+//
+//   IndexHeader
+//   IndexTerm[nterms]        (sorted by hash)
+//   uint32_t postings[]      (section indexes, sorted)
+//   IndexSection[nsections]
+//   uint32_t files[nfiles]   (offsets to the strings pool)
+//   char strings[]
+struct IndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nterms;
+  uint32_t nsections;
+  uint32_t nfiles;
+  uint32_t terms_offset;
+  uint32_t postings_offset;
+  uint32_t sections_offset;
+  uint32_t files_offset;
+  uint32_t strings_offset;
+};
+
+struct IndexTerm {
+  uint64_t hash;
+  uint32_t str;                 // Offset in the strings pool
+  uint32_t postings;            // Index of the first posting
+  uint32_t npostings;
+  uint32_t reserved;
+};
+
+struct IndexSection {
+  uint32_t file;                // Index in the files table
+  uint32_t line;
+  uint32_t id, type, loc;       // Offsets in the strings pool
+};
+
+const uint32_t index_magic = 0x49445043; // "CPDI"
+const uint32_t index_version = 1;
+
+// Splits the given text in lowercase terms ([a-z0-9_]+) of at least
+// "min_len" chars.
+void tokenize_terms(const std::string& text,
+                    const int min_len,
+                    std::vector<std::string>& terms);
+
+// Creates the index file of the given docs (one per file).
+void write_index(const std::string& fn,
+                 thread_pool& pool,
+                 const std::vector<Doc>& docs);
+
+// "docs-query" command: searches the sections that contain all the
+// given terms using the index file specified with -index.
+int query(const Options& options);
+
+} // namespace docs
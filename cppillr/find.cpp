@@ -0,0 +1,507 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/find.h"
+
+#include "cppillr/options.h"
+#include "cppillr/preprocessor.h"
+#include "cppillr/token_cursor.h"
+#include "utils/alloc_profile.h"
+#include "utils/hash.h"
+#include "utils/mapped_file.h"
+#include "utils/out_buffer.h"
+#include "utils/thread_pool.h"
+#include "utils/timers.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+inline uint32_t kind_bit(TokenKind kind)
+{
+  return (uint32_t(1) << int(kind));
+}
+
+const uint32_t any_kind = (kind_bit(TokenKind::Eof) - 1) & ~kind_bit(TokenKind::Comment);
+const uint32_t const_kinds = (kind_bit(TokenKind::Literal) |
+                              kind_bit(TokenKind::CharConstant) |
+                              kind_bit(TokenKind::NumericConstant));
+
+// Two-chars punctuators generated by the lexer
+const char* const punctuators2[] = {
+  "##", "++", "+=", "--", "-=", "->", "/=", "&&", "||", "::",
+  "^=", "%=", "*=", "!=", "~=", "<<", ">>", "<=", ">=", "=="
+};
+
+bool is_word_char(char c)
+{
+  return (std::isalnum((unsigned char)c) || c == '_');
+}
+
+// Returns true if "text" is in the given buffer (the bytes of a
+// source file)
+bool contains(const uint8_t* data, std::size_t size, const std::string& text)
+{
+  if (text.empty())
+    return true;
+  const uint8_t* end = data + size;
+  const uint8_t first = uint8_t(text[0]);
+  for (const uint8_t* p = data;
+       end - p >= std::ptrdiff_t(text.size()); ++p) {
+    p = (const uint8_t*)std::memchr(p, first, end - p - text.size() + 1);
+    if (!p)
+      return false;
+    if (std::memcmp(p, text.data(), text.size()) == 0)
+      return true;
+  }
+  return false;
+}
+
+// Hash of the kind and the text (tokens in the ids pool) or the
+// keyword index/punctuator chars of a token
+uint64_t token_hash(TokenKind kind, int i, int j,
+                    const char* text, std::size_t n)
+{
+  const uint8_t k = uint8_t(kind);
+  uint64_t h = fnv1a(&k, 1);
+  switch (kind) {
+    case TokenKind::PPHeaderName:
+    case TokenKind::Identifier:
+    case TokenKind::CharConstant:
+    case TokenKind::Literal:
+    case TokenKind::NumericConstant:
+      return fnv1a(text, n, h);
+    case TokenKind::PPKeyword:
+    case TokenKind::Keyword:
+      j = 0;
+      // Fallthrough
+    case TokenKind::Punctuator: {
+      const int32_t ij[2] = { i, j };
+      return fnv1a(ij, sizeof(ij), h);
+    }
+  }
+  return h;
+}
+
+// Text of the token to print the matched code
+void write_token(const LexData& data, const Token& tok, OutBuffer& out)
+{
+  switch (tok.kind) {
+    case TokenKind::PPBegin:
+      out.put('#');
+      break;
+    case TokenKind::PPKeyword:
+      out.write(pp_keywords_id[tok.i]);
+      break;
+    case TokenKind::Keyword:
+      out.write(keywords_id[tok.i]);
+      break;
+    case TokenKind::Punctuator:
+      out.put((char)tok.i);
+      if (tok.j)
+        out.put((char)tok.j);
+      break;
+    case TokenKind::Literal:
+      out.put('"');
+      out.write(&data.ids[0]+tok.i, &data.ids[0]+tok.j);
+      out.put('"');
+      break;
+    case TokenKind::CharConstant:
+      out.put('\'');
+      out.write(&data.ids[0]+tok.i, &data.ids[0]+tok.j);
+      out.put('\'');
+      break;
+    case TokenKind::PPHeaderName:
+    case TokenKind::Identifier:
+    case TokenKind::NumericConstant:
+      out.write(&data.ids[0]+tok.i, &data.ids[0]+tok.j);
+      break;
+  }
+}
+
+// Matched tokens separated by spaces (without comments)
+void write_match(const LexData& data,
+                 const TokenPattern::Match& m,
+                 OutBuffer& out)
+{
+  bool first = true;
+  for (TokenCursor it(data, m.first); it.index() <= m.last; ++it) {
+    if (it->kind == TokenKind::Comment ||
+        it->kind == TokenKind::PPEnd)
+      continue;
+    if (first)
+      first = false;
+    else
+      out.put(' ');
+    write_token(data, *it, out);
+  }
+}
+
+} // anonymous namespace
+
+uint64_t token_hash(const LexData& data, const Token& tok)
+{
+  const char* ids = (data.ids.empty() ? nullptr: (const char*)&data.ids[0]);
+  switch (tok.kind) {
+    case TokenKind::PPHeaderName:
+    case TokenKind::Identifier:
+    case TokenKind::CharConstant:
+    case TokenKind::Literal:
+    case TokenKind::NumericConstant:
+      return token_hash(tok.kind, 0, 0, ids+tok.i, tok.j-tok.i);
+  }
+  return token_hash(tok.kind, tok.i, tok.j, nullptr, 0);
+}
+
+bool TokenPattern::compile(const std::string& pattern, std::string& error)
+{
+  elements.clear();
+  words.clear();
+
+  bool gap = false;
+  const char* p = pattern.c_str();
+  const char* end = p + pattern.size();
+  while (p < end) {
+    if (std::isspace((unsigned char)*p)) {
+      ++p;
+      continue;
+    }
+
+    const int col = int(p - pattern.c_str()) + 1;
+    Element e;
+
+    // $class or $*
+    if (*p == '$') {
+      const char* q = ++p;
+      if (q < end && *q == '*') {
+        gap = true;
+        ++p;
+        continue;
+      }
+      while (p < end && is_word_char(*p))
+        ++p;
+      const std::string name(q, p);
+      if (name == "id") e.kinds = kind_bit(TokenKind::Identifier);
+      else if (name == "keyword") e.kinds = kind_bit(TokenKind::Keyword);
+      else if (name == "literal") e.kinds = kind_bit(TokenKind::Literal);
+      else if (name == "char") e.kinds = kind_bit(TokenKind::CharConstant);
+      else if (name == "number") e.kinds = kind_bit(TokenKind::NumericConstant);
+      else if (name == "const") e.kinds = const_kinds;
+      else if (name == "op") e.kinds = kind_bit(TokenKind::Punctuator);
+      else if (name == "header") e.kinds = kind_bit(TokenKind::PPHeaderName);
+      else if (name == "any") e.kinds = any_kind;
+      else {
+        error = "unknown token class $" + name + " at column " + std::to_string(col);
+        return false;
+      }
+    }
+    // #directive
+    else if (*p == '#' && p+1 < end && std::isalpha((unsigned char)p[1])) {
+      const char* q = ++p;
+      while (p < end && is_word_char(*p))
+        ++p;
+      auto it = pp_keywords.find(std::string(q, p));
+      if (it == pp_keywords.end()) {
+        error = "unknown directive #" + std::string(q, p) + " at column " + std::to_string(col);
+        return false;
+      }
+      Element begin;
+      begin.kinds = kind_bit(TokenKind::PPBegin);
+      begin.gap = gap;
+      gap = false;
+      elements.push_back(begin);
+
+      e.kinds = kind_bit(TokenKind::PPKeyword);
+      e.exact = Exact::Index;
+      e.i = it->second;
+      words.push_back(it->first);
+    }
+    // Identifier or keyword
+    else if (std::isalpha((unsigned char)*p) || *p == '_') {
+      const char* q = p;
+      while (p < end && is_word_char(*p))
+        ++p;
+      e.text.assign(q, p);
+      auto it = keywords.find(e.text);
+      if (it != keywords.end()) {
+        e.kinds = kind_bit(TokenKind::Keyword);
+        e.exact = Exact::Index;
+        e.i = it->second;
+      }
+      else {
+        e.kinds = kind_bit(TokenKind::Identifier);
+        e.exact = Exact::Text;
+      }
+      words.push_back(e.text);
+    }
+    // Numeric constant
+    else if (std::isdigit((unsigned char)*p)) {
+      const char* q = p;
+      while (p < end && (is_word_char(*p) || *p == '.' || *p == '\''))
+        ++p;
+      e.kinds = kind_bit(TokenKind::NumericConstant);
+      e.exact = Exact::Text;
+      e.text.assign(q, p);
+    }
+    // Literal or char constant
+    else if (*p == '"' || *p == '\'') {
+      const char quote = *p;
+      const char* q = ++p;
+      while (p < end && *p != quote)
+        ++p;
+      if (p == end) {
+        error = std::string("unterminated ") +
+          (quote == '"' ? "literal": "char constant") +
+          " at column " + std::to_string(col);
+        return false;
+      }
+      e.kinds = kind_bit(quote == '"' ? TokenKind::Literal:
+                                        TokenKind::CharConstant);
+      e.exact = Exact::Text;
+      e.text.assign(q, p);
+      ++p;
+    }
+    // Punctuator
+    else {
+      e.kinds = kind_bit(TokenKind::Punctuator);
+      e.exact = Exact::Punctuator;
+      e.i = *p;
+      e.j = 0;
+      if (p+1 < end) {
+        for (const char* op : punctuators2) {
+          if (op[0] == p[0] && op[1] == p[1]) {
+            e.j = p[1];
+            break;
+          }
+        }
+      }
+      p += (e.j ? 2: 1);
+    }
+
+    e.gap = gap;
+    gap = false;
+    elements.push_back(e);
+  }
+
+  if (elements.empty()) {
+    error = "empty pattern";
+    return false;
+  }
+  if (gap || elements[0].gap) {
+    error = "$* must be between two elements";
+    return false;
+  }
+  return true;
+}
+
+std::vector<std::vector<uint64_t>> TokenPattern::exact_runs() const
+{
+  std::vector<std::vector<uint64_t>> runs(1);
+  for (const Element& e : elements) {
+    if (e.gap && !runs.back().empty())
+      runs.emplace_back();
+
+    // Only one kind of token
+    TokenKind kind = TokenKind::Eof;
+    for (int k=0; k<int(TokenKind::Eof); ++k)
+      if (e.kinds == kind_bit(TokenKind(k)))
+        kind = TokenKind(k);
+
+    if (kind == TokenKind::PPBegin)
+      runs.back().push_back(token_hash(kind, 0, 0, nullptr, 0));
+    else if (kind != TokenKind::Eof && e.exact != Exact::None)
+      runs.back().push_back(token_hash(kind, e.i, e.j,
+                                       e.text.data(), e.text.size()));
+    else if (!runs.back().empty())
+      runs.emplace_back();
+  }
+  if (runs.back().empty())
+    runs.pop_back();
+  return runs;
+}
+
+bool TokenPattern::matches(const Element& e,
+                           const Token& tok,
+                           const LexData& data) const
+{
+  if (!(e.kinds & kind_bit(tok.kind)))
+    return false;
+  switch (e.exact) {
+    case Exact::None:
+      return true;
+    case Exact::Index:
+      return (tok.i == e.i);
+    case Exact::Punctuator:
+      return (tok.i == e.i && tok.j == e.j);
+    case Exact::Text:
+      return (std::size_t(tok.j - tok.i) == e.text.size() &&
+              std::memcmp(&data.ids[tok.i], e.text.data(), e.text.size()) == 0);
+  }
+  return false;
+}
+
+// Runs the automaton over the tokens keeping the leftmost start of
+// each state (-1 if the state is not active). As most tokens cannot
+// start a match, when there are no active states only the first
+// element is tested.
+void TokenPattern::match(const LexData& data,
+                         std::vector<Match>& output) const
+{
+  const int m = int(elements.size());
+  std::vector<int> start(m+1, -1);
+  std::vector<int> next(m+1, -1);
+  const Element& first = elements[0];
+  int active = 0;
+
+  for (TokenCursor it(data); !it.at_end(); ++it) {
+    const Token& tok = *it;
+    if (tok.kind == TokenKind::Comment ||
+        tok.kind == TokenKind::Eof)
+      continue;
+
+    // First-token filter
+    if (active == 0 && !matches(first, tok, data))
+      continue;
+
+    const int i = it.index();
+    active = 0;
+    std::fill(next.begin(), next.end(), -1);
+    for (int k=0; k<m; ++k) {
+      const Element& e = elements[k];
+      const int s = (k == 0 ? i: start[k]);
+      if (s < 0)
+        continue;
+
+      // States before a $* are kept until the next element matches
+      if (k > 0 && e.gap && (next[k] < 0 || s < next[k]))
+        next[k] = s;
+      if (matches(e, tok, data) && (next[k+1] < 0 || s < next[k+1]))
+        next[k+1] = s;
+    }
+
+    if (next[m] >= 0) {
+      output.push_back(Match{ next[m], i });
+      std::fill(start.begin(), start.end(), -1);
+      continue;
+    }
+
+    for (int k=1; k<m; ++k)
+      if (next[k] >= 0)
+        ++active;
+    start.swap(next);
+  }
+}
+
+void TokenPattern::format_match(const LexData& data,
+                                const Match& m,
+                                const bool jsonl,
+                                OutBuffer& out)
+{
+  TokenCursor it(data, m.first);
+  const Token tok = *it;
+  if (jsonl) {
+    out.write("{\"type\":\"match\",\"file\":");
+    out.write_json_string(data.fn);
+    out.write(",\"line\":");
+    out.write_int(tok.pos.line);
+    out.write(",\"col\":");
+    out.write_int(tok.pos.col);
+    out.write(",\"first_token\":");
+    out.write_int(m.first);
+    out.write(",\"last_token\":");
+    out.write_int(m.last);
+    out.write(",\"text\":");
+    OutBuffer text;
+    write_match(data, m, text);
+    out.write_json_string(text.str());
+    out.write("}\n");
+  }
+  else {
+    out.write(data.fn);
+    out.put(':');
+    out.write_int(tok.pos.line);
+    out.put(':');
+    out.write_int(tok.pos.col);
+    out.write(": ");
+    write_match(data, m, out);
+    out.put('\n');
+  }
+}
+
+namespace find {
+
+int run(const Options& options, thread_pool& pool)
+{
+  TokenPattern pattern;
+  std::string error;
+  if (!pattern.compile(options.pattern, error)) {
+    std::printf("find: %s\n", error.c_str());
+    return 1;
+  }
+
+  // Macros could generate the words of the pattern
+  const bool filter = !options.preprocess;
+
+  const int n = int(options.parse_files.size());
+  std::vector<OutBuffer> outs(n);
+  std::atomic<int> lexed(0), matches(0), matched_files(0);
+  for (int i=0; i<n; ++i) {
+    ALLOC_TAG("find task");
+    pool.execute(
+      [i, &options, &pattern, filter, &outs, &lexed, &matches, &matched_files]{
+        const std::string& fn = options.parse_files[i];
+        if (filter && !fn.empty()) {
+          timers::Scope timer_filter("filter");
+          MappedFile file;
+          if (!file.open(fn))
+            return;
+          for (const auto& word : pattern.required_words())
+            if (!contains(file.data(), file.size(), word))
+              return;
+        }
+
+        timers::Scope timer_lex("lex", &fn);
+        Lexer lexer(options.lexer_macros());
+        if (lexer.lex(fn) != Lexer::Result::OK)
+          return;
+        LexData data = lexer.move_data();
+        if (options.preprocess) {
+          Preprocessor pp(&options.macros);
+          pp.process(data);
+        }
+        if (options.compact_tokens)
+          compress_tokens(data);
+        ++lexed;
+
+        timers::Scope timer_match("match", &fn);
+        std::vector<TokenPattern::Match> result;
+        pattern.match(data, result);
+        if (result.empty())
+          return;
+        matches += int(result.size());
+        ++matched_files;
+
+        for (const auto& m : result)
+          TokenPattern::format_match(data, m, options.jsonl(), outs[i]);
+      });
+  }
+  pool.wait_all();
+
+  std::fflush(stdout);
+  for (OutBuffer& out : outs)
+    out.flush(stdout);
+
+  if (!options.jsonl()) {
+    std::printf("find: %d matches in %d files (%d/%d files lexed)\n",
+                int(matches), int(matched_files), int(lexed), n);
+  }
+  return (matches > 0 ? 0: 1);
+}
+
+} // namespace find
@@ -0,0 +1,95 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+#include "cppillr/lexer.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class OutBuffer;
+class thread_pool;
+struct Options;
+
+// Hash of the kind and text of a token (e.g. to index token n-grams),
+// equal tokens in different files have the same hash.
+uint64_t token_hash(const LexData& data, const Token& tok);
+
+// A sequence of tokens to search in the source code, e.g.
+// "foo ( $const" or "new $id [". Each element of the pattern matches
+// one token:
+//
+// * word: an identifier or keyword (e.g. "foo", "new")
+// * 123, "text", 'c': a numeric constant, literal, or char constant
+// * punctuator: one of the punctuators of the lexer (e.g. "(", "->")
+// * #word: a preprocessor directive (e.g. "#include")
+// * $id, $keyword, $literal, $char, $number, $op, $header: any token
+//   of the given kind ($const is any literal/char/number, $any is any
+//   token)
+// * $*: any sequence of tokens (zero or more) before the next element
+//
+// Comments are ignored (they can be between the matched tokens).
+class TokenPattern {
+public:
+  struct Match {
+    int first, last;            // Indexes of the first/last tokens
+  };
+
+  // Returns false and an error message if the pattern is invalid
+  bool compile(const std::string& pattern, std::string& error);
+
+  // Words that the source code must contain to match the pattern (to
+  // skip files without lexing them)
+  const std::vector<std::string>& required_words() const { return words; }
+
+  // Runs of consecutive elements that match exactly one token (as
+  // token_hash() values). Token classes and $* split the runs. Each
+  // match contains each run as a sequence of consecutive tokens
+  // (without comments).
+  std::vector<std::vector<uint64_t>> exact_runs() const;
+
+  // Adds to "output" the matches of the pattern in the given file
+  // (leftmost-shortest and non-overlapping).
+  void match(const LexData& data, std::vector<Match>& output) const;
+
+  // Writes the match as "fn:line:col: tokens" or as a JSON object
+  // (JSON Lines)
+  static void format_match(const LexData& data,
+                           const Match& m,
+                           const bool jsonl,
+                           OutBuffer& out);
+
+private:
+  enum class Exact { None, Index, Punctuator, Text };
+
+  // Each element is a state of the automaton, the state "k" means
+  // that the first "k" elements were matched.
+  struct Element {
+    uint32_t kinds = 0;         // Mask of (1 << TokenKind)
+    Exact exact = Exact::None;
+    int i = 0, j = 0;           // Keyword index or punctuator chars
+    std::string text;           // Identifier/literal text
+    bool gap = false;           // Preceded by $*
+  };
+
+  bool matches(const Element& e,
+               const Token& tok,
+               const LexData& data) const;
+
+  std::vector<Element> elements;
+  std::vector<std::string> words;
+};
+
+namespace find {
+
+// "find" command: prints the matches of the pattern (the first
+// argument after the command) in the given files. Files are lexed
+// and matched in parallel, and the output follows the order of the
+// input files.
+int run(const Options& options, thread_pool& pool);
+
+} // namespace find
@@ -0,0 +1,600 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/includes.h"
+
+#include "cppillr/options.h"
+#include "cppillr/program.h"
+#include "cppillr/token_cursor.h"
+#include "utils/alloc_profile.h"
+#include "utils/thread_pool.h"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+
+namespace includes {
+
+static bool is_regular_file(const std::string& fn)
+{
+  struct stat st;
+  return (stat(fn.c_str(), &st) == 0 &&
+          (st.st_mode & S_IFMT) == S_IFREG);
+}
+
+static std::string dir_name(const std::string& fn)
+{
+  std::size_t i = fn.find_last_of("/\\");
+  if (i == std::string::npos)
+    return std::string();
+  return fn.substr(0, i+1);
+}
+
+static std::string join_path(const std::string& dir,
+                             const std::string& fn)
+{
+  if (dir.empty() || fn.empty() || fn[0] == '/')
+    return fn;
+  if (dir.back() == '/' || dir.back() == '\\')
+    return dir + fn;
+  return dir + "/" + fn;
+}
+
+// Removes "." and "dir/.." components so the same header included
+// from different directories gets the same node in the graph.
+std::string normalize_path(const std::string& fn)
+{
+  std::vector<std::string> parts;
+  std::string part;
+  const bool absolute = (!fn.empty() && fn[0] == '/');
+
+  for (int i=0; i<=int(fn.size()); ++i) {
+    if (i == int(fn.size()) || fn[i] == '/' || fn[i] == '\\') {
+      if (part == "..") {
+        if (!parts.empty() && parts.back() != "..")
+          parts.pop_back();
+        else if (!absolute)
+          parts.push_back(part);
+      }
+      else if (!part.empty() && part != ".")
+        parts.push_back(part);
+      part.clear();
+    }
+    else
+      part.push_back(fn[i]);
+  }
+
+  std::string result = (absolute ? "/": "");
+  for (int i=0; i<int(parts.size()); ++i) {
+    if (i > 0)
+      result.push_back('/');
+    result += parts[i];
+  }
+  return result;
+}
+
+void get_header_names(const LexData& data,
+                      std::vector<std::string>& output)
+{
+  const int n = data.ntokens();
+  for (TokenCursor it(data); it.index()+2 < n; ++it) {
+    if (it->kind != TokenKind::PPBegin)
+      continue;
+    TokenCursor key(it);
+    ++key;
+    if (key->kind == TokenKind::PPKeyword &&
+        key->i == pp_key_include) {
+      TokenCursor arg(key);
+      ++arg;
+      if (arg->kind == TokenKind::PPHeaderName) {
+        output.push_back(data.id_text(*arg));
+        it = arg;
+      }
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+// IncludeGraph
+
+IncludeNode* IncludeGraph::claim(const std::string& fn,
+                                 int& node_i,
+                                 bool& is_new)
+{
+  std::unique_lock<std::mutex> l(nodes_mutex);
+  auto it = claimed.find(fn);
+  if (it != claimed.end()) {
+    node_i = it->second;
+    is_new = false;
+  }
+  else {
+    node_i = int(nodes.size());
+    is_new = true;
+    claimed[fn] = node_i;
+    nodes.emplace_back(std::make_unique<IncludeNode>());
+    nodes.back()->fn = fn;
+  }
+  return nodes[node_i].get();
+}
+
+bool IncludeGraph::resolve(const std::string& includer,
+                           const std::string& header_name,
+                           std::string& output)
+{
+  if (header_name.size() < 3)
+    return false;
+
+  const bool user = (header_name[0] == '"');
+  const std::string name = header_name.substr(1, header_name.size()-2);
+  const std::string dir = (user ? dir_name(includer): std::string());
+  const std::string key = dir + '\0' + header_name;
+
+  {
+    std::unique_lock<std::mutex> l(resolve_mutex);
+    auto it = resolved.find(key);
+    if (it != resolved.end()) {
+      output = it->second;
+      return !output.empty();
+    }
+  }
+
+  output.clear();
+
+  // "file.h" is searched first in the directory of the includer
+  if (user && is_regular_file(join_path(dir, name)))
+    output = normalize_path(join_path(dir, name));
+
+  for (const auto* paths : { &options->include_paths,
+                             &options->system_include_paths }) {
+    for (const auto& path : *paths) {
+      if (!output.empty())
+        break;
+      if (is_regular_file(join_path(path, name)))
+        output = normalize_path(join_path(path, name));
+    }
+  }
+
+  std::unique_lock<std::mutex> l(resolve_mutex);
+  resolved[key] = output;
+  return !output.empty();
+}
+
+void IncludeGraph::scan(IncludeNode* node,
+                        const LexData& data,
+                        thread_pool& pool)
+{
+  node->bytes = data.readed_bytes;
+  node->tokens = data.ntokens();
+  node->guarded = data.is_guarded();
+
+  std::vector<std::string> names;
+  get_header_names(data, names);
+
+  std::string path;
+  for (const auto& name : names) {
+    if (!resolve(node->fn, name, path)) {
+      node->unresolved.push_back(name);
+      continue;
+    }
+
+    int i;
+    bool is_new;
+    IncludeNode* child = claim(path, i, is_new);
+    // Repeated includes are kept until we know if the header is
+    // guarded (see remove_guarded_duplicates())
+    node->includes.push_back(i);
+
+    // Only the worker that claimed the header lexes it
+    if (is_new) {
+      ALLOC_TAG("includes task");
+      pool.execute(
+        [this, child, &pool]{
+          visit(child, pool);
+        });
+    }
+  }
+}
+
+void IncludeGraph::visit(IncludeNode* node, thread_pool& pool)
+{
+  if (with_stamps) {
+    if (!get_file_stamp(node->fn, node->stamp)) {
+      node->error = true;
+      return;
+    }
+
+    int old_i = (previous ? previous->find(node->fn): -1);
+    const IncludeNode* old = (old_i >= 0 ? previous->nodes[old_i].get(): nullptr);
+    bool same = (old &&
+                 !old->error &&
+                 old->stamp.size == node->stamp.size &&
+                 old->stamp.mtime == node->stamp.mtime &&
+                 !is_racy_stamp(old->stamp, previous->checked));
+    if (same) {
+      node->stamp.hash = old->stamp.hash;
+    }
+    else {
+      hash_file_content(node->fn, node->stamp);
+      same = (old && !old->error && old->stamp.hash == node->stamp.hash);
+    }
+
+    // Reuse the information of the unmodified file
+    if (same) {
+      node->bytes = old->bytes;
+      node->tokens = old->tokens;
+      node->guarded = old->guarded;
+      node->unresolved = old->unresolved;
+      for (int j : old->includes) {
+        int i;
+        bool is_new;
+        IncludeNode* child = claim(previous->node_fn(j), i, is_new);
+        node->includes.push_back(i);
+        if (is_new) {
+          ALLOC_TAG("includes task");
+          pool.execute(
+            [this, child, &pool]{
+              visit(child, pool);
+            });
+        }
+      }
+      return;
+    }
+  }
+
+  Lexer lexer(options->lexer_macros());
+  if (lexer.lex(node->fn) != Lexer::Result::OK) {
+    node->error = true;
+    return;
+  }
+  ++lexed;
+  scan(node, lexer.move_data(), pool);
+}
+
+void IncludeGraph::build(const Options& options,
+                         thread_pool& pool,
+                         const Program& prog)
+{
+  this->options = &options;
+
+  // Claim all input files first so they are not lexed again (a file
+  // given twice is scanned only once). Translation units are kept in
+  // the order of the input files.
+  std::vector<IncludeNode*> tu_nodes;
+  std::vector<const LexData*> tu_data;
+  for (const LexData* data : in_input_order(options.parse_files, prog.lex_data)) {
+    int i;
+    bool is_new;
+    IncludeNode* node = claim(normalize_path(data->fn), i, is_new);
+    if (!is_new)
+      continue;
+    node->tu = true;
+    tus.push_back(i);
+    tu_nodes.push_back(node);
+    tu_data.push_back(data);
+  }
+
+  for (int i=0; i<int(tus.size()); ++i) {
+    const LexData* data = tu_data[i];
+    IncludeNode* node = tu_nodes[i];
+    ALLOC_TAG("includes task");
+    pool.execute(
+      [this, node, data, &pool]{
+        scan(node, *data, pool);
+      });
+  }
+  pool.wait_all();
+  remove_guarded_duplicates();
+}
+
+void IncludeGraph::remove_guarded_duplicates()
+{
+  // An unguarded header included twice from the same file is
+  // processed twice by the preprocessor, so only the repeated
+  // includes of guarded headers are removed.
+  std::vector<char> seen(nodes.size(), false);
+  for (auto& node : nodes) {
+    auto& includes = node->includes;
+    auto end = std::remove_if(
+      includes.begin(), includes.end(),
+      [this, &seen](int i) {
+        if (!seen[i]) {
+          seen[i] = true;
+          return false;
+        }
+        return nodes[i]->guarded;
+      });
+    includes.erase(end, includes.end());
+    for (int i : includes)
+      seen[i] = false;
+  }
+}
+
+void IncludeGraph::build_files(const Options& options,
+                               thread_pool& pool,
+                               const std::vector<std::string>& files,
+                               const IncludeGraph* previous)
+{
+  this->options = &options;
+  this->previous = previous;
+  with_stamps = true;
+
+  for (const auto& fn : files) {
+    int i;
+    bool is_new;
+    IncludeNode* node = claim(normalize_path(fn), i, is_new);
+    node->tu = true;
+    tus.push_back(i);
+    if (is_new) {
+      ALLOC_TAG("includes task");
+      pool.execute(
+        [this, node, &pool]{
+          visit(node, pool);
+        });
+    }
+  }
+  pool.wait_all();
+  remove_guarded_duplicates();
+}
+
+int IncludeGraph::add_node(std::unique_ptr<IncludeNode>&& node)
+{
+  int i = int(nodes.size());
+  claimed[node->fn] = i;
+  if (node->tu)
+    tus.push_back(i);
+  nodes.emplace_back(std::move(node));
+  return i;
+}
+
+int IncludeGraph::find(const std::string& fn) const
+{
+  auto it = claimed.find(fn);
+  return (it != claimed.end() ? it->second: -1);
+}
+
+void IncludeGraph::closure(int tu, Closure& output) const
+{
+  enum { White, Gray, Black };
+  std::vector<char> color(nodes.size(), White);
+  // Stack of (node, index of the next include to visit)
+  std::vector<std::pair<int, int>> stack;
+
+  color[tu] = Gray;
+  stack.emplace_back(tu, 0);
+  while (!stack.empty()) {
+    int i = stack.back().first;
+    const IncludeNode* node = nodes[i].get();
+
+    if (stack.back().second == 0) {
+      for (const auto& name : node->unresolved)
+        output.unresolved.emplace_back(i, name);
+    }
+
+    if (stack.back().second < int(node->includes.size())) {
+      int j = node->includes[stack.back().second++];
+      if (color[j] == White) {
+        color[j] = Gray;
+        output.files.push_back(j);
+        output.parents.push_back(i);
+        stack.emplace_back(j, 0);
+      }
+      else if (color[j] == Black) {
+        // Guarded headers are skipped without looking at them again
+        if (!nodes[j]->guarded)
+          output.reprocessed.push_back(j);
+      }
+      else if (color[j] == Gray) {
+        // Cycle from "j" to the current node
+        std::vector<int> cycle;
+        auto it = std::find_if(stack.begin(), stack.end(),
+                               [j](const std::pair<int, int>& p) {
+                                 return p.first == j;
+                               });
+        for (; it != stack.end(); ++it)
+          cycle.push_back(it->first);
+        cycle.push_back(j);
+        output.cycles.emplace_back(std::move(cycle));
+      }
+    }
+    else {
+      color[i] = Black;
+      stack.pop_back();
+    }
+  }
+}
+
+int run(const Options& options,
+        thread_pool& pool,
+        const Program& prog)
+{
+  IncludeGraph graph;
+  graph.build(options, pool, prog);
+
+  // Calculate the closure of each translation unit in parallel
+  std::vector<Closure> closures(graph.tus.size());
+  for (int i=0; i<int(graph.tus.size()); ++i) {
+    ALLOC_TAG("includes task");
+    pool.execute(
+      [i, &graph, &closures]{
+        graph.closure(graph.tus[i], closures[i]);
+      });
+  }
+  pool.wait_all();
+
+  for (int i=0; i<int(graph.tus.size()); ++i) {
+    const Closure& c = closures[i];
+    std::printf("%s: %d includes\n",
+                graph.node_fn(graph.tus[i]).c_str(),
+                int(c.files.size()));
+    for (int j : c.files)
+      std::printf("  %s%s\n", graph.node_fn(j).c_str(),
+                  graph.nodes[j]->guarded ? "": " (no include guard)");
+    for (const auto& u : c.unresolved) {
+      std::printf("  unresolved %s (from %s)\n",
+                  u.second.c_str(),
+                  graph.node_fn(u.first).c_str());
+    }
+    for (const auto& cycle : c.cycles) {
+      std::printf("  cycle");
+      for (int j=0; j<int(cycle.size()); ++j)
+        std::printf("%s %s", j > 0 ? " ->": "", graph.node_fn(cycle[j]).c_str());
+      std::printf("\n");
+    }
+  }
+  return 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Include cost
+
+struct TUCost {
+  int tu;
+  int64_t bytes = 0;
+  int64_t tokens = 0;
+  int files = 0;
+};
+
+int run_cost(const Options& options,
+             thread_pool& pool,
+             const Program& prog)
+{
+  IncludeGraph graph;
+  graph.build(options, pool, prog);
+
+  const int nnodes = int(graph.nodes.size());
+  const int ntus = int(graph.tus.size());
+  std::vector<TUCost> costs(ntus);
+
+  // Translation units are processed in blocks, each block counts the
+  // inclusions of each header in its own vector to avoid locks, and
+  // then all counts are added. Each block records the first
+  // translation unit (and the parent in its closure) that includes
+  // each header too, to print the include chains.
+  const int nblocks = std::max(1, std::min(ntus, options.threads*4));
+  std::vector<std::vector<int>> block_counts(nblocks);
+  std::vector<std::vector<int>> block_first(nblocks);
+  std::vector<std::vector<int>> block_parent(nblocks);
+  for (int b=0; b<nblocks; ++b) {
+    ALLOC_TAG("includes task");
+    pool.execute(
+      [b, nblocks, ntus, nnodes, &graph, &costs,
+       &block_counts, &block_first, &block_parent]{
+        std::vector<int>& counts = block_counts[b];
+        std::vector<int>& first = block_first[b];
+        std::vector<int>& parent = block_parent[b];
+        counts.resize(nnodes, 0);
+        first.resize(nnodes, ntus);
+        parent.resize(nnodes, -1);
+        for (int i=b; i<ntus; i+=nblocks) {
+          Closure c;
+          graph.closure(graph.tus[i], c);
+
+          TUCost& cost = costs[i];
+          cost.tu = graph.tus[i];
+          cost.files = int(c.files.size());
+          for (int k=0; k<int(c.files.size()); ++k) {
+            const int j = c.files[k];
+            cost.bytes += graph.nodes[j]->bytes;
+            cost.tokens += graph.nodes[j]->tokens;
+            ++counts[j];
+            if (first[j] == ntus) {
+              first[j] = i;
+              parent[j] = c.parents[k];
+            }
+          }
+          // Headers without guards are processed again each time
+          for (int j : c.reprocessed) {
+            cost.bytes += graph.nodes[j]->bytes;
+            cost.tokens += graph.nodes[j]->tokens;
+            ++counts[j];
+          }
+        }
+      });
+  }
+  pool.wait_all();
+
+  std::vector<int> counts(nnodes, 0);
+  std::vector<int> first(nnodes, ntus);
+  std::vector<int> parent(nnodes, -1);
+  for (int b=0; b<nblocks; ++b) {
+    for (int j=0; j<nnodes; ++j) {
+      counts[j] += block_counts[b][j];
+      if (block_first[b][j] < first[j]) {
+        first[j] = block_first[b][j];
+        parent[j] = block_parent[b][j];
+      }
+    }
+  }
+
+  const int top = (options.top > 0 ? options.top: 20);
+
+  // Translation units sorted by transitive included bytes
+  std::stable_sort(costs.begin(), costs.end(),
+                   [](const TUCost& a, const TUCost& b) {
+                     return a.bytes > b.bytes;
+                   });
+
+  int64_t total_bytes = 0, total_tokens = 0;
+  for (const auto& cost : costs) {
+    total_bytes += cost.bytes;
+    total_tokens += cost.tokens;
+  }
+
+  std::printf("translation units: %d, included bytes %lld, included tokens %lld\n",
+              ntus, (long long)total_bytes, (long long)total_tokens);
+  std::printf("%12s %10s %6s  translation unit\n", "bytes", "tokens", "files");
+  for (int i=0; i<int(costs.size()) && i<top; ++i) {
+    std::printf("%12lld %10lld %6d  %s\n",
+                (long long)costs[i].bytes,
+                (long long)costs[i].tokens,
+                costs[i].files,
+                graph.node_fn(costs[i].tu).c_str());
+  }
+
+  // Headers sorted by total cost
+  std::vector<int> headers;
+  for (int j=0; j<nnodes; ++j)
+    if (counts[j] > 0)
+      headers.push_back(j);
+  auto header_cost = [&graph, &counts](int j) -> int64_t {
+    return int64_t(graph.nodes[j]->bytes) * counts[j];
+  };
+  std::stable_sort(headers.begin(), headers.end(),
+                   [&header_cost](int a, int b) {
+                     return header_cost(a) > header_cost(b);
+                   });
+
+  std::printf("\n%14s %10s %6s  header\n", "cost", "bytes", "count");
+  for (int k=0; k<int(headers.size()) && k<top; ++k) {
+    const int j = headers[k];
+    std::printf("%14lld %10d %6d  %s\n",
+                (long long)header_cost(j),
+                graph.nodes[j]->bytes,
+                counts[j],
+                graph.node_fn(j).c_str());
+
+    // Show the include chain from the first translation unit that
+    // includes this header. The parents of the headers in the chain
+    // come from the closure of the same translation unit (if a
+    // header is included by an earlier unit, all the headers it
+    // includes are included by that unit too).
+    if (first[j] == ntus)
+      continue;
+
+    const int tu = graph.tus[first[j]];
+    std::vector<int> chain = { j };
+    for (int p = parent[j]; p != tu; p = parent[p])
+      chain.push_back(p);
+    chain.push_back(tu);
+
+    std::printf("%32s", "chain:");
+    for (int m=int(chain.size())-1; m>=0; --m)
+      std::printf(" %s%s", graph.node_fn(chain[m]).c_str(), m > 0 ? " ->": "");
+    std::printf("\n");
+  }
+  return 0;
+}
+
+} // namespace includes
@@ -0,0 +1,125 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+#include "utils/file_stamp.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class thread_pool;
+struct LexData;
+struct Options;
+class Program;
+
+namespace includes {
+
+// A file in the include graph (a translation unit or a header)
+struct IncludeNode {
+  std::string fn;
+  bool tu = false;              // True if it's one of the input files
+  bool error = false;           // True if the file couldn't be read
+  bool guarded = false;         // Has an include guard or #pragma once
+  int bytes = 0;
+  int tokens = 0;
+  FileStamp stamp;              // Only used when the graph is persisted
+  std::vector<int> includes;    // Resolved #includes (node indexes, repeated
+                                // only for headers without guard)
+  std::vector<std::string> unresolved; // Header names not found
+};
+
+// Result of the transitive closure of one translation unit
+struct Closure {
+  std::vector<int> files;       // All included files (node indexes)
+  std::vector<int> parents;     // The file that included each file
+  // Headers without include guard that are included again (so they
+  // are processed again by the preprocessor)
+  std::vector<int> reprocessed;
+  std::vector<std::vector<int>> cycles;
+  std::vector<std::pair<int, std::string>> unresolved; // Includer + header name
+};
+
+class IncludeGraph {
+public:
+  std::vector<std::unique_ptr<IncludeNode>> nodes;
+  std::vector<int> tus;         // Nodes of the input files
+  int64_t checked = 0;          // When the FileStamps were taken (a
+                                // persisted graph, see is_racy_stamp())
+
+  // Resolves the #includes of all the lexed files in "prog" using
+  // the -I/-isystem paths. Each discovered header is lexed only once
+  // (the first worker that claims it).
+  void build(const Options& options,
+             thread_pool& pool,
+             const Program& prog);
+
+  // Lexes the given files and all their includes. If a "previous"
+  // graph is given, files that didn't change (same FileStamp) are not
+  // lexed again, their #includes are taken from the previous graph.
+  void build_files(const Options& options,
+                   thread_pool& pool,
+                   const std::vector<std::string>& files,
+                   const IncludeGraph* previous);
+
+  // Adds an already created node (e.g. loaded from a file)
+  int add_node(std::unique_ptr<IncludeNode>&& node);
+
+  void closure(int tu, Closure& output) const;
+
+  // Returns the node of the given file or -1 (it can be used only
+  // after building the graph)
+  int find(const std::string& fn) const;
+
+  const std::string& node_fn(int i) const { return nodes[i]->fn; }
+
+  int lexed_files() const { return lexed; }
+
+private:
+  IncludeNode* claim(const std::string& fn, int& node_i, bool& is_new);
+  bool resolve(const std::string& includer,
+               const std::string& header_name,
+               std::string& output);
+  void visit(IncludeNode* node, thread_pool& pool);
+  void scan(IncludeNode* node,
+            const LexData& data,
+            thread_pool& pool);
+  void remove_guarded_duplicates();
+
+  const Options* options = nullptr;
+  const IncludeGraph* previous = nullptr;
+  bool with_stamps = false;
+  std::atomic<int> lexed{0};
+  std::mutex nodes_mutex;
+  std::unordered_map<std::string, int> claimed;
+  std::mutex resolve_mutex;
+  std::unordered_map<std::string, std::string> resolved; // Cache of resolve()
+};
+
+// Removes "." and "dir/.." components from the given path
+std::string normalize_path(const std::string& fn);
+
+// Returns the header names ("file.h" or <file.h>) of the #include
+// directives in the given file.
+void get_header_names(const LexData& data,
+                      std::vector<std::string>& output);
+
+// "includes" command: prints the transitive closure of each input file
+int run(const Options& options,
+        thread_pool& pool,
+        const Program& prog);
+
+// "includecost" command: prints the transitive bytes/tokens of each
+// input file and the headers with the greatest total cost (bytes x
+// number of translation units including it).
+int run_cost(const Options& options,
+             thread_pool& pool,
+             const Program& prog);
+
+} // namespace includes
@@ -4,10 +4,14 @@
 // Read LICENSE.txt for more information.
 
 #include "cppillr/lexer.h"
+#include "utils/alloc_profile.h"
 #include "utils/scoped_fclose.h"
 #include "utils/string.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <mutex>
 
 int CharReader::nextchar()
 {
@@ -34,6 +38,7 @@ int CharReader::nextchar()
 
 Lexer::Result Lexer::lex(const std::string& fn)
 {
+  ALLOC_TAG("lexer");
   std::FILE* f = (fn.empty() ? stdin: std::fopen(fn.c_str(), "r"));
   if (!f)
     return Lexer::Result::ErrorOpeningFile;
@@ -42,6 +47,12 @@ Lexer::Result Lexer::lex(const std::string& fn)
 
   data.fn = fn;
   data.tokens.clear();
+  data.comment_toks.clear();
+  data.include_guard.clear();
+  data.pragma_once = false;
+  local_macros = PPMacros();
+  pp_groups.clear();
+  pp_begin = -1;
   data.tokens.reserve(128); // TODO This number might depend on the
                             //      size of the input file
   state = LexState::ReadingWhitespace;
@@ -50,14 +61,53 @@ Lexer::Result Lexer::lex(const std::string& fn)
   reader.set_file(f);
   do {
     chr = reader.nextchar();
+#ifdef CPPILLR_LEXER_STATS
+    if (chr)
+      ++stats.bytes[int(state)];
+    while (process_counted() == Action::ProcessChr)
+      ++stats.redispatches;
+#else
     while (process() == Action::ProcessChr)
       ;
+#endif
   } while (chr);
   data.readed_bytes = reader.readed_bytes();
   data.add_token(TokenKind::Eof, reader.pos());
+  detect_include_guard();
+
+#ifdef CPPILLR_LEXER_STATS
+  ++stats.files;
+  LexerStats::flush(stats);
+  stats = LexerStats();
+#endif
   return Lexer::Result::OK;
 }
 
+#ifdef CPPILLR_LEXER_STATS
+Lexer::Action Lexer::process_counted()
+{
+  const int from = int(state);
+  const int consumed = reader.consumed();
+  const size_t capacity = tok_id.capacity();
+
+  const Action action = process();
+
+  const int to = int(state);
+  ++stats.dispatches[from];
+  // Chars read ahead (or skipped) inside process()
+  stats.bytes[from] += reader.consumed() - consumed;
+  if (from != to)
+    ++stats.transitions[from][to];
+  // std::string grows geometrically, so one change of capacity can
+  // hide several reallocations
+  for (size_t c=std::max<size_t>(capacity, 1); c<tok_id.capacity(); c*=2)
+    ++stats.tok_id_reallocs;
+  stats.tok_id_max_capacity = std::max<uint64_t>(stats.tok_id_max_capacity,
+                                                 tok_id.capacity());
+  return action;
+}
+#endif
+
 Lexer::Action Lexer::process()
 {
   switch (state) {
@@ -66,19 +116,38 @@ Lexer::Action Lexer::process()
         case ' ':
         case '\t':
         case '\r':
+        case '\f':
+        case '\v':
           // Ignore whitespace
           break;
         case '\n':
           if (prepro) {
             add_token(TokenKind::PPEnd, reader.pos());
             prepro = false;
+            if (macros)
+              return end_directive();
           }
           break;
         case '\\':
           state = LexState::ReadingWhitespaceToEOL;
           break;
         case '#':
+          // Stringizing (#) and token-pasting (##) operators inside a
+          // #define body
+          if (prepro && in_define()) {
+            int chr2 = reader.nextchar();
+            if (chr2 == '#') {
+              add_token(TokenKind::Punctuator, reader.pos(), '#', '#');
+            }
+            else {
+              add_token(TokenKind::Punctuator, reader.pos(), '#');
+              chr = chr2;
+              return Action::ProcessChr;
+            }
+            break;
+          }
           state = LexState::ReadingIdentifier;
+          pp_begin = int(data.tokens.size());
           prepro = true;
           add_token(TokenKind::PPBegin, reader.pos());
           tok_id.clear();
@@ -298,6 +367,7 @@ Lexer::Action Lexer::process()
       else if (prepro) {
         auto it = pp_keywords.find(tok_id);
         if (it != pp_keywords.end()) {
+          LEXER_STAT(++stats.pp_keyword_hits);
           add_token(TokenKind::PPKeyword, reader.pos(), (int)it->second);
           tok_id.clear();
           switch ((PPKeyword)it->second) {
@@ -313,6 +383,7 @@ Lexer::Action Lexer::process()
           }
         }
         else {
+          LEXER_STAT(++stats.pp_keyword_misses);
           add_token_id(TokenKind::Identifier);
           state = LexState::ReadingWhitespace;
         }
@@ -321,22 +392,34 @@ Lexer::Action Lexer::process()
       else {
         auto it = keywords.find(tok_id);
         if (it != keywords.end()) {
+          LEXER_STAT(++stats.keyword_hits);
           add_token(TokenKind::Keyword, reader.pos(), (int)it->second);
           tok_id.clear();
         }
-        else
+        else {
+          LEXER_STAT(++stats.keyword_misses);
           add_token_id(TokenKind::Identifier);
+        }
         state = LexState::ReadingWhitespace;
         return Action::ProcessChr;
       }
       break;
     case LexState::ReadingLineComment:
       if (chr == '\n') {
+        // The newline ends the directive too, the comment goes after
+        // its PPEnd token
+        const bool end_of_directive = prepro;
+        if (prepro) {
+          add_token(TokenKind::PPEnd, reader.pos());
+          prepro = false;
+        }
         if (keep_comments) {
           tok_id.push_back(chr);
           add_token_comment();
         }
         state = LexState::ReadingWhitespace;
+        if (end_of_directive && macros)
+          return end_directive();
       }
       else if (keep_comments) {
         tok_id.push_back(chr);
@@ -561,6 +644,7 @@ void Lexer::add_token_comment()
       data.tokens.back().j = data.comments.size();
     }
     else {
+      data.comment_toks.push_back(int(data.tokens.size()));
       data.add_token(TokenKind::Comment,
                      reader.pos(),
                      data.comments.size()-tok_id.size(),
@@ -570,3 +654,489 @@ void Lexer::add_token_comment()
     tok_id.clear();
   }
 }
+
+// Called at the end of each directive to evaluate the conditions of
+// #if/#elif/#else and skip the disabled regions.
+Lexer::Action Lexer::end_directive()
+{
+  const auto& tokens = data.tokens;
+  const int beg = pp_begin;
+  int end = (beg < 0 ? 0: beg);   // PPEnd
+  while (end < int(tokens.size()) && tokens[end].kind != TokenKind::PPEnd)
+    ++end;
+  if (beg < 0 || beg+1 >= end ||
+      tokens[beg+1].kind != TokenKind::PPKeyword)
+    return Action::NextChr;
+
+  // Tokens after the directive keyword without comments
+  std::vector<int> args;
+  for (int k=beg+2; k<end; ++k)
+    if (tokens[k].kind != TokenKind::Comment)
+      args.push_back(k);
+
+  const int key = tokens[beg+1].i;
+  const bool has_id = (!args.empty() &&
+                       tokens[args[0]].kind == TokenKind::Identifier);
+  switch (key) {
+
+    case pp_key_if:
+    case pp_key_ifdef:
+    case pp_key_ifndef: {
+      PPValue v;
+      if (key == pp_key_if)
+        v = eval_pp_condition(data, beg+2, end, local_macros, *macros);
+      else if (has_id)
+        v = eval_pp_defined(data.id_text(tokens[args[0]]),
+                            key == pp_key_ifdef,
+                            local_macros, *macros);
+      if (!v.known)
+        pp_groups.push_back(PPGroup::MaybeTaken);
+      else if (v.value)
+        pp_groups.push_back(PPGroup::Taken);
+      else {
+        pp_groups.push_back(PPGroup::NoneTaken);
+        return skip_disabled_region(true);
+      }
+      break;
+    }
+
+    case pp_key_elif:
+    case pp_key_else: {
+      if (pp_groups.empty())
+        break;
+      PPGroup& group = pp_groups.back();
+      // We were in the enabled branch, skip the rest until #endif
+      if (group == PPGroup::Taken)
+        return skip_disabled_region(false);
+
+      PPValue v(true, 1);
+      if (key == pp_key_elif)
+        v = eval_pp_condition(data, beg+2, end, local_macros, *macros);
+      if (v.known && !v.value)
+        return skip_disabled_region(true);
+      if (group == PPGroup::NoneTaken)
+        group = (v.known ? PPGroup::Taken: PPGroup::MaybeTaken);
+      break;
+    }
+
+    case pp_key_endif:
+      if (!pp_groups.empty())
+        pp_groups.pop_back();
+      break;
+
+    case pp_key_define:
+    case pp_key_undef:
+      if (has_id) {
+        const std::string name = data.id_text(tokens[args[0]]);
+        bool uncertain = false;
+        for (PPGroup group : pp_groups)
+          if (group == PPGroup::MaybeTaken)
+            uncertain = true;
+
+        if (uncertain)
+          local_macros.set_unknown(name);
+        else if (key == pp_key_undef)
+          local_macros.undef(name);
+        else if (args.size() == 1)
+          local_macros.define(name, std::string());
+        else if (args.size() == 2 &&
+                 tokens[args[1]].kind == TokenKind::NumericConstant)
+          local_macros.define(name, data.id_text(tokens[args[1]]));
+        else
+          // We don't expand macros, so other values are unknown
+          local_macros.define(name, "?");
+      }
+      break;
+  }
+  return Action::NextChr;
+}
+
+// Fast scan of a disabled region: only the first chars of each line
+// are checked to find the directives that might finish the region
+// (#endif, or #elif/#else if "stop_at_else" is true), no tokens are
+// generated. Comments, literals and line continuations are skipped
+// so a "#" inside them doesn't start a directive.
+Lexer::Action Lexer::skip_disabled_region(const bool stop_at_else)
+{
+  auto is_id_chr = [](int chr) {
+    return ((chr >= 'a' && chr <= 'z') ||
+            (chr >= 'A' && chr <= 'Z') ||
+            (chr >= '0' && chr <= '9') ||
+            (chr == '_'));
+  };
+  int depth = 0;
+  bool line_start = true;       // Only whitespace/comments in this line
+
+  chr = reader.nextchar();
+  while (chr) {
+    switch (chr) {
+
+      case ' ':
+      case '\t':
+      case '\r':
+      case '\f':
+      case '\v':
+        chr = reader.nextchar();
+        break;
+
+      case '\n':
+        line_start = true;
+        chr = reader.nextchar();
+        break;
+
+      // Line continuation
+      case '\\':
+        chr = reader.nextchar();
+        if (chr == '\r')
+          chr = reader.nextchar();
+        if (chr == '\n')
+          chr = reader.nextchar();
+        else
+          line_start = false;
+        break;
+
+      case '/':
+        chr = reader.nextchar();
+        if (chr == '/') {
+          while (chr && chr != '\n') {
+            if (chr == '\\') {
+              chr = reader.nextchar();
+              if (chr == '\r')
+                chr = reader.nextchar();
+              if (!chr)
+                break;
+            }
+            chr = reader.nextchar();
+          }
+        }
+        else if (chr == '*') {
+          int prev = 0;
+          chr = reader.nextchar();
+          while (chr && !(prev == '*' && chr == '/')) {
+            prev = chr;
+            chr = reader.nextchar();
+          }
+          if (chr)
+            chr = reader.nextchar();
+        }
+        else
+          line_start = false;
+        break;
+
+      // Literals finish at the end of the line (unbalanced quotes
+      // are common in disabled regions, e.g. "#if 0 // don't")
+      case '"':
+      case '\'': {
+        const int quote = chr;
+        line_start = false;
+        chr = reader.nextchar();
+        while (chr && chr != quote && chr != '\n') {
+          if (chr == '\\') {
+            chr = reader.nextchar();
+            if (!chr)
+              break;
+          }
+          chr = reader.nextchar();
+        }
+        if (chr == quote)
+          chr = reader.nextchar();
+        break;
+      }
+
+      case '#':
+        if (line_start) {
+          const TextPos pos = reader.pos();
+          chr = reader.nextchar();
+          while (chr == ' ' || chr == '\t')
+            chr = reader.nextchar();
+
+          tok_id.clear();
+          while (is_id_chr(chr)) {
+            tok_id.push_back(chr);
+            chr = reader.nextchar();
+          }
+
+          bool resume = false;
+          if (tok_id == "if" || tok_id == "ifdef" || tok_id == "ifndef")
+            ++depth;
+          else if (tok_id == "endif") {
+            if (depth == 0)
+              resume = true;
+            else
+              --depth;
+          }
+          else if ((tok_id == "elif" || tok_id == "else") &&
+                   depth == 0 && stop_at_else)
+            resume = true;
+
+          // Continue lexing this directive in the normal way
+          if (resume) {
+            pp_begin = int(data.tokens.size());
+            add_token(TokenKind::PPBegin, pos);
+            prepro = true;
+            state = LexState::ReadingIdentifier;
+            return Action::ProcessChr;
+          }
+          tok_id.clear();
+          line_start = false;
+          break;
+        }
+        line_start = false;
+        chr = reader.nextchar();
+        break;
+
+      default:
+        line_start = false;
+        chr = reader.nextchar();
+        break;
+    }
+  }
+  return Action::NextChr;
+}
+
+bool Lexer::in_define() const
+{
+  return (pp_begin >= 0 &&
+          pp_begin+1 < int(data.tokens.size()) &&
+          data.tokens[pp_begin+1].kind == TokenKind::PPKeyword &&
+          data.tokens[pp_begin+1].i == pp_key_define);
+}
+
+void Lexer::detect_include_guard()
+{
+  const auto& tokens = data.tokens;
+  const int n = int(tokens.size());
+  std::string guard;
+  int depth = 0;
+  bool outside = false; // True if there are tokens outside the guard
+
+  auto is_pp = [&tokens, n](int i, PPKeyword key) {
+    return (i+1 < n &&
+            tokens[i].kind == TokenKind::PPBegin &&
+            tokens[i+1].kind == TokenKind::PPKeyword &&
+            tokens[i+1].i == key);
+  };
+  auto is_id = [this, &tokens, n](int i, const char* id) {
+    return (i < n &&
+            tokens[i].kind == TokenKind::Identifier &&
+            data.id_text(tokens[i]) == id);
+  };
+  auto is_punctuator = [&tokens, n](int i, char chr) {
+    return (i < n &&
+            tokens[i].kind == TokenKind::Punctuator &&
+            tokens[i].i == chr && tokens[i].j == 0);
+  };
+
+  for (int i=0; i<n; ++i) {
+    const Token& tok = tokens[i];
+    if (tok.kind == TokenKind::Comment ||
+        tok.kind == TokenKind::PPEnd ||
+        tok.kind == TokenKind::Eof)
+      continue;
+
+    if (tok.kind != TokenKind::PPBegin) {
+      if (depth == 0)
+        outside = true;
+      continue;
+    }
+
+    if (is_pp(i, pp_key_pragma) && is_id(i+2, "once")) {
+      data.pragma_once = true;
+    }
+    else if (is_pp(i, pp_key_if) ||
+             is_pp(i, pp_key_ifdef) ||
+             is_pp(i, pp_key_ifndef)) {
+      // The first directive of the file must be the guard
+      //   #ifndef X
+      //   #if !defined(X) or #if !defined X
+      // followed by #define X
+      if (depth == 0 && guard.empty() && !outside) {
+        int j = -1;
+        if (is_pp(i, pp_key_ifndef))
+          j = i+2;
+        else if (is_pp(i, pp_key_if) &&
+                 is_punctuator(i+2, '!') &&
+                 is_id(i+3, "defined")) {
+          j = (is_punctuator(i+4, '(') ? i+5: i+4);
+        }
+        if (j >= 0 && j < n &&
+            tokens[j].kind == TokenKind::Identifier) {
+          const std::string id = data.id_text(tokens[j]);
+          int k = j+1;
+          while (k < n && tokens[k].kind != TokenKind::PPEnd) ++k;
+          ++k;
+          while (k < n && tokens[k].kind == TokenKind::Comment) ++k;
+          if (is_pp(k, pp_key_define) && is_id(k+2, id.c_str()))
+            guard = id;
+        }
+        if (guard.empty())
+          outside = true;
+      }
+      else if (depth == 0)
+        outside = true;
+      ++depth;
+    }
+    else if (is_pp(i, pp_key_endif)) {
+      --depth;
+    }
+    else if (depth <= 1 &&
+             (is_pp(i, pp_key_elif) ||
+              is_pp(i, pp_key_else))) {
+      // An #else of the guard
+      outside = true;
+    }
+    else if (depth == 0) {
+      outside = true;
+    }
+
+    // Skip the rest of the directive
+    while (i+1 < n && tokens[i+1].kind != TokenKind::PPEnd)
+      ++i;
+  }
+
+  if (!guard.empty() && !outside)
+    data.include_guard = guard;
+}
+
+const char* lex_state_name(const LexState state)
+{
+  switch (state) {
+    case LexState::ReadingWhitespace:       return "Whitespace";
+    case LexState::ReadingWhitespaceToEOL:  return "WhitespaceToEOL";
+    case LexState::ReadingIdentifier:       return "Identifier";
+    case LexState::ReadingLineComment:      return "LineComment";
+    case LexState::ReadingMultilineComment: return "MultilineComment";
+    case LexState::ReadingBeforeHeaderName: return "BeforeHeaderName";
+    case LexState::ReadingSysHeaderName:    return "SysHeaderName";
+    case LexState::ReadingUserHeaderName:   return "UserHeaderName";
+    case LexState::ReadingErrorTextToEOL:   return "ErrorTextToEOL";
+    case LexState::ReadingString:           return "String";
+    case LexState::ReadingWideString:       return "WideString";
+    case LexState::ReadingChar:             return "Char";
+    case LexState::ReadingWideChar:         return "WideChar";
+    case LexState::ReadingHexadecimal:      return "Hexadecimal";
+    case LexState::ReadingBinary:           return "Binary";
+    case LexState::ReadingOctal:            return "Octal";
+    case LexState::ReadingIntegerPart:      return "IntegerPart";
+    case LexState::ReadingDecimalPart:      return "DecimalPart";
+  }
+  return "";
+}
+
+#ifdef CPPILLR_LEXER_STATS
+
+static std::mutex global_stats_mutex;
+static LexerStats global_stats;
+
+void LexerStats::add(const LexerStats& other)
+{
+  files += other.files;
+  for (int i=0; i<NumStates; ++i) {
+    bytes[i] += other.bytes[i];
+    dispatches[i] += other.dispatches[i];
+    for (int j=0; j<NumStates; ++j)
+      transitions[i][j] += other.transitions[i][j];
+  }
+  redispatches += other.redispatches;
+  keyword_hits += other.keyword_hits;
+  keyword_misses += other.keyword_misses;
+  pp_keyword_hits += other.pp_keyword_hits;
+  pp_keyword_misses += other.pp_keyword_misses;
+  tok_id_reallocs += other.tok_id_reallocs;
+  tok_id_max_capacity = std::max(tok_id_max_capacity, other.tok_id_max_capacity);
+}
+
+// static
+void LexerStats::flush(const LexerStats& stats)
+{
+  std::unique_lock<std::mutex> lock(global_stats_mutex);
+  global_stats.add(stats);
+}
+
+static void print_bar(const uint64_t value, const uint64_t max)
+{
+  const int width = 30;
+  char bar[width+1];
+  const int n = (max > 0 ? int(value * width / max): 0);
+  std::memset(bar, '#', n);
+  bar[n] = 0;
+  std::printf(" %s\n", bar);
+}
+
+static double percent(const uint64_t value, const uint64_t total)
+{
+  return (total > 0 ? 100.0 * double(value) / double(total): 0.0);
+}
+
+// static
+void LexerStats::print()
+{
+  std::unique_lock<std::mutex> lock(global_stats_mutex);
+  const LexerStats& s = global_stats;
+
+  uint64_t total_bytes = 0, total_dispatches = 0, max_bytes = 0;
+  for (int i=0; i<NumStates; ++i) {
+    total_bytes += s.bytes[i];
+    total_dispatches += s.dispatches[i];
+    max_bytes = std::max(max_bytes, s.bytes[i]);
+  }
+
+  std::printf("lexer stats: %llu files, %llu bytes, %llu dispatches\n",
+              (unsigned long long)s.files,
+              (unsigned long long)total_bytes,
+              (unsigned long long)total_dispatches);
+  std::printf("%-18s %12s %7s %12s %12s\n",
+              "state", "bytes", "%", "dispatches", "transitions");
+  for (int i=0; i<NumStates; ++i) {
+    if (s.dispatches[i] == 0)
+      continue;
+    uint64_t transitions = 0;
+    for (int j=0; j<NumStates; ++j)
+      transitions += s.transitions[i][j];
+    std::printf("%-18s %12llu %6.1f%% %12llu %12llu",
+                lex_state_name(LexState(i)),
+                (unsigned long long)s.bytes[i],
+                percent(s.bytes[i], total_bytes),
+                (unsigned long long)s.dispatches[i],
+                (unsigned long long)transitions);
+    print_bar(s.bytes[i], max_bytes);
+  }
+
+  // Most frequent transitions
+  std::vector<std::pair<uint64_t, int>> transitions;
+  for (int i=0; i<NumStates; ++i)
+    for (int j=0; j<NumStates; ++j)
+      if (s.transitions[i][j])
+        transitions.emplace_back(s.transitions[i][j], i*NumStates + j);
+  std::sort(transitions.begin(), transitions.end(),
+            [](const std::pair<uint64_t, int>& a,
+               const std::pair<uint64_t, int>& b) {
+              return a.first > b.first;
+            });
+  const uint64_t max_transitions = (transitions.empty() ? 0: transitions[0].first);
+  std::printf("%-37s %12s\n", "transition", "count");
+  for (const auto& t : transitions) {
+    std::string name = lex_state_name(LexState(t.second / NumStates));
+    name += " -> ";
+    name += lex_state_name(LexState(t.second % NumStates));
+    std::printf("%-37s %12llu", name.c_str(), (unsigned long long)t.first);
+    print_bar(t.first, max_transitions);
+  }
+
+  std::printf("ProcessChr re-dispatches: %llu (%.1f%% of dispatches)\n",
+              (unsigned long long)s.redispatches,
+              percent(s.redispatches, total_dispatches));
+  std::printf("keyword lookups: %llu hits, %llu misses (%.1f%% hits)\n",
+              (unsigned long long)s.keyword_hits,
+              (unsigned long long)s.keyword_misses,
+              percent(s.keyword_hits, s.keyword_hits + s.keyword_misses));
+  std::printf("pp keyword lookups: %llu hits, %llu misses (%.1f%% hits)\n",
+              (unsigned long long)s.pp_keyword_hits,
+              (unsigned long long)s.pp_keyword_misses,
+              percent(s.pp_keyword_hits, s.pp_keyword_hits + s.pp_keyword_misses));
+  std::printf("tok_id reallocations: %llu (max capacity %llu)\n",
+              (unsigned long long)s.tok_id_reallocs,
+              (unsigned long long)s.tok_id_max_capacity);
+}
+
+#endif
@@ -6,8 +6,10 @@
 #pragma once
 
 #include "cppillr/keywords.h"
+#include "cppillr/pp_expr.h"
 
 #include <array>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -26,6 +28,15 @@ enum class TokenKind {
   Eof,
 };
 
+// Error found lexing/parsing a file ("fn:line:col: msg"). It's thrown
+// only when the Lexer/Parser is configured with set_throw_errors(true)
+// (e.g. by the "serve" command, where a bad file must not stop the
+// server), by default errors are printed and the process exits.
+class SourceError : public std::runtime_error {
+public:
+  SourceError(const std::string& msg) : std::runtime_error(msg) { }
+};
+
 struct TextPos {
   int line, col;
   TextPos(int line = 0, int col = 0) : line(line), col(col) { }
@@ -80,13 +91,92 @@ enum class LexState {
   ReadingDecimalPart,
 };
 
+const char* lex_state_name(const LexState state);
+
+#ifdef CPPILLR_LEXER_STATS
+
+// Counters of the instrumented lexer (CPPILLR_LEXER_STATS CMake
+// option). Each Lexer counts in its own LexerStats and adds them to
+// the global stats at the end of each file.
+struct LexerStats {
+  static const int NumStates = int(LexState::ReadingDecimalPart)+1;
+
+  uint64_t files = 0;
+  uint64_t bytes[NumStates] = { 0 };      // Bytes consumed in each state
+  uint64_t dispatches[NumStates] = { 0 }; // Calls to Lexer::process()
+  uint64_t transitions[NumStates][NumStates] = { { 0 } };
+  uint64_t redispatches = 0;              // Action::ProcessChr
+  uint64_t keyword_hits = 0;
+  uint64_t keyword_misses = 0;
+  uint64_t pp_keyword_hits = 0;
+  uint64_t pp_keyword_misses = 0;
+  uint64_t tok_id_reallocs = 0;
+  uint64_t tok_id_max_capacity = 0;
+
+  void add(const LexerStats& other);
+
+  // Adds the given stats to the global ones (thread-safe)
+  static void flush(const LexerStats& stats);
+
+  // Prints a histogram of the global stats
+  static void print();
+};
+
+  #define LEXER_STAT(expr) expr
+#else
+  #define LEXER_STAT(expr)
+#endif
+
+// Tokens encoded in a compact variable-length format (used with
+// -compacttokens, see cppillr/token_cursor.h). Each block of
+// BlockSize tokens can be decoded starting from its Block state.
+struct CompactTokens {
+  static const int BlockSize = 64;
+
+  struct Block {
+    uint32_t offset;            // Offset in "bytes" of the first token
+    int32_t line, col;          // Position of the previous token
+    int32_t ids_end;            // End of the previous ids/comments payload
+    int32_t comments_end;
+  };
+
+  int ntokens = 0;
+  std::vector<Block> blocks;
+  std::vector<uint8_t> bytes;
+
+  std::size_t memory() const {
+    return blocks.capacity()*sizeof(Block) + bytes.capacity();
+  }
+};
+
 struct LexData {
   std::string fn;
   std::vector<uint8_t> ids;
   std::vector<uint8_t> comments;
+  // Tokens of the file, or empty if they were compressed in
+  // "compact_tokens" (use a TokenCursor to iterate them in both cases)
   std::vector<Token> tokens;
+  CompactTokens compact_tokens;
+  bool compact = false;
+  // Indexes of TokenKind::Comment tokens inside "tokens" (in order),
+  // so we can jump directly to comments without iterating all tokens.
+  std::vector<int> comment_toks;
+  // Macro of the classic include guard (#ifndef X / #define X
+  // ... #endif surrounding the whole file), or empty if there is no
+  // include guard.
+  std::string include_guard;
+  bool pragma_once = false;
   int readed_bytes;
 
+  int ntokens() const {
+    return (compact ? compact_tokens.ntokens: int(tokens.size()));
+  }
+
+  // True if including this file twice is the same as including it once
+  bool is_guarded() const {
+    return (pragma_once || !include_guard.empty());
+  }
+
   template<typename ...Args>
   void add_token(Args&& ...args) {
     tokens.emplace_back<Args...>(std::forward<Args>(args)...);
@@ -118,6 +208,8 @@ public:
 
   int readed_bytes() const { return readed_bytes_; }
   const TextPos& pos() const { return pos_; }
+  // Number of chars returned by nextchar()
+  int consumed() const { return readed_bytes_ - int(end - it); }
 
   int nextchar();
 
@@ -127,9 +219,16 @@ class Lexer {
 public:
   enum class Result { ErrorOpeningFile, OK };
 
+  // If "macros" is specified, regions of #if directives that are
+  // known to be disabled are skipped without generating tokens.
+  Lexer(const PPMacros* macros = nullptr) : macros(macros) { }
+
   Result lex(const std::string& fn);
   LexData&& move_data() { return std::move(data); }
 
+  // Throw SourceError instead of exiting the process on errors
+  void set_throw_errors(bool state) { throw_errors = state; }
+
 private:
   enum class Action {
     // Read next char from input file and process it
@@ -138,7 +237,19 @@ private:
     ProcessChr,
   };
 
+  // State of each #if/#elif/#else group when we skip disabled regions
+  enum class PPGroup {
+    NoneTaken,  // All previous branches were disabled
+    Taken,      // A previous branch was enabled
+    MaybeTaken, // A previous branch might be enabled (unknown condition)
+  };
+
   Action process();
+#ifdef CPPILLR_LEXER_STATS
+  Action process_counted();
+#endif
+  Action end_directive();
+  Action skip_disabled_region(const bool stop_at_else);
 
   template<typename ...Args>
   void add_token(Args&& ...args) {
@@ -147,16 +258,23 @@ private:
 
   void add_token_id(TokenKind tokenKind);
   void add_token_comment();
+  void detect_include_guard();
+  // True if the current directive is a #define
+  bool in_define() const;
 
   template<typename ...Args>
   void error(Args&& ...args) {
     char buf[4096];
     std::sprintf(buf, std::forward<Args>(args)...);
-    std::printf("%s:%d:%d: %s\n",
-                data.fn.c_str(),
-                reader.pos().line,
-                reader.pos().col,
-                buf);
+    char msg[4096+512];
+    std::snprintf(msg, sizeof(msg), "%s:%d:%d: %s",
+                  data.fn.c_str(),
+                  reader.pos().line,
+                  reader.pos().col,
+                  buf);
+    if (throw_errors)
+      throw SourceError(msg);
+    std::printf("%s\n", msg);
     std::exit(1);
   }
 
@@ -167,4 +285,12 @@ private:
   bool prepro; // True if we are reading preprocessor tokens.
   std::string tok_id;
   bool keep_comments = true;
+  bool throw_errors = false;
+  const PPMacros* macros;
+  PPMacros local_macros;          // Macros defined in this file
+  std::vector<PPGroup> pp_groups;
+  int pp_begin;                   // Index of the last PPBegin token
+#ifdef CPPILLR_LEXER_STATS
+  LexerStats stats;
+#endif
 };
@@ -5,12 +5,31 @@
 
 #pragma once
 
+#include "cppillr/pp_expr.h"
+
+#include <string>
+#include <vector>
+
 struct Options {
   std::string command;
   std::string print;
+  std::string docs_cache;
+  std::string docs_index;
+  std::string dep_index;
+  std::string token_index;      // -tokindex file.tix
+  std::string trace;            // -trace file.json
+  std::string dump_tokens;      // -dumptokens file.ctok
+  std::string format = "text";  // -format text|jsonl
+  std::string socket;           // -socket PATH (serve command)
+  std::string pattern;          // find/index-query 'PATTERN'
   std::vector<std::string> parse_files;
+  std::vector<std::string> include_paths;        // -I
+  std::vector<std::string> system_include_paths; // -isystem
   int threads;
+  int top = 0;                  // -top N elements to show in reports
   bool show_time = false;
+  bool show_counters = false;
+  bool show_pool = false;
   bool show_tokens = false;
   bool show_ast = false;
   bool show_includes = false;
@@ -18,4 +37,19 @@ struct Options {
   bool count_tokens = false;
   bool count_lines = false;
   bool keyword_stats = false;
+  bool preprocess = false;      // Expand macros after lexing
+  bool compact_tokens = false;  // Compress tokens after lexing
+  PPMacros macros;              // -D/-U/-skipdisabled
+
+  // Macros for the Lexer to skip disabled regions (or nullptr if we
+  // must lex all the regions)
+  const PPMacros* lexer_macros() const {
+    return (macros.enabled ? &macros: nullptr);
+  }
+
+  // True if -showtokens/-showincludes/-showfunctions must print JSON
+  // Lines instead of text
+  bool jsonl() const {
+    return (format == "jsonl");
+  }
 };
@@ -5,12 +5,16 @@
 
 #include "cppillr/parser.h"
 
+#include "utils/alloc_profile.h"
+
 #include <memory>
 
 void Parser::parse(const LexData& lex)
 {
+  ALLOC_TAG("parser AST");
   data.fn = lex.fn;
   lex_data = &lex;
+  cursor = TokenCursor(lex);
   goto_token(-1);
   dcl_seq();
 }
@@ -19,8 +23,10 @@ void Parser::parse(const LexData& lex)
 // AST nodes.
 void Parser::parse_function_body(const LexData& lex, FunctionNode* f)
 {
+  ALLOC_TAG("parser AST");
   data.fn = lex.fn;
   lex_data = &lex;
+  cursor = TokenCursor(lex);
   goto_token(f->body->beg_tok);
   f->body->block = compound_statement();
 }
@@ -55,6 +61,7 @@ FunctionNode* Parser::function_definition()
 
     expect(TokenKind::Identifier, "expecting identifier for function");
     f->name = lex_data->id_text(*tok);
+    f->pos = tok->pos;
 
     f->params = function_params();
     if (!f->params)
@@ -7,6 +7,7 @@
 
 #include "cppillr/keywords.h"
 #include "cppillr/lexer.h"
+#include "cppillr/token_cursor.h"
 
 enum class NodeKind {
   ParamNode,
@@ -37,6 +38,10 @@ struct ParamNode : public Node {
 struct ParamsNode : public Node {
   std::vector<ParamNode*> params;
   ParamsNode() : Node(NodeKind::ParamsNode) { }
+  ~ParamsNode() {
+    for (ParamNode* p : params)
+      delete p;
+  }
 };
 
 struct Expr : public Node {
@@ -100,10 +105,12 @@ struct FunctionNode : public Node {
   // Function
   Keyword builtin_type;
   std::string name;
+  TextPos pos;                  // Position of the function name
   ParamsNode* params = nullptr;
   BodyNode* body = nullptr;
   FunctionNode() : Node(NodeKind::Function) { }
   ~FunctionNode() {
+    delete params;
     delete body;
   }
 };
@@ -115,13 +122,28 @@ struct ParserData {
 
   ParserData() { }
   ~ParserData() {
-    for (FunctionNode* f : functions)
-      delete f;
+    clear();
   }
 
   ParserData(ParserData&&) = default;
+  ParserData& operator=(ParserData&& other) {
+    if (this != &other) {
+      clear();
+      lex = other.lex;
+      fn = std::move(other.fn);
+      functions = std::move(other.functions);
+      other.functions.clear();
+    }
+    return *this;
+  }
   ParserData(const ParserData&) = delete;
   ParserData& operator=(const ParserData&) = delete;
+
+  void clear() {
+    for (FunctionNode* f : functions)
+      delete f;
+    functions.clear();
+  }
 };
 
 class Parser {
@@ -132,11 +154,20 @@ public:
 
   ParserData&& move_data() { return std::move(data); }
 
+  // Throw SourceError instead of exiting the process on errors
+  void set_throw_errors(bool state) { throw_errors = state; }
+
 private:
   const Token& goto_token(int i) {
     tok_i = i;
-    if (i >= 0 && i < lex_data->tokens.size())
-      tok = &lex_data->tokens[i];
+    if (i >= 0 && i < lex_data->ntokens()) {
+      // Sequential access just decodes the next token
+      if (i == cursor.index()+1)
+        ++cursor;
+      else
+        cursor.seek(i);
+      tok = &(*cursor);
+    }
     else
       tok = &eof;
     return *tok;
@@ -205,18 +236,22 @@ private:
   void error(Args&& ...args) {
     char buf[4096];
     std::sprintf(buf, std::forward<Args>(args)...);
+    char msg[4096+512];
     if (tok) {
-      std::printf("%s:%d:%d: %s\n",
-                  lex_data->fn.c_str(),
-                  tok->pos.line,
-                  tok->pos.col,
-                  buf);
+      std::snprintf(msg, sizeof(msg), "%s:%d:%d: %s",
+                    lex_data->fn.c_str(),
+                    tok->pos.line,
+                    tok->pos.col,
+                    buf);
     }
     else {
-      std::printf("%s: %s\n",
-                  lex_data->fn.c_str(),
-                  buf);
+      std::snprintf(msg, sizeof(msg), "%s: %s",
+                    lex_data->fn.c_str(),
+                    buf);
     }
+    if (throw_errors)
+      throw SourceError(msg);
+    std::printf("%s\n", msg);
     std::exit(1);
   }
 
@@ -225,6 +260,8 @@ private:
   int tok_i;
   Token eof = { TokenKind::Eof, TextPos(0, 0) };
   const LexData* lex_data;
+  TokenCursor cursor;
   const Token* tok;
   int depth = 0;
+  bool throw_errors = false;
 };
@@ -0,0 +1,458 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/pp_expr.h"
+
+#include "cppillr/lexer.h"
+
+#include <cstdlib>
+
+namespace {
+
+enum class MacroState { Defined, Undefined, Unknown };
+
+MacroState lookup_macro(const std::string& name,
+                        const PPMacros& local,
+                        const PPMacros& global,
+                        std::string* value = nullptr)
+{
+  for (const PPMacros* macros : { &local, &global }) {
+    if (macros->unknown.find(name) != macros->unknown.end())
+      return MacroState::Unknown;
+
+    auto it = macros->defined.find(name);
+    if (it != macros->defined.end()) {
+      if (value)
+        *value = it->second;
+      return MacroState::Defined;
+    }
+
+    if (macros->undefined.find(name) != macros->undefined.end())
+      return MacroState::Undefined;
+  }
+  if (local.complete || global.complete)
+    return MacroState::Undefined;
+  return MacroState::Unknown;
+}
+
+// Arithmetic operations wrap around (as unsigned values) to avoid
+// the undefined behavior of signed overflow
+using ull = unsigned long long;
+
+long long wrap_add(long long x, long long y) { return (long long)(ull(x) + ull(y)); }
+long long wrap_sub(long long x, long long y) { return (long long)(ull(x) - ull(y)); }
+long long wrap_mul(long long x, long long y) { return (long long)(ull(x) * ull(y)); }
+long long wrap_neg(long long x) { return (long long)(0 - ull(x)); }
+
+bool is_integer_suffix(const std::string& s)
+{
+  for (char c : s)
+    if (c != 'u' && c != 'U' && c != 'l' && c != 'L')
+      return false;
+  return !s.empty();
+}
+
+// Parses an integer literal like 10, 0x1F, 010, or 10UL
+bool parse_integer(const std::string& s, long long& value)
+{
+  if (s.empty())
+    return false;
+  char* end = nullptr;
+  value = std::strtoll(s.c_str(), &end, 0);
+  return (end != s.c_str() &&
+          (*end == 0 || is_integer_suffix(end)));
+}
+
+// Recursive descent parser of a #if condition ([cpp.cond]) with
+// three-valued logic: any sub-expression that uses a macro with an
+// unknown state is unknown, except when the result doesn't depend on
+// it (e.g. "0 && X" or "1 || X").
+class PPExprParser {
+  const LexData& data;
+  std::vector<Token> tokens;    // Tokens of the condition without comments
+  int i, end;
+  const PPMacros& local;
+  const PPMacros& global;
+  bool failed = false;
+
+  const Token* tok() const {
+    return (i < end ? &tokens[i]: nullptr);
+  }
+
+  bool is_punctuator(char a, char b = 0) const {
+    const Token* t = tok();
+    return (t && t->kind == TokenKind::Punctuator &&
+            t->i == a && t->j == b);
+  }
+
+  bool is_id(const char* id) const {
+    const Token* t = tok();
+    return (t && t->kind == TokenKind::Identifier &&
+            data.id_text(*t) == id);
+  }
+
+  static PPValue unknown() { return PPValue(false, 0); }
+  static PPValue known(long long v) { return PPValue(true, v); }
+
+  template<typename Op>
+  static PPValue binary(const PPValue& a, const PPValue& b, Op op) {
+    if (a.known && b.known)
+      return known(op(a.value, b.value));
+    return unknown();
+  }
+
+public:
+  PPExprParser(const LexData& data, int beg, int end,
+               const PPMacros& local,
+               const PPMacros& global)
+    : data(data), i(0)
+    , local(local), global(global) {
+    for (int k=beg; k<end; ++k)
+      if (data.tokens[k].kind != TokenKind::Comment)
+        tokens.push_back(data.tokens[k]);
+    this->end = int(tokens.size());
+  }
+
+  PPValue parse() {
+    PPValue v = conditional();
+    if (failed || i != end)
+      return unknown();
+    return v;
+  }
+
+private:
+  PPValue conditional() {
+    PPValue c = logical_or();
+    if (is_punctuator('?')) {
+      ++i;
+      PPValue a = conditional();
+      if (!is_punctuator(':')) {
+        failed = true;
+        return unknown();
+      }
+      ++i;
+      PPValue b = conditional();
+      if (!c.known)
+        return (a.known && b.known && a.value == b.value ? a: unknown());
+      return (c.value ? a: b);
+    }
+    return c;
+  }
+
+  PPValue logical_or() {
+    PPValue a = logical_and();
+    while (is_punctuator('|', '|')) {
+      ++i;
+      PPValue b = logical_and();
+      if ((a.known && a.value) || (b.known && b.value))
+        a = known(1);
+      else if (a.known && b.known)
+        a = known(0);
+      else
+        a = unknown();
+    }
+    return a;
+  }
+
+  PPValue logical_and() {
+    PPValue a = bit_or();
+    while (is_punctuator('&', '&')) {
+      ++i;
+      PPValue b = bit_or();
+      if ((a.known && !a.value) || (b.known && !b.value))
+        a = known(0);
+      else if (a.known && b.known)
+        a = known(1);
+      else
+        a = unknown();
+    }
+    return a;
+  }
+
+  PPValue bit_or() {
+    PPValue a = bit_xor();
+    while (is_punctuator('|')) {
+      ++i;
+      a = binary(a, bit_xor(), [](long long x, long long y) { return x | y; });
+    }
+    return a;
+  }
+
+  PPValue bit_xor() {
+    PPValue a = bit_and();
+    while (is_punctuator('^')) {
+      ++i;
+      a = binary(a, bit_and(), [](long long x, long long y) { return x ^ y; });
+    }
+    return a;
+  }
+
+  PPValue bit_and() {
+    PPValue a = equality();
+    while (is_punctuator('&')) {
+      ++i;
+      a = binary(a, equality(), [](long long x, long long y) { return x & y; });
+    }
+    return a;
+  }
+
+  PPValue equality() {
+    PPValue a = relational();
+    while (true) {
+      if (is_punctuator('=', '=')) {
+        ++i;
+        a = binary(a, relational(), [](long long x, long long y) -> long long { return x == y; });
+      }
+      else if (is_punctuator('!', '=')) {
+        ++i;
+        a = binary(a, relational(), [](long long x, long long y) -> long long { return x != y; });
+      }
+      else
+        return a;
+    }
+  }
+
+  PPValue relational() {
+    PPValue a = shift();
+    while (true) {
+      if (is_punctuator('<')) {
+        ++i;
+        a = binary(a, shift(), [](long long x, long long y) -> long long { return x < y; });
+      }
+      else if (is_punctuator('>')) {
+        ++i;
+        a = binary(a, shift(), [](long long x, long long y) -> long long { return x > y; });
+      }
+      else if (is_punctuator('<', '=')) {
+        ++i;
+        a = binary(a, shift(), [](long long x, long long y) -> long long { return x <= y; });
+      }
+      else if (is_punctuator('>', '=')) {
+        ++i;
+        a = binary(a, shift(), [](long long x, long long y) -> long long { return x >= y; });
+      }
+      else
+        return a;
+    }
+  }
+
+  PPValue shift() {
+    PPValue a = additive();
+    while (true) {
+      if (is_punctuator('<', '<')) {
+        ++i;
+        a = binary(a, additive(), [](long long x, long long y) { return (long long)(ull(x) << (y & 63)); });
+      }
+      else if (is_punctuator('>', '>')) {
+        ++i;
+        a = binary(a, additive(), [](long long x, long long y) { return x >> (y & 63); });
+      }
+      else
+        return a;
+    }
+  }
+
+  PPValue additive() {
+    PPValue a = multiplicative();
+    while (true) {
+      if (is_punctuator('+')) {
+        ++i;
+        a = binary(a, multiplicative(), wrap_add);
+      }
+      else if (is_punctuator('-')) {
+        ++i;
+        a = binary(a, multiplicative(), wrap_sub);
+      }
+      else
+        return a;
+    }
+  }
+
+  PPValue multiplicative() {
+    PPValue a = unary();
+    while (true) {
+      if (is_punctuator('*')) {
+        ++i;
+        a = binary(a, unary(), wrap_mul);
+      }
+      else if (is_punctuator('/') || is_punctuator('%')) {
+        const bool div = is_punctuator('/');
+        ++i;
+        PPValue b = unary();
+        if (b.known && b.value == 0)
+          a = unknown();
+        else if (div)
+          a = binary(a, b, [](long long x, long long y) { return (y == -1 ? wrap_neg(x): x / y); });
+        else
+          a = binary(a, b, [](long long x, long long y) { return (y == -1 ? 0: x % y); });
+      }
+      else
+        return a;
+    }
+  }
+
+  PPValue unary() {
+    PPValue v;
+    if (is_punctuator('!')) {
+      ++i;
+      v = unary();
+      return (v.known ? known(!v.value): v);
+    }
+    else if (is_punctuator('~')) {
+      ++i;
+      v = unary();
+      return (v.known ? known(~v.value): v);
+    }
+    else if (is_punctuator('-')) {
+      ++i;
+      v = unary();
+      return (v.known ? known(wrap_neg(v.value)): v);
+    }
+    else if (is_punctuator('+')) {
+      ++i;
+      return unary();
+    }
+    return primary();
+  }
+
+  PPValue primary() {
+    const Token* t = tok();
+    if (!t) {
+      failed = true;
+      return unknown();
+    }
+
+    if (is_punctuator('(')) {
+      ++i;
+      PPValue v = conditional();
+      if (!is_punctuator(')')) {
+        failed = true;
+        return unknown();
+      }
+      ++i;
+      return v;
+    }
+
+    switch (t->kind) {
+
+      case TokenKind::NumericConstant: {
+        long long value;
+        bool ok = parse_integer(data.id_text(*t), value);
+        ++i;
+        // The lexer splits suffixes like "10UL" in two tokens
+        if (tok() && tok()->kind == TokenKind::Identifier &&
+            is_integer_suffix(data.id_text(*tok())))
+          ++i;
+        return (ok ? known(value): unknown());
+      }
+
+      case TokenKind::CharConstant: {
+        std::string s = data.id_text(*t);
+        ++i;
+        return known(s.empty() ? 0: (long long)(uint8_t)s[0]);
+      }
+
+      case TokenKind::Identifier: {
+        if (is_id("defined"))
+          return defined();
+
+        std::string name = data.id_text(*t);
+        ++i;
+
+        // Function-like macro, we don't expand them
+        if (is_punctuator('(')) {
+          skip_parens();
+          return unknown();
+        }
+
+        if (name == "true")
+          return known(1);
+        if (name == "false")
+          return known(0);
+
+        std::string value;
+        switch (lookup_macro(name, local, global, &value)) {
+          case MacroState::Defined: {
+            long long v;
+            if (parse_integer(value, v))
+              return known(v);
+            return unknown();
+          }
+          case MacroState::Undefined:
+            // Undefined identifiers are replaced with 0
+            return known(0);
+          case MacroState::Unknown:
+            return unknown();
+        }
+        break;
+      }
+
+    }
+
+    failed = true;
+    return unknown();
+  }
+
+  // defined X or defined(X)
+  PPValue defined() {
+    ++i;
+    bool parens = is_punctuator('(');
+    if (parens)
+      ++i;
+
+    const Token* t = tok();
+    if (!t || t->kind != TokenKind::Identifier) {
+      failed = true;
+      return unknown();
+    }
+    std::string name = data.id_text(*t);
+    ++i;
+
+    if (parens) {
+      if (!is_punctuator(')')) {
+        failed = true;
+        return unknown();
+      }
+      ++i;
+    }
+    return eval_pp_defined(name, true, local, global);
+  }
+
+  void skip_parens() {
+    int level = 0;
+    for (; i<end; ++i) {
+      if (is_punctuator('('))
+        ++level;
+      else if (is_punctuator(')')) {
+        if (--level == 0) {
+          ++i;
+          return;
+        }
+      }
+    }
+    failed = true;
+  }
+};
+
+} // anonymous namespace
+
+PPValue eval_pp_condition(const LexData& data, int beg, int end,
+                          const PPMacros& local,
+                          const PPMacros& global)
+{
+  PPExprParser parser(data, beg, end, local, global);
+  return parser.parse();
+}
+
+PPValue eval_pp_defined(const std::string& name, bool def,
+                        const PPMacros& local,
+                        const PPMacros& global)
+{
+  switch (lookup_macro(name, local, global)) {
+    case MacroState::Defined:   return PPValue(true, def ? 1: 0);
+    case MacroState::Undefined: return PPValue(true, def ? 0: 1);
+    default:                    return PPValue();
+  }
+}
@@ -0,0 +1,93 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+struct LexData;
+
+// Macros known to be defined (with their value) or undefined. The
+// state of any other macro is unknown (e.g. it might be defined in
+// other header), so conditions using them cannot be evaluated.
+struct PPMacros {
+  std::unordered_map<std::string, std::string> defined;
+  std::unordered_set<std::string> undefined;
+  // Macros that were defined/undefined in a region that might not
+  // be compiled, so their state is unknown.
+  std::unordered_set<std::string> unknown;
+  // True if the lexer should skip disabled #if regions
+  bool enabled = false;
+  // True if macros that are not in these lists are undefined instead
+  // of unknown (e.g. when we expand all the macros of the file)
+  bool complete = false;
+
+  void define(const std::string& name, const std::string& value) {
+    undefined.erase(name);
+    unknown.erase(name);
+    defined[name] = value;
+  }
+
+  void undef(const std::string& name) {
+    defined.erase(name);
+    unknown.erase(name);
+    undefined.insert(name);
+  }
+
+  void set_unknown(const std::string& name) {
+    defined.erase(name);
+    undefined.erase(name);
+    unknown.insert(name);
+  }
+
+  // Returns a string that identifies the -D/-U configuration (e.g. to
+  // invalidate caches when it changes)
+  std::string key() const {
+    std::vector<std::string> items;
+    for (const auto& kv : defined)
+      items.push_back("D" + kv.first + "=" + kv.second);
+    for (const auto& name : undefined)
+      items.push_back("U" + name);
+    std::sort(items.begin(), items.end());
+    std::string result = (enabled ? "skip": "");
+    for (const auto& item : items)
+      result += " " + item;
+    return result;
+  }
+
+  // Adds a -D argument ("NAME" or "NAME=value")
+  void add_define_arg(const std::string& arg) {
+    std::size_t i = arg.find('=');
+    if (i == std::string::npos)
+      define(arg, "1");
+    else
+      define(arg.substr(0, i), arg.substr(i+1));
+  }
+};
+
+// Result of a #if condition: the value is valid only if "known" is true
+struct PPValue {
+  bool known;
+  long long value;
+  PPValue(bool known = false, long long value = 0)
+    : known(known), value(value) { }
+};
+
+// Evaluates the condition of a #if/#elif directive (the tokens in the
+// [beg, end) range of "data"), first using the macros defined in the
+// file (local) and then the macros given in the command line
+// (global).
+PPValue eval_pp_condition(const LexData& data, int beg, int end,
+                          const PPMacros& local,
+                          const PPMacros& global);
+
+// Evaluates #ifdef (or #ifndef if "def" is false) of the given macro
+PPValue eval_pp_defined(const std::string& name, bool def,
+                        const PPMacros& local,
+                        const PPMacros& global);
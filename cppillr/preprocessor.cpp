@@ -0,0 +1,666 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/preprocessor.h"
+
+#include "utils/alloc_profile.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace {
+
+bool is_punctuator(const Token& tok, char a, char b = 0)
+{
+  return (tok.kind == TokenKind::Punctuator &&
+          tok.i == a && tok.j == b);
+}
+
+bool is_id_chr(int chr)
+{
+  return (std::isalnum(chr) || chr == '_');
+}
+
+} // anonymous namespace
+
+const Preprocessor::PPToken* Preprocessor::Source::peek() const
+{
+  if (!pending.empty())
+    return &pending.back();
+  for (std::size_t k=i; k<input->size(); ++k)
+    if ((*input)[k].tok.kind != TokenKind::Comment)
+      return &(*input)[k];
+  return nullptr;
+}
+
+void Preprocessor::process(LexData& data)
+{
+  ALLOC_TAG("preprocessor");
+  this->data = &data;
+  macros.clear();
+  next_macro_id = 0;
+  keyword_macros = false;
+  defined_macros = PPMacros();
+  defined_macros.complete = true;
+  groups.clear();
+  hide_sets.clear();
+  hide_sets_ids.clear();
+  hs_intern(std::vector<int>()); // Empty hide-set = 0
+
+  // Macros from the command line (-D)
+  if (cmdline_macros) {
+    for (const auto& kv : cmdline_macros->defined) {
+      Macro m;
+      m.id = next_macro_id++;
+      if (!kv.second.empty()) {
+        m.body.push_back(make_token(kv.second, TextPos()));
+        m.body_params.push_back(-1);
+      }
+      if (keywords.find(kv.first) != keywords.end())
+        keyword_macros = true;
+      macros[kv.first] = std::move(m);
+    }
+  }
+
+  PPTokens input;
+  input.reserve(data.tokens.size());
+  for (const Token& tok : data.tokens)
+    input.emplace_back(tok);
+
+  PPTokens output;
+  output.reserve(input.size());
+  Source src(&input);
+  expand(src, output, true);
+
+  data.tokens.clear();
+  data.comment_toks.clear();
+  for (const PPToken& t : output) {
+    if (t.tok.kind == TokenKind::Comment)
+      data.comment_toks.push_back(int(data.tokens.size()));
+    data.tokens.push_back(t.tok);
+  }
+}
+
+void Preprocessor::expand(Source& src, PPTokens& output, bool directives)
+{
+  while (!src.empty()) {
+    const bool from_input = src.pending.empty();
+    PPToken t = src.next();
+
+    if (directives && from_input &&
+        t.tok.kind == TokenKind::PPBegin) {
+      directive(src, t, output);
+      continue;
+    }
+
+    // Tokens of a disabled #if group
+    if (directives && from_input && !active() &&
+        t.tok.kind != TokenKind::Eof)
+      continue;
+
+    const Macro* m = find_macro(t.tok);
+    if (!m) {
+      if (!builtin_macro(t, output))
+        output.push_back(t);
+      continue;
+    }
+
+    // This token was generated by the same macro
+    if (hs_contains(t.hs, m->id)) {
+      output.push_back(t);
+      continue;
+    }
+
+    PPTokens expansion;
+    if (!m->function_like) {
+      substitute(*m, std::vector<PPTokens>(), t.tok.pos,
+                 hs_add(t.hs, m->id), expansion);
+    }
+    else {
+      // A function-like macro name without arguments is not expanded
+      const PPToken* next = src.peek();
+      if (!next || !is_punctuator(next->tok, '(')) {
+        output.push_back(t);
+        continue;
+      }
+
+      std::vector<PPTokens> args;
+      int rparen_hs;
+      PPTokens consumed;
+      if (!collect_args(src, *m, args, rparen_hs, consumed)) {
+        output.push_back(t);
+        output.insert(output.end(), consumed.begin(), consumed.end());
+        continue;
+      }
+      substitute(*m, args, t.tok.pos,
+                 hs_add(hs_intersection(t.hs, rparen_hs), m->id),
+                 expansion);
+    }
+
+    // Rescan the expansion with the rest of the tokens
+    src.pending.insert(src.pending.end(),
+                       expansion.rbegin(), expansion.rend());
+  }
+}
+
+void Preprocessor::directive(Source& src, const PPToken& begin, PPTokens& output)
+{
+  // Directives are read from the input, so "src.i" is the index of
+  // the next token in data->tokens too
+  const int beg = int(src.i)-1;
+  PPTokens line = { begin };
+  while (!src.empty()) {
+    PPToken t = src.next();
+    line.push_back(t);
+    if (t.tok.kind == TokenKind::PPEnd ||
+        t.tok.kind == TokenKind::Eof)
+      break;
+  }
+
+  if (line.size() >= 2 &&
+      line[1].tok.kind == TokenKind::PPKeyword) {
+    switch (line[1].tok.i) {
+      case pp_key_if:
+      case pp_key_ifdef:
+      case pp_key_ifndef:
+      case pp_key_elif:
+      case pp_key_else:
+      case pp_key_endif: {
+        const bool was_active = active();
+        conditional(line[1].tok.i, beg, beg+int(line.size())-1);
+        // The directive is kept if the group is in an enabled region
+        if (was_active || active())
+          output.insert(output.end(), line.begin(), line.end());
+        else if (line.back().tok.kind == TokenKind::Eof)
+          output.push_back(line.back());
+        return;
+      }
+    }
+  }
+
+  if (!active()) {
+    if (line.back().tok.kind == TokenKind::Eof)
+      output.push_back(line.back());
+    return;
+  }
+
+  if (line.size() >= 3 &&
+      line[1].tok.kind == TokenKind::PPKeyword &&
+      (line[1].tok.i == pp_key_define ||
+       line[1].tok.i == pp_key_undef)) {
+    std::vector<Token> tokens;
+    for (std::size_t k=2; k<line.size(); ++k) {
+      const Token& tok = line[k].tok;
+      if (tok.kind != TokenKind::PPEnd &&
+          tok.kind != TokenKind::Eof &&
+          tok.kind != TokenKind::Comment)
+        tokens.push_back(tok);
+    }
+    if (!tokens.empty()) {
+      if (line[1].tok.i == pp_key_define)
+        define(tokens);
+      else {
+        const std::string name = token_text(tokens[0]);
+        macros.erase(name);
+        defined_macros.undef(name);
+      }
+    }
+    // The #define/#undef is removed from the output
+    if (line.back().tok.kind == TokenKind::Eof)
+      output.push_back(line.back());
+    return;
+  }
+
+  output.insert(output.end(), line.begin(), line.end());
+}
+
+// Updates the #if groups with the given conditional directive (the
+// tokens of the directive are in the [beg, end] range of data->tokens,
+// where "end" is the PPEnd token)
+void Preprocessor::conditional(const int key, const int beg, const int end)
+{
+  const auto& tokens = data->tokens;
+  const PPMacros no_macros;
+  const PPMacros& global = (cmdline_macros ? *cmdline_macros: no_macros);
+
+  auto eval = [&]() -> PPValue {
+    if (key == pp_key_if || key == pp_key_elif)
+      return eval_pp_condition(*data, beg+2, end, defined_macros, global);
+    else if (key == pp_key_else)
+      return PPValue(true, 1);
+    for (int k=beg+2; k<end; ++k) {
+      if (tokens[k].kind == TokenKind::Identifier)
+        return eval_pp_defined(data->id_text(tokens[k]),
+                               key == pp_key_ifdef,
+                               defined_macros, global);
+      else if (tokens[k].kind != TokenKind::Comment)
+        break;
+    }
+    return PPValue();
+  };
+
+  switch (key) {
+
+    case pp_key_if:
+    case pp_key_ifdef:
+    case pp_key_ifndef:
+      // All branches of a group inside a disabled region are disabled
+      if (!active()) {
+        groups.push_back(Group{ true, false });
+      }
+      else {
+        const PPValue v = eval();
+        groups.push_back(Group{ v.known && v.value != 0,
+                                !v.known || v.value != 0 });
+      }
+      break;
+
+    case pp_key_elif:
+    case pp_key_else:
+      if (!groups.empty()) {
+        Group& group = groups.back();
+        if (group.taken) {
+          group.active = false;
+        }
+        else {
+          const PPValue v = eval();
+          group.active = (!v.known || v.value != 0);
+          group.taken = (v.known && v.value != 0);
+        }
+      }
+      break;
+
+    case pp_key_endif:
+      if (!groups.empty())
+        groups.pop_back();
+      break;
+  }
+}
+
+void Preprocessor::define(const std::vector<Token>& line)
+{
+  const std::string name = token_text(line[0]);
+  Macro m;
+  m.id = next_macro_id++;
+
+  std::size_t k = 1;
+  // Function-like macros have the '(' just after the name (the
+  // lexer gives the same position to both tokens when there is no
+  // whitespace between them)
+  if (k < line.size() &&
+      is_punctuator(line[k], '(') &&
+      line[k].pos.line == line[0].pos.line &&
+      line[k].pos.col == line[0].pos.col) {
+    m.function_like = true;
+    for (++k; k < line.size() && !is_punctuator(line[k], ')'); ++k) {
+      if (k+2 < line.size() &&
+          is_punctuator(line[k], '.') &&
+          is_punctuator(line[k+1], '.') &&
+          is_punctuator(line[k+2], '.')) {
+        // "..." or "name..."
+        if (m.params.empty() || !m.variadic)
+          m.params.push_back("__VA_ARGS__");
+        m.variadic = true;
+        k += 2;
+      }
+      else if (line[k].kind == TokenKind::Identifier) {
+        m.params.push_back(token_text(line[k]));
+        if (k+3 < line.size() &&
+            is_punctuator(line[k+1], '.') &&
+            is_punctuator(line[k+2], '.') &&
+            is_punctuator(line[k+3], '.')) {
+          m.variadic = true;
+          k += 3;
+        }
+      }
+    }
+    ++k;                        // Skip ')'
+  }
+
+  // Words in a directive are lexed as identifiers or preprocessor
+  // keywords, so here we convert them to C++ keywords.
+  for (; k < line.size(); ++k) {
+    Token tok = line[k];
+    int param = -1;
+    if (tok.kind == TokenKind::Identifier ||
+        tok.kind == TokenKind::PPKeyword) {
+      const std::string text = token_text(tok);
+      auto it = std::find(m.params.begin(), m.params.end(), text);
+      if (it != m.params.end() && tok.kind == TokenKind::Identifier)
+        param = int(it - m.params.begin());
+      else
+        tok = make_token(text, tok.pos);
+    }
+    m.body.push_back(tok);
+    m.body_params.push_back(param);
+  }
+
+  // Value for #if conditions
+  if (m.function_like || m.body.size() > 1)
+    defined_macros.define(name, "?");
+  else if (m.body.empty())
+    defined_macros.define(name, std::string());
+  else
+    defined_macros.define(name, token_text(m.body[0]));
+
+  if (keywords.find(name) != keywords.end())
+    keyword_macros = true;
+  macros[name] = std::move(m);
+}
+
+bool Preprocessor::collect_args(Source& src, const Macro& m,
+                                std::vector<PPTokens>& args,
+                                int& rparen_hs,
+                                PPTokens& consumed)
+{
+  // Skip comments until the '('
+  while (!src.empty()) {
+    PPToken t = src.next();
+    consumed.push_back(t);
+    if (t.tok.kind != TokenKind::Comment)
+      break;
+  }
+
+  int depth = 0;
+  args.emplace_back();
+  while (!src.empty()) {
+    PPToken t = src.next();
+    consumed.push_back(t);
+
+    switch (t.tok.kind) {
+      case TokenKind::Comment:
+        continue;
+      case TokenKind::Eof:
+        return false;
+    }
+
+    if (is_punctuator(t.tok, '(')) {
+      ++depth;
+    }
+    else if (is_punctuator(t.tok, ')')) {
+      if (depth == 0) {
+        rparen_hs = t.hs;
+        // F() is a call without arguments
+        if (m.params.empty() && args.size() == 1 && args[0].empty())
+          args.clear();
+        // Variadic arguments can be omitted
+        if (m.variadic && args.size()+1 == m.params.size())
+          args.emplace_back();
+        return (args.size() == m.params.size());
+      }
+      --depth;
+    }
+    else if (is_punctuator(t.tok, ',') && depth == 0 &&
+             !(m.variadic && args.size() == m.params.size())) {
+      args.emplace_back();
+      continue;
+    }
+    args.back().push_back(t);
+  }
+  return false;
+}
+
+void Preprocessor::substitute(const Macro& m,
+                              const std::vector<PPTokens>& args,
+                              const TextPos& pos,
+                              int hs,
+                              PPTokens& output)
+{
+  const int n = int(m.body.size());
+  const int va_args = (m.variadic ? int(m.params.size())-1: -1);
+
+  bool lhs_empty = false;       // True if the left operand of ## is empty
+  for (int k=0; k<n; ++k) {
+    const Token& tok = m.body[k];
+
+    // #param
+    if (m.function_like && is_punctuator(tok, '#') && k+1 < n) {
+      int p = m.body_params[k+1];
+      if (p >= 0) {
+        output.emplace_back(make_literal(TokenKind::Literal, stringize(args[p]), pos));
+        ++k;
+        lhs_empty = false;
+        continue;
+      }
+    }
+
+    // lhs ## rhs
+    if (is_punctuator(tok, '#', '#')) {
+      if (k+1 >= n)
+        continue;
+      const Token& rhs = m.body[++k];
+      const int p = m.body_params[k];
+      PPTokens rhs_toks;
+      if (p >= 0)
+        rhs_toks = args[p];
+      else
+        rhs_toks.emplace_back(rhs);
+
+      // GNU extension: ", ## __VA_ARGS__" removes the comma when
+      // there are no variadic arguments
+      if (p >= 0 && p == va_args && !lhs_empty &&
+          !output.empty() && is_punctuator(output.back().tok, ',')) {
+        if (rhs_toks.empty())
+          output.pop_back();
+        else
+          output.insert(output.end(), rhs_toks.begin(), rhs_toks.end());
+      }
+      else if (lhs_empty || output.empty() || rhs_toks.empty()) {
+        output.insert(output.end(), rhs_toks.begin(), rhs_toks.end());
+      }
+      else {
+        std::string text = token_text(output.back().tok) + token_text(rhs_toks[0].tok);
+        output.back() = PPToken(make_token(text, pos), output.back().hs);
+        output.insert(output.end(), rhs_toks.begin()+1, rhs_toks.end());
+      }
+      lhs_empty = (rhs_toks.empty() && output.empty());
+      continue;
+    }
+
+    const int p = m.body_params[k];
+    if (p >= 0) {
+      // Operands of ## are not expanded
+      if (k+1 < n && is_punctuator(m.body[k+1], '#', '#')) {
+        output.insert(output.end(), args[p].begin(), args[p].end());
+        lhs_empty = args[p].empty();
+      }
+      else {
+        Source arg_src(&args[p]);
+        expand(arg_src, output, false);
+        lhs_empty = false;
+      }
+      continue;
+    }
+
+    output.emplace_back(tok);
+    lhs_empty = false;
+  }
+
+  for (PPToken& t : output) {
+    t.tok.pos = pos;
+    t.hs = hs_union(t.hs, hs);
+  }
+}
+
+const Preprocessor::Macro* Preprocessor::find_macro(const Token& tok)
+{
+  if (macros.empty())
+    return nullptr;
+
+  if (tok.kind == TokenKind::Identifier)
+    name.assign(data->ids.begin()+tok.i, data->ids.begin()+tok.j);
+  else if (tok.kind == TokenKind::Keyword && keyword_macros)
+    name = keywords_id[tok.i];
+  else
+    return nullptr;
+
+  auto it = macros.find(name);
+  return (it != macros.end() ? &it->second: nullptr);
+}
+
+bool Preprocessor::builtin_macro(const PPToken& t, PPTokens& output)
+{
+  const Token& tok = t.tok;
+  if (tok.kind != TokenKind::Identifier ||
+      tok.j - tok.i < 8 ||
+      data->ids[tok.i] != '_' ||
+      data->ids[tok.i+1] != '_')
+    return false;
+
+  const std::string id = data->id_text(tok);
+  if (id == "__LINE__") {
+    output.emplace_back(make_literal(TokenKind::NumericConstant,
+                                     std::to_string(tok.pos.line),
+                                     tok.pos), t.hs);
+    return true;
+  }
+  else if (id == "__FILE__") {
+    output.emplace_back(make_literal(TokenKind::Literal, data->fn, tok.pos), t.hs);
+    return true;
+  }
+  return false;
+}
+
+std::string Preprocessor::token_text(const Token& tok) const
+{
+  switch (tok.kind) {
+    case TokenKind::PPKeyword:
+      return pp_keywords_id[tok.i];
+    case TokenKind::Keyword:
+      return keywords_id[tok.i];
+    case TokenKind::Punctuator: {
+      std::string s(1, char(tok.i));
+      if (tok.j)
+        s.push_back(char(tok.j));
+      return s;
+    }
+    case TokenKind::Comment:
+      return data->comment_text(tok);
+    case TokenKind::PPHeaderName:
+    case TokenKind::Identifier:
+    case TokenKind::CharConstant:
+    case TokenKind::Literal:
+    case TokenKind::NumericConstant:
+      return data->id_text(tok);
+  }
+  return std::string();
+}
+
+// Creates a token from the given text (e.g. the result of ##)
+Token Preprocessor::make_token(const std::string& text, const TextPos& pos)
+{
+  const int c = (text.empty() ? 0: (uint8_t)text[0]);
+  if (std::isalpha(c) || c == '_') {
+    if (std::all_of(text.begin(), text.end(), is_id_chr)) {
+      auto it = keywords.find(text);
+      if (it != keywords.end())
+        return Token(TokenKind::Keyword, pos, int(it->second));
+    }
+    return make_literal(TokenKind::Identifier, text, pos);
+  }
+  else if (std::isdigit(c) ||
+           (c == '.' && text.size() > 1 && std::isdigit((uint8_t)text[1])))
+    return make_literal(TokenKind::NumericConstant, text, pos);
+  else if (c == '"' && text.size() >= 2 && text.back() == '"')
+    return make_literal(TokenKind::Literal, text.substr(1, text.size()-2), pos);
+  else if (c == '\'' && text.size() >= 2 && text.back() == '\'')
+    return make_literal(TokenKind::CharConstant, text.substr(1, text.size()-2), pos);
+  else if (text.size() == 1)
+    return Token(TokenKind::Punctuator, pos, c);
+  else if (text.size() == 2)
+    return Token(TokenKind::Punctuator, pos, c, (uint8_t)text[1]);
+  return make_literal(TokenKind::Identifier, text, pos);
+}
+
+Token Preprocessor::make_literal(TokenKind kind,
+                                 const std::string& text,
+                                 const TextPos& pos)
+{
+  const int i = int(data->ids.size());
+  data->ids.insert(data->ids.end(), text.begin(), text.end());
+  return Token(kind, pos, i, int(data->ids.size()));
+}
+
+std::string Preprocessor::stringize(const PPTokens& arg) const
+{
+  std::string s;
+  for (const PPToken& t : arg) {
+    if (t.tok.kind == TokenKind::Comment)
+      continue;
+    if (!s.empty())
+      s.push_back(' ');
+    if (t.tok.kind == TokenKind::Literal ||
+        t.tok.kind == TokenKind::CharConstant) {
+      // The quotes of a string literal are escaped too (the text of
+      // the new literal is without its own quotes)
+      const char* quote = (t.tok.kind == TokenKind::Literal ? "\\\"": "'");
+      s += quote;
+      for (char chr : token_text(t.tok)) {
+        if (chr == '"' || chr == '\\')
+          s.push_back('\\');
+        s.push_back(chr);
+      }
+      s += quote;
+    }
+    else
+      s += token_text(t.tok);
+  }
+  return s;
+}
+
+//////////////////////////////////////////////////////////////////////
+// Hide-sets (sorted vectors of macro ids interned in hide_sets)
+
+int Preprocessor::hs_intern(std::vector<int>&& set)
+{
+  auto it = hide_sets_ids.find(set);
+  if (it != hide_sets_ids.end())
+    return it->second;
+  int i = int(hide_sets.size());
+  hide_sets_ids[set] = i;
+  hide_sets.emplace_back(std::move(set));
+  return i;
+}
+
+bool Preprocessor::hs_contains(int hs, int macro_id) const
+{
+  const auto& set = hide_sets[hs];
+  return std::binary_search(set.begin(), set.end(), macro_id);
+}
+
+int Preprocessor::hs_add(int hs, int macro_id)
+{
+  if (hs_contains(hs, macro_id))
+    return hs;
+  std::vector<int> set = hide_sets[hs];
+  set.insert(std::upper_bound(set.begin(), set.end(), macro_id), macro_id);
+  return hs_intern(std::move(set));
+}
+
+int Preprocessor::hs_union(int a, int b)
+{
+  if (a == b || b == 0)
+    return a;
+  if (a == 0)
+    return b;
+  std::vector<int> set;
+  std::set_union(hide_sets[a].begin(), hide_sets[a].end(),
+                 hide_sets[b].begin(), hide_sets[b].end(),
+                 std::back_inserter(set));
+  return hs_intern(std::move(set));
+}
+
+int Preprocessor::hs_intersection(int a, int b)
+{
+  if (a == b)
+    return a;
+  if (a == 0 || b == 0)
+    return 0;
+  std::vector<int> set;
+  std::set_intersection(hide_sets[a].begin(), hide_sets[a].end(),
+                        hide_sets[b].begin(), hide_sets[b].end(),
+                        std::back_inserter(set));
+  return hs_intern(std::move(set));
+}
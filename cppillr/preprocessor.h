@@ -0,0 +1,122 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+#include "cppillr/lexer.h"
+
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Expands the object-like and function-like macros of a lexed file
+// (the macros defined with #define in the same file and with -D in
+// the command line). #define/#undef directives are removed from the
+// token stream, other directives are kept as they are.
+//
+// #if/#ifdef/#ifndef/#elif/#else conditions are evaluated with the
+// macros defined at that point (other macros are undefined), and the
+// tokens of disabled groups are removed. Conditions that cannot be
+// evaluated (e.g. they use function-like macros) enable the group
+// (and the next branches too).
+//
+// Recursive expansions are avoided using hide-sets (Prosser's
+// algorithm): each token has the set of macros that were expanded to
+// produce it, and a macro is not expanded again for those tokens.
+class Preprocessor {
+public:
+  Preprocessor(const PPMacros* cmdline_macros = nullptr)
+    : cmdline_macros(cmdline_macros) { }
+
+  // Replaces data.tokens with the preprocessed tokens
+  void process(LexData& data);
+
+private:
+  struct PPToken {
+    Token tok;
+    int hs;                     // Hide-set (index in hide_sets)
+    PPToken(const Token& tok, int hs = 0) : tok(tok), hs(hs) { }
+  };
+  using PPTokens = std::vector<PPToken>;
+
+  struct Macro {
+    int id;
+    bool function_like = false;
+    bool variadic = false;
+    std::vector<std::string> params;
+    std::vector<Token> body;
+    std::vector<int> body_params; // Index of the param of each body token or -1
+  };
+
+  // State of each #if group
+  struct Group {
+    bool taken;                 // A previous branch was enabled
+    bool active;                // The current branch is enabled
+  };
+
+  bool active() const {
+    return (groups.empty() || groups.back().active);
+  }
+
+  // Tokens to expand: a list of input tokens + tokens that were
+  // pushed back from expansions (pending.back() is the next token)
+  struct Source {
+    const PPTokens* input;
+    std::size_t i = 0;
+    PPTokens pending;
+    Source(const PPTokens* input) : input(input) { }
+    bool empty() const { return pending.empty() && i >= input->size(); }
+    PPToken next() {
+      if (!pending.empty()) {
+        PPToken t = pending.back();
+        pending.pop_back();
+        return t;
+      }
+      return (*input)[i++];
+    }
+    // Returns the next non-comment token without consuming it
+    const PPToken* peek() const;
+  };
+
+  void expand(Source& src, PPTokens& output, bool directives);
+  void directive(Source& src, const PPToken& begin, PPTokens& output);
+  void conditional(const int key, const int beg, const int end);
+  void define(const std::vector<Token>& line);
+  bool collect_args(Source& src, const Macro& m,
+                    std::vector<PPTokens>& args, int& rparen_hs,
+                    PPTokens& consumed);
+  void substitute(const Macro& m,
+                  const std::vector<PPTokens>& args,
+                  const TextPos& pos,
+                  int hs,
+                  PPTokens& output);
+  const Macro* find_macro(const Token& tok);
+  bool builtin_macro(const PPToken& t, PPTokens& output);
+
+  // Tokens creation
+  std::string token_text(const Token& tok) const;
+  Token make_token(const std::string& text, const TextPos& pos);
+  Token make_literal(TokenKind kind, const std::string& text, const TextPos& pos);
+  std::string stringize(const PPTokens& arg) const;
+
+  // Hide-sets
+  int hs_add(int hs, int macro_id);
+  int hs_union(int a, int b);
+  int hs_intersection(int a, int b);
+  bool hs_contains(int hs, int macro_id) const;
+  int hs_intern(std::vector<int>&& set);
+
+  const PPMacros* cmdline_macros;
+  LexData* data = nullptr;
+  std::unordered_map<std::string, Macro> macros;
+  int next_macro_id = 0;
+  bool keyword_macros = false;  // True if there is a macro called as a keyword
+  PPMacros defined_macros;      // Macros to evaluate #if conditions
+  std::vector<Group> groups;
+  std::string name;             // Buffer to find macros
+  std::vector<std::vector<int>> hide_sets;
+  std::map<std::vector<int>, int> hide_sets_ids;
+};
@@ -7,8 +7,12 @@
 
 #include "cppillr/lexer.h"
 #include "cppillr/parser.h"
+#include "utils/alloc_profile.h"
 
+#include <algorithm>
 #include <mutex>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
 // Data collected from the source code (tokens + AST nodes)
@@ -27,6 +31,7 @@ public:
   }
 
   void get_lex(int i, LexData& output) const {
+    ALLOC_TAG("LexData copy");
     std::unique_lock<std::mutex> l(lex_mutex);
     output = lex_data[i];
   }
@@ -37,3 +42,29 @@ public:
   }
 
 };
+
+// Returns the elements (e.g. LexData or ParserData) in the order of
+// the given input files (Program data is in the order that files were
+// processed). Elements of other files go at the end.
+template<typename T>
+std::vector<const T*> in_input_order(const std::vector<std::string>& files,
+                                     const std::vector<T>& items)
+{
+  std::unordered_map<std::string, int> input_order;
+  for (int i=0; i<int(files.size()); ++i)
+    input_order.insert(std::make_pair(files[i], i));
+
+  auto order = [&input_order](const T* item) -> int {
+    auto it = input_order.find(item->fn);
+    return (it != input_order.end() ? it->second: int(input_order.size()));
+  };
+
+  std::vector<const T*> result;
+  for (const auto& item : items)
+    result.push_back(&item);
+  std::stable_sort(result.begin(), result.end(),
+                   [&order](const T* a, const T* b) {
+                     return order(a) < order(b);
+                   });
+  return result;
+}
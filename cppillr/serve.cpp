@@ -0,0 +1,638 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/serve.h"
+
+#include "cppillr/includes.h"
+#include "cppillr/options.h"
+#include "cppillr/preprocessor.h"
+#include "cppillr/program.h"
+#include "cppillr/stats.h"
+#include "cppillr/token_cursor.h"
+#include "utils/file_stamp.h"
+#include "utils/out_buffer.h"
+#include "utils/thread_pool.h"
+#include "utils/timers.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+#ifndef _WIN32
+  #include <poll.h>
+  #include <signal.h>
+  #include <sys/socket.h>
+  #include <sys/stat.h>
+  #include <sys/un.h>
+  #include <unistd.h>
+#endif
+
+namespace serve {
+
+#ifdef _WIN32
+
+int run(const Options& options, thread_pool& pool)
+{
+  std::printf("serve: Unix domain sockets are not supported in this platform\n");
+  return 1;
+}
+
+#else
+
+namespace {
+
+// Requests over all the files (find, stats, files, and functions
+// without a file) check the loaded files at most once in this
+// interval, so a sequence of queries costs one stat() per file
+const auto update_all_interval = std::chrono::milliseconds(500);
+
+// A client that sends a longer line without a '\n' is disconnected
+const std::size_t max_request_line = 64*1024;
+
+volatile sig_atomic_t interrupted = 0;
+
+void on_signal(int)
+{
+  interrupted = 1;
+}
+
+// State of each file loaded in the server (the tokens and AST are in
+// the Program with the same index)
+struct FileState {
+  std::string fn;
+  FileStamp stamp;
+  int64_t checked = 0;          // When the stamp was taken
+  bool missing = false;         // The file couldn't be read
+  std::string error;            // Error lexing/parsing the file
+  int lines = 0;
+};
+
+std::vector<std::string> split_args(const std::string& line)
+{
+  std::vector<std::string> args;
+  std::size_t i = 0;
+  while (i < line.size()) {
+    const std::size_t j = line.find(' ', i);
+    const std::size_t end = (j == std::string::npos ? line.size(): j);
+    if (end > i)
+      args.push_back(line.substr(i, end-i));
+    i = end+1;
+  }
+  return args;
+}
+
+class Server {
+public:
+  Server(const Options& options, thread_pool& pool)
+    : options(options)
+    , pool(pool) { }
+
+  bool quit() const { return quit_; }
+  int nfiles() const { return int(files.size()); }
+  int nrequests() const { return requests; }
+
+  // Lexes/parses the initial files
+  void load(const std::vector<std::string>& fns) {
+    std::vector<int> all;
+    for (const auto& fn : fns)
+      all.push_back(add_file(fn));
+    lex_files(all);
+  }
+
+  // Processes the request line and writes the whole response
+  // (header + payload) in "response"
+  void handle(const std::string& line, OutBuffer& response);
+
+private:
+  int add_file(const std::string& fn);
+  bool is_modified(FileState& s);
+  void update(const std::vector<int>& files);
+  void update_all();
+  void lex_files(const std::vector<int>& files);
+  void lex_file(int i);
+
+  bool cmd_lex(const std::string& fn, OutBuffer& out);
+  bool cmd_functions(int i, OutBuffer& out);
+  bool cmd_find(const std::string& name, OutBuffer& out);
+  bool cmd_includes(int i, OutBuffer& out);
+  void cmd_stats(OutBuffer& out);
+  void cmd_files(OutBuffer& out);
+
+  void file_summary(int i, OutBuffer& out);
+  void function_line(const FileState& s, const FunctionNode* f, OutBuffer& out);
+  bool file_error(int i, OutBuffer& out);
+
+  const Options& options;
+  thread_pool& pool;
+  Program prog;
+  std::vector<FileState> files;
+  std::unordered_map<std::string, int> index;
+  std::atomic<int> lexed{0};
+  std::chrono::steady_clock::time_point updated_all;
+  bool updated_all_once = false;
+  int requests = 0;
+  bool quit_ = false;
+};
+
+int Server::add_file(const std::string& fn)
+{
+  const std::string path = includes::normalize_path(fn);
+  auto it = index.find(path);
+  if (it != index.end())
+    return it->second;
+
+  const int i = int(files.size());
+  files.emplace_back();
+  files.back().fn = path;
+  prog.lex_data.emplace_back();
+  prog.lex_data.back().readed_bytes = 0;
+  prog.parser_data.emplace_back();
+  index[path] = i;
+  return i;
+}
+
+// Returns true if the file must be lexed again. Unchanged files cost
+// only a stat() call. Touched files are hashed to compare their
+// content, and files modified just before they were checked are
+// hashed too (see is_racy_stamp()).
+bool Server::is_modified(FileState& s)
+{
+  const int64_t now = file_stamp_now();
+  FileStamp stamp;
+  if (!get_file_stamp(s.fn, stamp))
+    return !s.missing;
+  if (s.missing || stamp.size != s.stamp.size)
+    return true;
+  if (stamp.mtime == s.stamp.mtime && !is_racy_stamp(stamp, s.checked))
+    return false;
+  if (!hash_file_content(s.fn, stamp) ||
+      stamp.hash != s.stamp.hash)
+    return true;
+
+  // Same content, we don't need to hash it again
+  s.stamp = stamp;
+  s.checked = now;
+  return false;
+}
+
+void Server::update(const std::vector<int>& indexes)
+{
+  std::vector<int> modified;
+  for (int i : indexes)
+    if (is_modified(files[i]))
+      modified.push_back(i);
+  lex_files(modified);
+}
+
+void Server::update_all()
+{
+  const auto now = std::chrono::steady_clock::now();
+  if (updated_all_once && now - updated_all < update_all_interval)
+    return;
+  updated_all_once = true;
+  updated_all = now;
+
+  std::vector<int> all(files.size());
+  for (int i=0; i<int(all.size()); ++i)
+    all[i] = i;
+  update(all);
+}
+
+void Server::lex_files(const std::vector<int>& indexes)
+{
+  // Avoid the thread pool round-trip for the common case of one
+  // modified file
+  if (indexes.size() == 1) {
+    lex_file(indexes[0]);
+    return;
+  }
+  for (int i : indexes)
+    pool.execute([this, i]{ lex_file(i); });
+  pool.wait_all();
+}
+
+void Server::lex_file(const int i)
+{
+  FileState& s = files[i];
+  timers::Scope timer_lex("lex", &s.fn);
+
+  // The stamp is taken before lexing the file, so if it's modified
+  // while we lex it, we'll lex it again in the next request
+  s.checked = file_stamp_now();
+  s.stamp = FileStamp();
+  s.missing = (!get_file_stamp(s.fn, s.stamp) ||
+               !hash_file_content(s.fn, s.stamp));
+  s.error.clear();
+
+  LexData lex;
+  lex.fn = s.fn;
+  lex.readed_bytes = 0;
+  ParserData parser;
+  parser.fn = s.fn;
+
+  if (s.missing) {
+    s.error = s.fn + ": cannot read file";
+  }
+  else {
+    try {
+      Lexer lexer(options.lexer_macros());
+      lexer.set_throw_errors(true);
+      if (lexer.lex(s.fn) != Lexer::Result::OK) {
+        s.error = s.fn + ": cannot open file";
+      }
+      else {
+        lex = lexer.move_data();
+        if (options.preprocess) {
+          Preprocessor pp(&options.macros);
+          pp.process(lex);
+        }
+        if (options.compact_tokens)
+          compress_tokens(lex);
+
+        Parser p(i);
+        p.set_throw_errors(true);
+        p.parse(lex);
+        parser = p.move_data();
+      }
+    }
+    catch (const SourceError& ex) {
+      s.error = ex.what();
+    }
+  }
+
+  s.lines = count_lines(lex);
+  prog.lex_data[i] = std::move(lex);
+  prog.parser_data[i] = std::move(parser);
+  ++lexed;
+}
+
+void Server::handle(const std::string& line, OutBuffer& response)
+{
+  timers::Scope timer_request("request");
+  ++requests;
+
+  const std::vector<std::string> args = split_args(line);
+  const std::string cmd = (args.empty() ? std::string(): args[0]);
+  OutBuffer out;
+  bool ok = true;
+
+  if (cmd == "lex" && args.size() == 2)
+    ok = cmd_lex(args[1], out);
+  else if (cmd == "functions" && args.size() <= 2) {
+    if (args.size() == 2) {
+      const int i = add_file(args[1]);
+      update({ i });
+      ok = cmd_functions(i, out);
+    }
+    else {
+      update_all();
+      for (int i=0; i<int(files.size()); ++i)
+        cmd_functions(i, out);
+    }
+  }
+  else if (cmd == "find" && args.size() == 2)
+    ok = cmd_find(args[1], out);
+  else if (cmd == "includes" && args.size() == 2)
+    ok = cmd_includes(add_file(args[1]), out);
+  else if (cmd == "stats" && args.size() == 1)
+    cmd_stats(out);
+  else if (cmd == "files" && args.size() == 1)
+    cmd_files(out);
+  else if (cmd == "ping" && args.size() == 1)
+    out.write("pong\n");
+  else if (cmd == "shutdown" && args.size() == 1) {
+    out.write("bye\n");
+    quit_ = true;
+  }
+  else {
+    out.write("invalid request: ");
+    out.write(line);
+    out.put('\n');
+    ok = false;
+  }
+
+  response.write(ok ? ok_status: error_status);
+  response.put(' ');
+  response.write_int(int(out.size()));
+  response.put('\n');
+  response.write(out.str());
+}
+
+bool Server::cmd_lex(const std::string& fn, OutBuffer& out)
+{
+  const int i = add_file(fn);
+  const int before = lexed;
+  update({ i });
+  if (file_error(i, out))
+    return false;
+  file_summary(i, out);
+  out.write(lexed != before ? " lexed\n": " cached\n");
+  return true;
+}
+
+bool Server::cmd_functions(const int i, OutBuffer& out)
+{
+  if (file_error(i, out))
+    return false;
+  for (const FunctionNode* f : prog.parser_data[i].functions)
+    function_line(files[i], f, out);
+  return true;
+}
+
+bool Server::cmd_find(const std::string& name, OutBuffer& out)
+{
+  update_all();
+  for (int i=0; i<int(files.size()); ++i) {
+    for (const FunctionNode* f : prog.parser_data[i].functions)
+      if (f->name == name)
+        function_line(files[i], f, out);
+  }
+  return true;
+}
+
+bool Server::cmd_includes(const int i, OutBuffer& out)
+{
+  update({ i });
+  if (file_error(i, out))
+    return false;
+
+  const LexData& data = prog.lex_data[i];
+  if (data.pragma_once) {
+    out.write(data.fn);
+    out.write(": #pragma once\n");
+  }
+  else if (!data.include_guard.empty()) {
+    out.write(data.fn);
+    out.write(": include guard ");
+    out.write(data.include_guard);
+    out.put('\n');
+  }
+
+  const int n = data.ntokens();
+  for (TokenCursor it(data); it.index()+2 < n; ++it) {
+    if (it->kind != TokenKind::PPBegin)
+      continue;
+    TokenCursor key(it);
+    ++key;
+    if (key->kind != TokenKind::PPKeyword ||
+        key->i != pp_key_include)
+      continue;
+    TokenCursor arg(key);
+    ++arg;
+    if (arg->kind == TokenKind::PPHeaderName) {
+      out.write(data.fn);
+      out.put(':');
+      out.write_int(arg->pos.line);
+      out.write(": #include ");
+      out.write(&data.ids[0]+arg->i, &data.ids[0]+arg->j);
+      out.put('\n');
+      it = arg;
+    }
+  }
+  return true;
+}
+
+void Server::cmd_stats(OutBuffer& out)
+{
+  update_all();
+
+  int errors = 0, tokens = 0, lines = 0, functions = 0;
+  int64_t bytes = 0;
+  for (int i=0; i<int(files.size()); ++i) {
+    if (!files[i].error.empty())
+      ++errors;
+    tokens += prog.lex_data[i].ntokens();
+    lines += files[i].lines;
+    functions += int(prog.parser_data[i].functions.size());
+    bytes += prog.lex_data[i].readed_bytes;
+  }
+
+  char buf[512];
+  std::snprintf(buf, sizeof(buf),
+                "files %d\n"
+                "errors %d\n"
+                "bytes %lld\n"
+                "tokens %d\n"
+                "lines %d\n"
+                "functions %d\n"
+                "lexed %d\n"
+                "requests %d\n",
+                int(files.size()), errors, (long long)bytes,
+                tokens, lines, functions, int(lexed), requests);
+  out.write(buf);
+}
+
+void Server::cmd_files(OutBuffer& out)
+{
+  update_all();
+  for (int i=0; i<int(files.size()); ++i) {
+    file_summary(i, out);
+    if (!files[i].error.empty())
+      out.write(" error");
+    out.put('\n');
+  }
+}
+
+// "fn: tokens=N lines=N functions=N bytes=N"
+void Server::file_summary(const int i, OutBuffer& out)
+{
+  out.write(files[i].fn);
+  out.write(": tokens=");
+  out.write_int(prog.lex_data[i].ntokens());
+  out.write(" lines=");
+  out.write_int(files[i].lines);
+  out.write(" functions=");
+  out.write_int(int(prog.parser_data[i].functions.size()));
+  out.write(" bytes=");
+  out.write_int(prog.lex_data[i].readed_bytes);
+}
+
+// "fn:line:col: int f(int a, char b)"
+void Server::function_line(const FileState& s,
+                           const FunctionNode* f,
+                           OutBuffer& out)
+{
+  out.write(s.fn);
+  out.put(':');
+  out.write_int(f->pos.line);
+  out.put(':');
+  out.write_int(f->pos.col);
+  out.write(": ");
+  out.write(keywords_id[f->builtin_type]);
+  out.put(' ');
+  out.write(f->name);
+  out.put('(');
+  bool first = true;
+  for (const ParamNode* p : f->params->params) {
+    if (first)
+      first = false;
+    else
+      out.write(", ");
+    out.write(keywords_id[p->builtin_type]);
+    if (!p->name.empty()) {
+      out.put(' ');
+      out.write(p->name);
+    }
+  }
+  out.write(")\n");
+}
+
+// Writes the error of the file "i" (if it has one)
+bool Server::file_error(const int i, OutBuffer& out)
+{
+  if (files[i].error.empty())
+    return false;
+  out.write(files[i].error);
+  out.put('\n');
+  return true;
+}
+
+bool write_all(int fd, const std::string& buf)
+{
+  const char* p = buf.data();
+  std::size_t n = buf.size();
+  while (n > 0) {
+    const ssize_t w = ::write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += w;
+    n -= std::size_t(w);
+  }
+  return true;
+}
+
+struct Client {
+  int fd;
+  std::string input;
+};
+
+} // anonymous namespace
+
+int run(const Options& options, thread_pool& pool)
+{
+  if (options.socket.empty()) {
+    std::printf("serve: specify the socket path with -socket PATH\n");
+    return 1;
+  }
+
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (options.socket.size() >= sizeof(addr.sun_path)) {
+    std::printf("%s: socket path too long\n", options.socket.c_str());
+    return 1;
+  }
+  std::strcpy(addr.sun_path, options.socket.c_str());
+
+  Server server(options, pool);
+  {
+    timers::Scope timer_load("load files");
+    server.load(options.parse_files);
+  }
+
+  // Remove the socket of a previous server (but nothing else)
+  struct stat st;
+  if (lstat(options.socket.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    unlink(options.socket.c_str());
+
+  const int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0 ||
+      bind(listen_fd, (const sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(listen_fd, 16) != 0) {
+    std::printf("%s: cannot listen (%s)\n",
+                options.socket.c_str(), std::strerror(errno));
+    if (listen_fd >= 0)
+      close(listen_fd);
+    return 1;
+  }
+
+  struct sigaction sa;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;    // Without SA_RESTART to interrupt poll()
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+  signal(SIGPIPE, SIG_IGN);     // Clients can disconnect at any time
+
+  std::printf("serve: listening on %s (%d files)\n",
+              options.socket.c_str(), server.nfiles());
+  std::fflush(stdout);
+
+  // All requests are processed in this thread (one at a time), the
+  // thread pool is used only to lex several modified files
+  std::vector<Client> clients;
+  std::vector<pollfd> fds;
+  OutBuffer response;
+  char buf[4096];
+  while (!server.quit() && !interrupted) {
+    fds.clear();
+    fds.push_back(pollfd{ listen_fd, POLLIN, 0 });
+    for (const Client& c : clients)
+      fds.push_back(pollfd{ c.fd, POLLIN, 0 });
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    // Backwards to remove disconnected clients
+    for (int k=int(clients.size())-1; k>=0; --k) {
+      if (!(fds[k+1].revents & (POLLIN | POLLHUP | POLLERR)))
+        continue;
+
+      Client& c = clients[k];
+      const ssize_t n = read(c.fd, buf, sizeof(buf));
+      bool closed = (n == 0 || (n < 0 && errno != EINTR));
+      if (n > 0) {
+        c.input.append(buf, n);
+        std::size_t eol;
+        while (!server.quit() &&
+               (eol = c.input.find('\n')) != std::string::npos) {
+          std::string line = c.input.substr(0, eol);
+          c.input.erase(0, eol+1);
+          if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+          response.clear();
+          server.handle(line, response);
+          if (!write_all(c.fd, response.str())) {
+            closed = true;
+            break;
+          }
+        }
+        if (c.input.size() > max_request_line)
+          closed = true;
+      }
+      if (closed) {
+        close(c.fd);
+        clients.erase(clients.begin()+k);
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      const int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd >= 0)
+        clients.push_back(Client{ fd, std::string() });
+    }
+  }
+
+  for (const Client& c : clients)
+    close(c.fd);
+  close(listen_fd);
+  unlink(options.socket.c_str());
+
+  std::printf("serve: stopped after %d requests\n", server.nrequests());
+  return 0;
+}
+
+#endif // _WIN32
+
+} // namespace serve
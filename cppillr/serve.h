@@ -0,0 +1,48 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+#include <string>
+
+class thread_pool;
+struct Options;
+
+namespace serve {
+
+// Protocol of the "serve" command over the Unix domain socket.
+//
+// Each request is one line of text with a command and its arguments
+// separated by spaces (file names cannot contain spaces):
+//
+//   lex FILE          Lexes/parses FILE if it changed (or it's new)
+//   functions [FILE]  Functions of FILE (or of all files)
+//   find NAME         Functions with the given name
+//   includes FILE     #include directives of FILE
+//   stats             Files, tokens, lines, and functions counters
+//   files             Loaded files
+//   ping              Replies "pong"
+//   shutdown          Stops the server
+//
+// Each response is a header line with "ok" or "error" and the number
+// of bytes of the payload, followed by the payload (text lines):
+//
+//   ok 12\n
+//   function f()\n
+//
+// Files referenced by a request are checked before replying (a
+// stat() call if the file didn't change), and lexed again if they
+// were modified. Requests over all the files (find, stats, files, and
+// functions without FILE) check all of them at most once every
+// 500ms. A request line longer than 64KB closes the connection.
+const char* const ok_status = "ok";
+const char* const error_status = "error";
+
+// "serve" command: lexes/parses the input files and keeps them in
+// memory answering requests in the -socket path until "shutdown" is
+// received (or the process is interrupted).
+int run(const Options& options, thread_pool& pool);
+
+} // namespace serve
@@ -0,0 +1,40 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/stats.h"
+
+#include "cppillr/lexer.h"
+#include "cppillr/token_cursor.h"
+
+#include <cstdio>
+
+int count_lines(const LexData& data)
+{
+  int nlines = 0;
+  int line = 0;
+  for (TokenCursor it(data); !it.at_end(); ++it) {
+    if (line != it->pos.line) {
+      line = it->pos.line;
+      ++nlines;
+    }
+  }
+  return nlines;
+}
+
+void KeywordStats::add(const LexData& data)
+{
+  for (TokenCursor it(data); !it.at_end(); ++it) {
+    if (it->kind == TokenKind::Keyword)
+      ++keywords[it->i];
+  }
+}
+
+void KeywordStats::print() const
+{
+  for (int i=0; i<int(MaxKeyword); ++i) {
+    if (keywords[i] > 0)
+      std::printf("%d\t%s\n", keywords[i], keywords_id[i].c_str());
+  }
+}
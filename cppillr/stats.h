@@ -0,0 +1,38 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+#include "cppillr/keywords.h"
+
+#include <array>
+#include <cstddef>
+
+struct LexData;
+
+// Number of lines with tokens (non-blank lines)
+int count_lines(const LexData& data);
+
+// Counter of each keyword used in the input files
+class KeywordStats {
+  std::array<std::size_t, MaxKeyword> keywords;
+public:
+  KeywordStats() { keywords.fill(0); }
+
+  void add(const LexData& data);
+
+  // Adds/subtracts the counters of other files (e.g. to update the
+  // totals when a file changes)
+  void add(const KeywordStats& other) {
+    for (int i=0; i<int(MaxKeyword); ++i)
+      keywords[i] += other.keywords[i];
+  }
+  void subtract(const KeywordStats& other) {
+    for (int i=0; i<int(MaxKeyword); ++i)
+      keywords[i] -= other.keywords[i];
+  }
+
+  void print() const;
+};
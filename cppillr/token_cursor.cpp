@@ -0,0 +1,174 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/token_cursor.h"
+
+#include "utils/alloc_profile.h"
+#include "utils/varint.h"
+
+#include <algorithm>
+
+namespace {
+
+// Tokens with "i" and "j" pointing to LexData::ids or
+// LexData::comments
+bool uses_ids(TokenKind kind)
+{
+  switch (kind) {
+    case TokenKind::PPHeaderName:
+    case TokenKind::Identifier:
+    case TokenKind::CharConstant:
+    case TokenKind::Literal:
+    case TokenKind::NumericConstant:
+      return true;
+  }
+  return false;
+}
+
+} // anonymous namespace
+
+void compress_tokens(LexData& data)
+{
+  ALLOC_TAG("compact tokens");
+  if (data.compact)
+    return;
+
+  const std::vector<Token>& tokens = data.tokens;
+  const int n = int(tokens.size());
+  CompactTokens& c = data.compact_tokens;
+  c.ntokens = n;
+  c.blocks.clear();
+  c.bytes.clear();
+  c.blocks.reserve((n + CompactTokens::BlockSize - 1) / CompactTokens::BlockSize);
+  c.bytes.reserve(n*3);
+
+  TextPos pos;
+  int ids_end = 0;
+  int comments_end = 0;
+  int run_end = 0;
+
+  for (int i=0; i<n; ++i) {
+    const Token& tok = tokens[i];
+
+    if ((i % CompactTokens::BlockSize) == 0) {
+      c.blocks.push_back(CompactTokens::Block{
+          uint32_t(c.bytes.size()), pos.line, pos.col, ids_end, comments_end });
+    }
+
+    // Start a new run of tokens of the same kind
+    if (i == run_end) {
+      const int block_end = std::min(
+        n, (i / CompactTokens::BlockSize + 1) * CompactTokens::BlockSize);
+      run_end = i+1;
+      while (run_end < block_end &&
+             run_end - i < 16 &&
+             tokens[run_end].kind == tok.kind)
+        ++run_end;
+      c.bytes.push_back(uint8_t(int(tok.kind) | ((run_end - i - 1) << 4)));
+    }
+
+    write_varint(c.bytes, zigzag(tok.pos.line - pos.line));
+    if (tok.pos.line == pos.line)
+      write_varint(c.bytes, zigzag(tok.pos.col - pos.col));
+    else
+      write_varint(c.bytes, uint32_t(tok.pos.col));
+    pos = tok.pos;
+
+    if (tok.kind == TokenKind::Comment) {
+      write_varint(c.bytes, zigzag(tok.i - comments_end));
+      write_varint(c.bytes, uint32_t(tok.j - tok.i));
+      comments_end = tok.j;
+    }
+    else if (uses_ids(tok.kind)) {
+      write_varint(c.bytes, zigzag(tok.i - ids_end));
+      write_varint(c.bytes, uint32_t(tok.j - tok.i));
+      ids_end = tok.j;
+    }
+    else {
+      write_varint(c.bytes, uint32_t(tok.i));
+      write_varint(c.bytes, uint32_t(tok.j));
+    }
+  }
+
+  c.bytes.shrink_to_fit();
+  data.compact = true;
+  std::vector<Token>().swap(data.tokens);
+}
+
+void TokenCursor::seek(int i)
+{
+  if (i < 0)
+    i = 0;
+  if (i >= n) {
+    this->i = n;
+    tok = Token(TokenKind::Eof, TextPos());
+    return;
+  }
+
+  if (!data->compact) {
+    this->i = i;
+    tok = data->tokens[i];
+    return;
+  }
+
+  // Continue decoding from the current token if we are in the same
+  // block (e.g. skipping a few tokens forward)
+  if (p &&
+      i >= this->i &&
+      this->i / CompactTokens::BlockSize == i / CompactTokens::BlockSize) {
+    while (this->i < i)
+      operator++();
+    return;
+  }
+
+  const int b = i / CompactTokens::BlockSize;
+  const CompactTokens::Block& block = data->compact_tokens.blocks[b];
+  p = &data->compact_tokens.bytes[block.offset];
+  tok.pos = TextPos(block.line, block.col);
+  ids_end = block.ids_end;
+  comments_end = block.comments_end;
+  run_left = 0;
+
+  this->i = b * CompactTokens::BlockSize;
+  decode();
+  while (this->i < i) {
+    ++this->i;
+    decode();
+  }
+}
+
+void TokenCursor::decode()
+{
+  if (run_left == 0) {
+    run_kind = (*p & 15);
+    run_left = (*p >> 4) + 1;
+    ++p;
+  }
+  --run_left;
+  tok.kind = TokenKind(run_kind);
+
+  const int dline = unzigzag(read_varint(p));
+  if (dline == 0)
+    tok.pos.col += unzigzag(read_varint(p));
+  else {
+    tok.pos.line += dline;
+    tok.pos.col = int(read_varint(p));
+  }
+
+  if (tok.kind == TokenKind::Comment) {
+    tok.i = comments_end + unzigzag(read_varint(p));
+    tok.j = tok.i + int(read_varint(p));
+    comments_end = tok.j;
+  }
+  else if (uses_ids(tok.kind)) {
+    tok.i = ids_end + unzigzag(read_varint(p));
+    tok.j = tok.i + int(read_varint(p));
+    ids_end = tok.j;
+  }
+  else {
+    tok.i = int(read_varint(p));
+    tok.j = int(read_varint(p));
+  }
+}
@@ -0,0 +1,88 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+#include "cppillr/lexer.h"
+
+#include <cstdint>
+
+// Compresses LexData::tokens into LexData::compact_tokens (and frees
+// the tokens vector). The tokens are stored in blocks of
+// CompactTokens::BlockSize tokens, each token as:
+//
+// * Kinds are run-length encoded: a byte with the kind (4 low bits)
+//   and the number of tokens-1 (4 high bits) of the run precedes the
+//   tokens of the run (runs don't cross blocks).
+// * Position: varint with the zigzag delta of the line, and the
+//   zigzag delta of the column (if it's in the same line) or the
+//   column (in a new line).
+// * Payload: for tokens that reference the ids/comments pools,
+//   the zigzag delta of "i" from the end of the previous payload of
+//   the same pool, and the length (j-i). For other tokens, "i" and "j"
+//   as varints (keyword indexes, punctuator chars).
+void compress_tokens(LexData& data);
+
+// Iterates the tokens of a LexData (compressed or not), decoding the
+// compressed ones on the fly:
+//
+//   for (TokenCursor it(data); !it.at_end(); ++it)
+//     it->kind ...
+//
+// When the cursor reaches the end, the current token is a
+// TokenKind::Eof token.
+class TokenCursor {
+public:
+  // Cursor at the end of an empty list of tokens
+  TokenCursor()
+    : data(nullptr)
+    , i(0)
+    , n(0)
+    , tok(TokenKind::Eof, TextPos()) { }
+
+  TokenCursor(const LexData& data, const int i = 0)
+    : data(&data)
+    , n(data.ntokens())
+    , tok(TokenKind::Eof, TextPos()) {
+    seek(i);
+  }
+
+  bool at_end() const { return i >= n; }
+  int index() const { return i; }
+
+  const Token& operator*() const { return tok; }
+  const Token* operator->() const { return &tok; }
+
+  TokenCursor& operator++() {
+    if (++i >= n) {
+      i = n;
+      tok = Token(TokenKind::Eof, TextPos());
+    }
+    else if (data->compact)
+      decode();
+    else
+      tok = data->tokens[i];
+    return *this;
+  }
+
+  // Moves the cursor to the token "i" (only the block of the given
+  // token is decoded in the compact case)
+  void seek(int i);
+
+private:
+  void decode();
+
+  const LexData* data;
+  int i;
+  int n;
+  Token tok;
+
+  // State to decode the next token of compact_tokens
+  const uint8_t* p = nullptr;
+  int run_kind = 0;
+  int run_left = 0;
+  int ids_end = 0;
+  int comments_end = 0;
+};
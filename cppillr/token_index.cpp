@@ -0,0 +1,684 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/token_index.h"
+
+#include "cppillr/find.h"
+#include "cppillr/options.h"
+#include "cppillr/preprocessor.h"
+#include "cppillr/token_cursor.h"
+#include "utils/alloc_profile.h"
+#include "utils/file_stamp.h"
+#include "utils/hash.h"
+#include "utils/mapped_file.h"
+#include "utils/out_buffer.h"
+#include "utils/scoped_fclose.h"
+#include "utils/thread_pool.h"
+#include "utils/timers.h"
+#include "utils/varint.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <unordered_map>
+
+namespace tokindex {
+
+namespace {
+
+// Terms are merged in shards (by the highest bits of the hash), each
+// shard in its own task
+const int shard_bits = 6;
+const int nshards = (1 << shard_bits);
+
+uint64_t config_hash(const Options& options)
+{
+  uint64_t h = fnv1a(options.preprocess ? "P\n": "\n");
+  return fnv1a(options.macros.key(), h);
+}
+
+uint64_t trigram_hash(uint64_t a, uint64_t b, uint64_t c)
+{
+  const uint64_t v[3] = { a, b, c };
+  return fnv1a(v, sizeof(v));
+}
+
+// Occurrence of a trigram in a file
+struct Gram {
+  uint64_t hash;
+  uint32_t offset;
+};
+
+// Occurrence of a trigram in the whole index
+struct Posting {
+  uint64_t hash;
+  uint32_t file;
+  uint32_t offset;
+};
+
+// Trigrams of the file sorted by hash (and offset)
+void extract_grams(const LexData& data, std::vector<Gram>& grams)
+{
+  grams.clear();
+  grams.reserve(data.ntokens());
+  uint64_t h0 = 0, h1 = 0;
+  uint32_t k = 0;
+  for (TokenCursor it(data); !it.at_end(); ++it) {
+    if (it->kind == TokenKind::Comment)
+      continue;
+    const uint64_t h = token_hash(data, *it);
+    if (k >= 2)
+      grams.push_back(Gram{ trigram_hash(h0, h1, h), k-2 });
+    h0 = h1;
+    h1 = h;
+    ++k;
+  }
+  std::stable_sort(grams.begin(), grams.end(),
+                   [](const Gram& a, const Gram& b) {
+                     return a.hash < b.hash;
+                   });
+}
+
+// Mapped index file
+class TokIndexReader {
+  MappedFile file;
+public:
+  const uint8_t* base = nullptr;
+  const TokIndexHeader* h = nullptr;
+  const TokIndexFile* files = nullptr;
+  const TokIndexTerm* terms = nullptr;
+  const char* strings = nullptr;
+
+  bool open(const std::string& fn) {
+    if (!file.open(fn) ||
+        file.size() < sizeof(TokIndexHeader))
+      return false;
+
+    base = file.data();
+    h = (const TokIndexHeader*)base;
+    if (h->magic != tokindex_magic ||
+        h->version != tokindex_version ||
+        h->files_offset < sizeof(TokIndexHeader) ||
+        h->files_offset > h->terms_offset ||
+        h->terms_offset > h->postings_offset ||
+        h->postings_offset > h->tokens_offset ||
+        h->tokens_offset > h->strings_offset ||
+        h->strings_offset > file.size() ||
+        h->nfiles*sizeof(TokIndexFile) > h->terms_offset - h->files_offset ||
+        h->nterms*sizeof(TokIndexTerm) > h->postings_offset - h->terms_offset)
+      return false;
+
+    files = (const TokIndexFile*)(base + h->files_offset);
+    terms = (const TokIndexTerm*)(base + h->terms_offset);
+    strings = (const char*)(base + h->strings_offset);
+
+    // Check the ranges of the stored tokens, and that the file names
+    // are zero-terminated inside the strings pool
+    const std::size_t strings_size = file.size() - h->strings_offset;
+    for (uint32_t i=0; i<h->nfiles; ++i) {
+      const TokIndexFile& f = files[i];
+      const uint64_t size = (uint64_t(f.nblocks)*sizeof(CompactTokens::Block) +
+                             f.nbytes + f.nids);
+      if (f.tokens < h->tokens_offset ||
+          f.tokens > h->strings_offset ||
+          size > h->strings_offset - f.tokens ||
+          f.nblocks != (uint64_t(f.ntokens) + CompactTokens::BlockSize - 1) / CompactTokens::BlockSize ||
+          f.fn >= strings_size ||
+          !std::memchr(strings + f.fn, 0, strings_size - f.fn))
+        return false;
+    }
+
+    // Check the ranges of the postings
+    for (uint32_t i=0; i<h->nterms; ++i) {
+      const TokIndexTerm& t = terms[i];
+      if (t.postings < h->postings_offset ||
+          t.postings > h->tokens_offset ||
+          t.size > h->tokens_offset - t.postings)
+        return false;
+    }
+    return true;
+  }
+
+  void close() {
+    file.close();
+    h = nullptr;
+  }
+
+  const TokIndexTerm* find_term(uint64_t hash) const {
+    auto end = terms + h->nterms;
+    auto it = std::lower_bound(
+      terms, end, hash,
+      [](const TokIndexTerm& t, uint64_t hash) { return t.hash < hash; });
+    return (it != end && it->hash == hash ? it: nullptr);
+  }
+
+  // Creates a LexData with the compressed tokens of the file "i"
+  void load_tokens(uint32_t i, LexData& data) const {
+    const TokIndexFile& f = files[i];
+    const uint8_t* p = base + f.tokens;
+    data.fn = strings + f.fn;
+    data.readed_bytes = int(f.bytes);
+    data.compact = true;
+
+    CompactTokens& c = data.compact_tokens;
+    c.ntokens = int(f.ntokens);
+    c.blocks.resize(f.nblocks);
+    if (f.nblocks)
+      std::memcpy(c.blocks.data(), p, f.nblocks*sizeof(CompactTokens::Block));
+    p += f.nblocks*sizeof(CompactTokens::Block);
+    c.bytes.assign(p, p+f.nbytes);
+    p += f.nbytes;
+    data.ids.assign(p, p+f.nids);
+  }
+};
+
+// File of the new index
+struct Entry {
+  std::string fn;
+  FileStamp stamp;
+  LexData data;
+  std::vector<Gram> grams;
+  int shards[nshards+1];        // Range of grams of each shard
+  bool ok = false;
+};
+
+// Terms and postings of a shard
+struct Shard {
+  std::vector<TokIndexTerm> terms;
+  std::vector<uint8_t> postings;
+};
+
+// Reuses the tokens of the previous index if the file wasn't
+// modified, or lexes it again
+bool load_entry(const Options& options,
+                const TokIndexReader* previous,
+                const std::unordered_map<std::string, uint32_t>& previous_files,
+                Entry& entry,
+                std::atomic<int>& lexed)
+{
+  if (!get_file_stamp(entry.fn, entry.stamp)) {
+    std::printf("%s: cannot open file\n", entry.fn.c_str());
+    return false;
+  }
+
+  const TokIndexFile* old = nullptr;
+  uint32_t old_i = 0;
+  if (previous) {
+    auto it = previous_files.find(entry.fn);
+    if (it != previous_files.end()) {
+      old_i = it->second;
+      old = previous->files + old_i;
+    }
+  }
+
+  FileStamp old_stamp;
+  if (old) {
+    old_stamp.size = old->size;
+    old_stamp.mtime = old->mtime;
+    old_stamp.hash = old->hash;
+  }
+  bool same = (old &&
+               old_stamp.size == entry.stamp.size &&
+               old_stamp.mtime == entry.stamp.mtime &&
+               !is_racy_stamp(old_stamp, previous->h->checked));
+  if (same) {
+    entry.stamp.hash = old->hash;
+  }
+  else {
+    hash_file_content(entry.fn, entry.stamp);
+    same = (old && old->hash == entry.stamp.hash);
+  }
+  if (same) {
+    previous->load_tokens(old_i, entry.data);
+    entry.data.fn = entry.fn;
+    return true;
+  }
+
+  timers::Scope timer_lex("lex", &entry.fn);
+  try {
+    Lexer lexer(options.lexer_macros());
+    lexer.set_throw_errors(true);
+    if (lexer.lex(entry.fn) != Lexer::Result::OK) {
+      std::printf("%s: cannot open file\n", entry.fn.c_str());
+      return false;
+    }
+    entry.data = lexer.move_data();
+  }
+  catch (const SourceError& ex) {
+    std::printf("%s\n", ex.what());
+    return false;
+  }
+  if (options.preprocess) {
+    Preprocessor pp(&options.macros);
+    pp.process(entry.data);
+  }
+  compress_tokens(entry.data);
+
+  // Comments are not stored in the index
+  entry.data.comments.clear();
+  entry.data.comments.shrink_to_fit();
+  entry.data.comment_toks.clear();
+  ++lexed;
+  return true;
+}
+
+void merge_shard(const std::vector<Entry*>& entries, const int s, Shard& shard)
+{
+  std::vector<Posting> posts;
+  for (uint32_t f=0; f<uint32_t(entries.size()); ++f) {
+    const Entry* e = entries[f];
+    for (int k=e->shards[s]; k<e->shards[s+1]; ++k)
+      posts.push_back(Posting{ e->grams[k].hash, f, e->grams[k].offset });
+  }
+  // Postings of each file were added in order, so a stable sort
+  // keeps the (file, offset) order of each term
+  std::stable_sort(posts.begin(), posts.end(),
+                   [](const Posting& a, const Posting& b) {
+                     return a.hash < b.hash;
+                   });
+
+  std::vector<uint8_t>& out = shard.postings;
+  for (std::size_t i=0; i<posts.size(); ) {
+    TokIndexTerm term;
+    term.hash = posts[i].hash;
+    term.postings = out.size();
+    term.count = 0;
+
+    uint32_t prev_file = 0;
+    while (i < posts.size() && posts[i].hash == term.hash) {
+      const uint32_t file = posts[i].file;
+      std::size_t j = i;
+      while (j < posts.size() &&
+             posts[j].hash == term.hash &&
+             posts[j].file == file)
+        ++j;
+
+      write_varint(out, file - prev_file);
+      write_varint(out, uint32_t(j - i));
+      uint32_t prev_offset = 0;
+      for (; i<j; ++i) {
+        write_varint(out, posts[i].offset - prev_offset);
+        prev_offset = posts[i].offset;
+        ++term.count;
+      }
+      prev_file = file;
+    }
+    term.size = uint32_t(out.size() - term.postings);
+    shard.terms.push_back(term);
+  }
+}
+
+bool write_index(const std::string& fn,
+                 const uint64_t config,
+                 const int64_t checked,
+                 const std::vector<Entry*>& entries,
+                 std::vector<Shard>& shards)
+{
+  const uint32_t nfiles = uint32_t(entries.size());
+  uint32_t nterms = 0;
+  uint64_t postings_size = 0;
+  for (const Shard& shard : shards) {
+    nterms += uint32_t(shard.terms.size());
+    postings_size += shard.postings.size();
+  }
+
+  TokIndexHeader h;
+  h.magic = tokindex_magic;
+  h.version = tokindex_version;
+  h.nfiles = nfiles;
+  h.nterms = nterms;
+  h.files_offset = sizeof(TokIndexHeader);
+  h.terms_offset = h.files_offset + nfiles*sizeof(TokIndexFile);
+  h.postings_offset = h.terms_offset + nterms*sizeof(TokIndexTerm);
+  h.tokens_offset = h.postings_offset + postings_size;
+  h.config = config;
+  h.checked = checked;
+
+  std::string strings;
+  std::vector<TokIndexFile> files(nfiles);
+  uint64_t tokens_offset = h.tokens_offset;
+  for (uint32_t i=0; i<nfiles; ++i) {
+    const Entry* e = entries[i];
+    const CompactTokens& c = e->data.compact_tokens;
+    TokIndexFile& f = files[i];
+    f.size = e->stamp.size;
+    f.mtime = e->stamp.mtime;
+    f.hash = e->stamp.hash;
+    f.tokens = tokens_offset;
+    f.fn = uint32_t(strings.size());
+    f.bytes = uint32_t(e->data.readed_bytes);
+    f.ntokens = uint32_t(c.ntokens);
+    f.nblocks = uint32_t(c.blocks.size());
+    f.nbytes = uint32_t(c.bytes.size());
+    f.nids = uint32_t(e->data.ids.size());
+    tokens_offset += (f.nblocks*sizeof(CompactTokens::Block) + f.nbytes + f.nids);
+    strings += e->fn;
+    strings.push_back(0);
+  }
+  h.strings_offset = tokens_offset;
+
+  // Write a temporary file and replace the index at the end, so a
+  // failed build doesn't leave a broken index
+  const std::string tmp = fn + ".tmp";
+  std::FILE* f = std::fopen(tmp.c_str(), "wb");
+  if (!f)
+    return false;
+  {
+    Scoped_fclose fc(f);
+    std::fwrite(&h, sizeof(h), 1, f);
+    std::fwrite(files.data(), sizeof(TokIndexFile), files.size(), f);
+
+    // Terms with absolute offsets of the postings
+    uint64_t base = h.postings_offset;
+    for (Shard& shard : shards) {
+      for (TokIndexTerm& term : shard.terms)
+        term.postings += base;
+      std::fwrite(shard.terms.data(), sizeof(TokIndexTerm), shard.terms.size(), f);
+      base += shard.postings.size();
+    }
+    for (const Shard& shard : shards)
+      std::fwrite(shard.postings.data(), 1, shard.postings.size(), f);
+
+    for (const Entry* e : entries) {
+      const CompactTokens& c = e->data.compact_tokens;
+      std::fwrite(c.blocks.data(), sizeof(CompactTokens::Block), c.blocks.size(), f);
+      std::fwrite(c.bytes.data(), 1, c.bytes.size(), f);
+      std::fwrite(e->data.ids.data(), 1, e->data.ids.size(), f);
+    }
+    std::fwrite(strings.data(), 1, strings.size(), f);
+    if (std::ferror(f))
+      return false;
+  }
+
+  if (std::rename(tmp.c_str(), fn.c_str()) != 0) {
+    // rename() cannot replace an existing file on Windows
+    std::remove(fn.c_str());
+    if (std::rename(tmp.c_str(), fn.c_str()) != 0)
+      return false;
+  }
+  return true;
+}
+
+// Appends to "keys" the (file << 32 | offset - k) values of the
+// postings of the term (in increasing order). Returns false if the
+// postings are corrupted (they are not read past the end of the term
+// or with a file index out of the index).
+bool decode_postings(const TokIndexReader& index,
+                     const TokIndexTerm& term,
+                     const uint32_t k,
+                     std::vector<uint64_t>& keys)
+{
+  keys.clear();
+  keys.reserve(std::min(term.count, term.size));
+  const uint8_t* p = index.base + term.postings;
+  const uint8_t* end = p + term.size;
+  uint32_t file = 0, delta, n;
+  while (p < end) {
+    if (!read_varint(p, end, delta) ||
+        !read_varint(p, end, n))
+      return false;
+    file += delta;
+    if (file >= index.h->nfiles)
+      return false;
+
+    uint32_t offset = 0;
+    for (; n > 0; --n) {
+      if (!read_varint(p, end, delta))
+        return false;
+      offset += delta;
+      if (offset >= k)
+        keys.push_back((uint64_t(file) << 32) | (offset - k));
+    }
+  }
+  return true;
+}
+
+enum class RunFiles { TooShort, OK, Invalid };
+
+// Files with a possible match of the run of exact tokens (the
+// trigrams of the run in consecutive offsets), returns TooShort if
+// the run is too short to use the index
+RunFiles run_files(const TokIndexReader& index,
+                   const std::vector<uint64_t>& run,
+                   std::vector<uint32_t>& output)
+{
+  output.clear();
+  if (run.size() < 3)
+    return RunFiles::TooShort;
+
+  struct RunTerm {
+    const TokIndexTerm* term;
+    uint32_t k;
+  };
+  std::vector<RunTerm> terms;
+  for (std::size_t k=0; k+2<run.size(); ++k) {
+    const TokIndexTerm* term = index.find_term(trigram_hash(run[k], run[k+1], run[k+2]));
+    if (!term)
+      return RunFiles::OK;      // No candidates
+    terms.push_back(RunTerm{ term, uint32_t(k) });
+  }
+
+  // Intersect from the less frequent trigram
+  std::sort(terms.begin(), terms.end(),
+            [](const RunTerm& a, const RunTerm& b) {
+              return a.term->count < b.term->count;
+            });
+
+  std::vector<uint64_t> keys, other, result;
+  if (!decode_postings(index, *terms[0].term, terms[0].k, keys))
+    return RunFiles::Invalid;
+  for (std::size_t i=1; i<terms.size() && !keys.empty(); ++i) {
+    if (!decode_postings(index, *terms[i].term, terms[i].k, other))
+      return RunFiles::Invalid;
+    result.clear();
+    std::set_intersection(keys.begin(), keys.end(),
+                          other.begin(), other.end(),
+                          std::back_inserter(result));
+    keys.swap(result);
+  }
+
+  for (uint64_t key : keys) {
+    const uint32_t file = uint32_t(key >> 32);
+    if (output.empty() || output.back() != file)
+      output.push_back(file);
+  }
+  return RunFiles::OK;
+}
+
+} // anonymous namespace
+
+int build(const Options& options, thread_pool& pool)
+{
+  if (options.token_index.empty()) {
+    std::printf("index: specify the index file with -tokindex file\n");
+    return 1;
+  }
+
+  const uint64_t config = config_hash(options);
+  const int64_t checked = file_stamp_now();
+  TokIndexReader previous;
+  const bool update = (previous.open(options.token_index) &&
+                       previous.h->config == config);
+  std::unordered_map<std::string, uint32_t> previous_files;
+  if (update) {
+    for (uint32_t i=0; i<previous.h->nfiles; ++i)
+      previous_files[previous.strings + previous.files[i].fn] = i;
+  }
+
+  // Input files without duplicates
+  std::vector<Entry> entries;
+  {
+    std::unordered_map<std::string, int> seen;
+    entries.reserve(options.parse_files.size());
+    for (const auto& fn : options.parse_files) {
+      if (seen.insert(std::make_pair(fn, 0)).second) {
+        entries.emplace_back();
+        entries.back().fn = fn;
+      }
+    }
+  }
+
+  // Load/lex each file and extract its trigrams
+  std::atomic<int> lexed(0);
+  {
+    timers::Scope timer_files("files");
+    for (Entry& entry : entries) {
+      ALLOC_TAG("token index task");
+      pool.execute(
+        [&options, &previous, update, &previous_files, &entry, &lexed]{
+          if (!load_entry(options, update ? &previous: nullptr,
+                          previous_files, entry, lexed))
+            return;
+
+          timers::Scope timer_grams("trigrams", &entry.fn);
+          extract_grams(entry.data, entry.grams);
+          for (int s=0; s<=nshards; ++s) {
+            entry.shards[s] = int(
+              s == nshards ?
+              entry.grams.size():
+              std::lower_bound(entry.grams.begin(), entry.grams.end(),
+                               uint64_t(s) << (64 - shard_bits),
+                               [](const Gram& g, uint64_t hash) {
+                                 return g.hash < hash;
+                               }) - entry.grams.begin());
+          }
+          entry.ok = true;
+        });
+    }
+    pool.wait_all();
+  }
+  previous.close();
+
+  std::vector<Entry*> ok_entries;
+  for (Entry& entry : entries)
+    if (entry.ok)
+      ok_entries.push_back(&entry);
+
+  // Merge the trigrams of all files
+  std::vector<Shard> shards(nshards);
+  {
+    timers::Scope timer_merge("merge");
+    for (int s=0; s<nshards; ++s) {
+      ALLOC_TAG("token index task");
+      pool.execute(
+        [&ok_entries, s, &shards]{
+          merge_shard(ok_entries, s, shards[s]);
+        });
+    }
+    pool.wait_all();
+  }
+
+  int nterms = 0;
+  for (const Shard& shard : shards)
+    nterms += int(shard.terms.size());
+
+  {
+    timers::Scope timer_write("write");
+    if (!write_index(options.token_index, config, checked, ok_entries, shards)) {
+      std::printf("%s: cannot write token index\n", options.token_index.c_str());
+      return 1;
+    }
+  }
+
+  std::printf("%s: %d files, %d lexed, %d terms\n",
+              options.token_index.c_str(),
+              int(ok_entries.size()),
+              int(lexed),
+              nterms);
+  return (ok_entries.size() == entries.size() ? 0: 1);
+}
+
+int query(const Options& options, thread_pool& pool)
+{
+  TokenPattern pattern;
+  std::string error;
+  if (!pattern.compile(options.pattern, error)) {
+    std::printf("index-query: %s\n", error.c_str());
+    return 1;
+  }
+
+  TokIndexReader index;
+  if (options.token_index.empty() ||
+      !index.open(options.token_index)) {
+    std::printf("index-query: cannot open index file (use -tokindex file)\n");
+    return 1;
+  }
+
+  // Candidate files: the intersection of the files of each run of
+  // exact tokens (all files if the pattern doesn't have a run of 3
+  // or more tokens)
+  const uint32_t nfiles = index.h->nfiles;
+  std::vector<uint32_t> candidates;
+  {
+    timers::Scope timer_candidates("candidates");
+    bool filtered = false;
+    std::vector<uint32_t> files, result;
+    for (const auto& run : pattern.exact_runs()) {
+      const RunFiles res = run_files(index, run, files);
+      if (res == RunFiles::TooShort)
+        continue;
+      if (res == RunFiles::Invalid) {
+        std::printf("%s: invalid token index\n", options.token_index.c_str());
+        return 1;
+      }
+      if (!filtered) {
+        candidates.swap(files);
+        filtered = true;
+      }
+      else {
+        result.clear();
+        std::set_intersection(candidates.begin(), candidates.end(),
+                              files.begin(), files.end(),
+                              std::back_inserter(result));
+        candidates.swap(result);
+      }
+    }
+    if (!filtered) {
+      candidates.resize(nfiles);
+      for (uint32_t i=0; i<nfiles; ++i)
+        candidates[i] = i;
+    }
+  }
+
+  // Verify the candidates with the tokens stored in the index
+  const int n = int(candidates.size());
+  std::vector<OutBuffer> outs(n);
+  std::atomic<int> matches(0), matched_files(0);
+  {
+    timers::Scope timer_match("match");
+    for (int i=0; i<n; ++i) {
+      ALLOC_TAG("token index task");
+      pool.execute(
+        [i, &options, &index, &candidates, &pattern, &outs, &matches, &matched_files]{
+          LexData data;
+          index.load_tokens(candidates[i], data);
+
+          std::vector<TokenPattern::Match> result;
+          pattern.match(data, result);
+          if (result.empty())
+            return;
+          matches += int(result.size());
+          ++matched_files;
+
+          for (const auto& m : result)
+            TokenPattern::format_match(data, m, options.jsonl(), outs[i]);
+        });
+    }
+    pool.wait_all();
+  }
+
+  std::fflush(stdout);
+  for (OutBuffer& out : outs)
+    out.flush(stdout);
+
+  if (!options.jsonl()) {
+    std::printf("index-query: %d matches in %d files (%d candidates of %d files)\n",
+                int(matches), int(matched_files), n, int(nfiles));
+  }
+  return (matches > 0 ? 0: 1);
+}
+
+} // namespace tokindex
@@ -0,0 +1,87 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+#include <cstdint>
+
+class thread_pool;
+struct Options;
+
+namespace tokindex {
+
+// Layout of the token index file generated with the "index" command.
+// It's an inverted index of the token trigrams of each file (three
+// consecutive tokens without comments) to find the candidate files
+// of a pattern without lexing them, and it contains the compressed
+// tokens of each file (the CompactTokens blocks/bytes and the ids
+// pool, without comments) to verify the candidates without reading
+// the source files. All offsets are in bytes from the beginning of
+// the file.
+//
+//   TokIndexHeader
+//   TokIndexFile[nfiles]
+//   TokIndexTerm[nterms]   (sorted by hash)
+//   uint8_t postings[]
+//   uint8_t tokens[]       (blocks + bytes + ids of each file)
+//   char strings[]
+//
+// The postings of each term are grouped by file (in increasing
+// order) as varints: the delta of the file index, the number of
+// occurrences in the file, and the deltas of the offsets of each
+// occurrence (the index of the first token of the trigram counting
+// only the tokens that aren't comments).
+struct TokIndexHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t nfiles;
+  uint32_t nterms;
+  uint64_t files_offset;
+  uint64_t terms_offset;
+  uint64_t postings_offset;
+  uint64_t tokens_offset;
+  uint64_t strings_offset;
+  uint64_t config;              // Hash of -D/-U/-preprocess options
+  int64_t checked;              // When the stamps were taken
+};
+
+struct TokIndexFile {
+  uint64_t size;                // FileStamp
+  int64_t mtime;
+  uint64_t hash;
+  uint64_t tokens;              // Offset of the blocks (+bytes +ids)
+  uint32_t fn;                  // Offset in the strings pool
+  uint32_t bytes;               // LexData::readed_bytes
+  uint32_t ntokens;
+  uint32_t nblocks;
+  uint32_t nbytes;
+  uint32_t nids;
+};
+
+struct TokIndexTerm {
+  uint64_t hash;                // Hash of the three token hashes
+  uint64_t postings;            // Offset of the postings
+  uint32_t count;               // Number of occurrences
+  uint32_t size;                // Size of the postings in bytes
+};
+
+const uint32_t tokindex_magic = 0x58495443; // "CTIX"
+const uint32_t tokindex_version = 2;
+
+// "index" command: creates/updates the -tokindex file with the token
+// trigrams of the given files. Only modified files are lexed again
+// if the index already exists (the tokens of the other files are
+// reused from the index), the trigrams of each file are extracted in
+// parallel and then merged in shards of terms (in parallel too).
+int build(const Options& options, thread_pool& pool);
+
+// "index-query" command: prints the matches of the pattern (like the
+// "find" command) using the index. The posting lists of the trigrams
+// of the pattern are intersected to get the candidate files, and the
+// pattern is matched against the tokens stored in the index (source
+// files are not read).
+int query(const Options& options, thread_pool& pool);
+
+} // namespace tokindex
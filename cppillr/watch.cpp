@@ -0,0 +1,501 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "cppillr/watch.h"
+
+#include "cppillr/options.h"
+#include "cppillr/parser.h"
+#include "cppillr/preprocessor.h"
+#include "cppillr/stats.h"
+#include "cppillr/token_cursor.h"
+#include "utils/thread_pool.h"
+#include "utils/timers.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#ifdef __linux__
+  #include <dirent.h>
+  #include <poll.h>
+  #include <signal.h>
+  #include <sys/inotify.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+namespace watch {
+
+#ifndef __linux__
+
+int run(const Options& options, thread_pool& pool)
+{
+  std::printf("watch: inotify is not available in this platform\n");
+  return 1;
+}
+
+#else
+
+namespace {
+
+// A burst of events is processed when there are no new events in
+// quiet_ms, or max_delay_ms after the first event (so a continuous
+// stream of changes still generates updates).
+const int quiet_ms = 50;
+const int max_delay_ms = 1000;
+
+const uint32_t dir_events =
+  IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+  IN_DELETE_SELF | IN_ONLYDIR;
+
+volatile sig_atomic_t interrupted = 0;
+
+void on_signal(int)
+{
+  interrupted = 1;
+}
+
+bool is_source_file(const std::string& fn)
+{
+  static const char* exts[] = {
+    "c", "cc", "cpp", "cxx", "c++", "h", "hh", "hpp", "hxx", "inl", "ipp"
+  };
+  const std::size_t dot = fn.rfind('.');
+  if (dot == std::string::npos ||
+      fn.find('/', dot) != std::string::npos)
+    return false;
+  for (const char* ext : exts)
+    if (fn.compare(dot+1, std::string::npos, ext) == 0)
+      return true;
+  return false;
+}
+
+// Contribution of one file to the totals
+struct FileStats {
+  int bytes = 0;
+  int tokens = 0;
+  int lines = 0;
+  KeywordStats keywords;
+  std::vector<std::string> functions; // Sorted names
+  std::string error;
+};
+
+struct Totals {
+  int files = 0;
+  int errors = 0;
+  int64_t bytes = 0;
+  int64_t tokens = 0;
+  int64_t lines = 0;
+  int64_t functions = 0;
+  KeywordStats keywords;
+  // Functions index: name -> number of definitions
+  std::unordered_map<std::string, int> names;
+
+  void add(const FileStats& s) {
+    ++files;
+    errors += (s.error.empty() ? 0: 1);
+    bytes += s.bytes;
+    tokens += s.tokens;
+    lines += s.lines;
+    functions += int64_t(s.functions.size());
+    keywords.add(s.keywords);
+    for (const auto& name : s.functions)
+      ++names[name];
+  }
+
+  void subtract(const FileStats& s) {
+    --files;
+    errors -= (s.error.empty() ? 0: 1);
+    bytes -= s.bytes;
+    tokens -= s.tokens;
+    lines -= s.lines;
+    functions -= int64_t(s.functions.size());
+    keywords.subtract(s.keywords);
+    for (const auto& name : s.functions) {
+      auto it = names.find(name);
+      if (it != names.end() && --it->second == 0)
+        names.erase(it);
+    }
+  }
+};
+
+// Result of lexing one modified file
+struct Change {
+  std::string fn;
+  bool exists = false;
+  FileStats stats;
+};
+
+class Watcher {
+public:
+  Watcher(const Options& options, thread_pool& pool)
+    : options(options)
+    , pool(pool) { }
+
+  ~Watcher() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool init() {
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    return (fd >= 0);
+  }
+
+  int get_fd() const { return fd; }
+
+  // Watches the directory and its subdirectories, and adds its
+  // source files to "output"
+  bool add_dir(const std::string& dir,
+               std::unordered_set<std::string>& output);
+
+  // Reads the available events adding the modified source files to
+  // "output"
+  void read_events(std::unordered_set<std::string>& output);
+
+  // Lexes the given files and updates the totals
+  void update(const std::unordered_set<std::string>& fns,
+              const bool initial,
+              const double wait_ms);
+
+private:
+  void lex_file(Change& change);
+  void print_update(const std::vector<Change>& changes,
+                    const std::vector<const FileStats*>& old_stats,
+                    const int lexed, const int removed,
+                    const bool initial,
+                    const double wait_ms,
+                    const double update_ms);
+
+  const Options& options;
+  thread_pool& pool;
+  int fd = -1;
+  std::unordered_map<int, std::string> dirs; // Watch descriptor -> dir
+  std::unordered_map<std::string, FileStats> files;
+  Totals totals;
+};
+
+bool Watcher::add_dir(const std::string& dir,
+                      std::unordered_set<std::string>& output)
+{
+  const int wd = inotify_add_watch(fd, dir.c_str(), dir_events);
+  if (wd < 0)
+    return false;
+  dirs[wd] = dir;
+
+  // The directory is listed after adding the watch, so files created
+  // in the middle are reported by the listing or by an event (or
+  // both)
+  DIR* d = opendir(dir.c_str());
+  if (!d)
+    return false;
+  while (dirent* e = readdir(d)) {
+    if (std::strcmp(e->d_name, ".") == 0 ||
+        std::strcmp(e->d_name, "..") == 0)
+      continue;
+
+    const std::string path = dir + "/" + e->d_name;
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0)
+      continue;
+    if (S_ISDIR(st.st_mode))
+      add_dir(path, output);
+    else if (S_ISREG(st.st_mode) && is_source_file(path))
+      output.insert(path);
+  }
+  closedir(d);
+  return true;
+}
+
+void Watcher::read_events(std::unordered_set<std::string>& output)
+{
+  alignas(inotify_event) char buf[64*1024];
+  while (true) {
+    const ssize_t n = read(fd, buf, sizeof(buf));
+    if (n <= 0)
+      break;
+
+    for (char* p = buf; p < buf+n; ) {
+      const inotify_event* ev = (const inotify_event*)p;
+      p += sizeof(inotify_event) + ev->len;
+
+      // Too many events, check all the files again
+      if (ev->mask & IN_Q_OVERFLOW) {
+        for (const auto& kv : files)
+          output.insert(kv.first);
+        std::vector<std::string> roots;
+        for (const auto& kv : dirs)
+          roots.push_back(kv.second);
+        for (const auto& dir : roots)
+          add_dir(dir, output);
+        continue;
+      }
+
+      auto it = dirs.find(ev->wd);
+      if (it == dirs.end())
+        continue;
+      if (ev->mask & (IN_DELETE_SELF | IN_IGNORED)) {
+        dirs.erase(it);
+        continue;
+      }
+      if (ev->len == 0)
+        continue;
+
+      const std::string path = it->second + "/" + ev->name;
+      if (ev->mask & IN_ISDIR) {
+        // New directory (its files might be created before the watch)
+        if (ev->mask & (IN_CREATE | IN_MOVED_TO))
+          add_dir(path, output);
+        // Removed/renamed directory: its files will be found missing
+        // (and a renamed directory is added again by IN_MOVED_TO)
+        else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+          const std::string prefix = path + "/";
+          for (const auto& kv : files)
+            if (kv.first.compare(0, prefix.size(), prefix) == 0)
+              output.insert(kv.first);
+          for (auto d = dirs.begin(); d != dirs.end(); ) {
+            if (d->second == path ||
+                d->second.compare(0, prefix.size(), prefix) == 0) {
+              inotify_rm_watch(fd, d->first);
+              d = dirs.erase(d);
+            }
+            else
+              ++d;
+          }
+        }
+      }
+      else if (is_source_file(path)) {
+        output.insert(path);
+      }
+    }
+  }
+}
+
+void Watcher::lex_file(Change& change)
+{
+  timers::Scope timer_lex("lex", &change.fn);
+  struct stat st;
+  change.exists = (stat(change.fn.c_str(), &st) == 0 && S_ISREG(st.st_mode));
+  if (!change.exists)
+    return;
+
+  FileStats& s = change.stats;
+  LexData lex;
+  lex.readed_bytes = 0;
+  try {
+    Lexer lexer(options.lexer_macros());
+    lexer.set_throw_errors(true);
+    if (lexer.lex(change.fn) != Lexer::Result::OK) {
+      change.exists = false;
+      return;
+    }
+    lex = lexer.move_data();
+    if (options.preprocess) {
+      Preprocessor pp(&options.macros);
+      pp.process(lex);
+    }
+    if (options.compact_tokens)
+      compress_tokens(lex);
+
+    Parser parser;
+    parser.set_throw_errors(true);
+    parser.parse(lex);
+    const ParserData data = parser.move_data();
+    for (const FunctionNode* f : data.functions)
+      s.functions.push_back(f->name);
+    std::sort(s.functions.begin(), s.functions.end());
+  }
+  catch (const SourceError& ex) {
+    s.error = ex.what();
+  }
+
+  s.bytes = lex.readed_bytes;
+  s.tokens = lex.ntokens();
+  s.lines = count_lines(lex);
+  s.keywords.add(lex);
+}
+
+void Watcher::update(const std::unordered_set<std::string>& fns,
+                     const bool initial,
+                     const double wait_ms)
+{
+  timers::Scope timer_update("update");
+  const auto t0 = std::chrono::steady_clock::now();
+
+  std::vector<Change> changes(fns.size());
+  {
+    int i = 0;
+    for (const auto& fn : fns)
+      changes[i++].fn = fn;
+  }
+  std::sort(changes.begin(), changes.end(),
+            [](const Change& a, const Change& b) { return a.fn < b.fn; });
+
+  for (Change& change : changes)
+    pool.execute([this, &change]{ lex_file(change); });
+  pool.wait_all();
+
+  // Subtract the old contribution of each file and add the new one
+  std::vector<FileStats> olds(changes.size());
+  std::vector<const FileStats*> old_stats(changes.size(), nullptr);
+  int lexed = 0, removed = 0;
+  for (int i=0; i<int(changes.size()); ++i) {
+    Change& change = changes[i];
+    auto it = files.find(change.fn);
+    if (it != files.end()) {
+      totals.subtract(it->second);
+      olds[i] = std::move(it->second);
+      old_stats[i] = &olds[i];
+      files.erase(it);
+    }
+    if (change.exists) {
+      totals.add(change.stats);
+      files[change.fn] = change.stats;
+      ++lexed;
+    }
+    else if (old_stats[i])
+      ++removed;
+  }
+
+  const double update_ms = std::chrono::duration<double, std::milli>(
+    std::chrono::steady_clock::now() - t0).count();
+  print_update(changes, old_stats, lexed, removed,
+               initial, wait_ms, update_ms);
+}
+
+void Watcher::print_update(const std::vector<Change>& changes,
+                           const std::vector<const FileStats*>& old_stats,
+                           const int lexed, const int removed,
+                           const bool initial,
+                           const double wait_ms,
+                           const double update_ms)
+{
+  if (initial)
+    std::printf("watch: %d files lexed in %.2f ms\n", lexed, update_ms);
+  else
+    std::printf("watch: %d files changed (%d lexed, %d removed) in %.2f ms "
+                "(coalesced events for %.2f ms)\n",
+                int(changes.size()), lexed, removed, update_ms, wait_ms);
+
+  for (const Change& change : changes) {
+    if (change.exists && !change.stats.error.empty())
+      std::printf("%s\n", change.stats.error.c_str());
+  }
+
+  std::printf("files %d, errors %d, bytes %lld, tokens %lld, lines %lld, "
+              "functions %lld (%d names)\n",
+              totals.files, totals.errors,
+              (long long)totals.bytes, (long long)totals.tokens,
+              (long long)totals.lines, (long long)totals.functions,
+              int(totals.names.size()));
+
+  if (options.count_tokens)
+    std::printf("total tokens %lld\n", (long long)totals.tokens);
+  if (options.count_lines)
+    std::printf("total lines %lld\n", (long long)totals.lines);
+  if (options.keyword_stats)
+    totals.keywords.print();
+
+  // Added/removed functions of each changed file
+  if (options.show_functions && !initial) {
+    static const std::vector<std::string> none;
+    std::vector<std::string> diff;
+    for (int i=0; i<int(changes.size()); ++i) {
+      const auto& olds = (old_stats[i] ? old_stats[i]->functions: none);
+      const auto& news = (changes[i].exists ? changes[i].stats.functions: none);
+
+      diff.clear();
+      std::set_difference(news.begin(), news.end(),
+                          olds.begin(), olds.end(),
+                          std::back_inserter(diff));
+      for (const auto& name : diff)
+        std::printf("+ %s: function %s()\n", changes[i].fn.c_str(), name.c_str());
+
+      diff.clear();
+      std::set_difference(olds.begin(), olds.end(),
+                          news.begin(), news.end(),
+                          std::back_inserter(diff));
+      for (const auto& name : diff)
+        std::printf("- %s: function %s()\n", changes[i].fn.c_str(), name.c_str());
+    }
+  }
+  std::fflush(stdout);
+}
+
+} // anonymous namespace
+
+int run(const Options& options, thread_pool& pool)
+{
+  if (options.parse_files.empty()) {
+    std::printf("watch: specify the directories to watch\n");
+    return 1;
+  }
+
+  Watcher watcher(options, pool);
+  if (!watcher.init()) {
+    std::printf("watch: cannot initialize inotify (%s)\n", std::strerror(errno));
+    return 1;
+  }
+
+  std::unordered_set<std::string> touched;
+  for (std::string dir : options.parse_files) {
+    while (dir.size() > 1 && dir.back() == '/')
+      dir.pop_back();
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+      std::printf("%s: not a directory\n", dir.c_str());
+      return 1;
+    }
+    if (!watcher.add_dir(dir, touched)) {
+      std::printf("%s: cannot watch directory (%s)\n",
+                  dir.c_str(), std::strerror(errno));
+      return 1;
+    }
+  }
+
+  struct sigaction sa;
+  std::memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_signal;    // Without SA_RESTART to interrupt poll()
+  sigaction(SIGINT, &sa, nullptr);
+  sigaction(SIGTERM, &sa, nullptr);
+
+  watcher.update(touched, true, 0.0);
+
+  pollfd pfd = { watcher.get_fd(), POLLIN, 0 };
+  while (!interrupted) {
+    if (poll(&pfd, 1, -1) <= 0)
+      continue;
+
+    // Coalesce the events of a burst
+    touched.clear();
+    const auto t0 = std::chrono::steady_clock::now();
+    double elapsed = 0.0;
+    while (true) {
+      watcher.read_events(touched);
+      elapsed = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - t0).count();
+      if (interrupted || elapsed >= max_delay_ms)
+        break;
+      const int timeout = std::min(quiet_ms, max_delay_ms - int(elapsed));
+      if (poll(&pfd, 1, timeout) <= 0)
+        break;
+    }
+
+    if (!touched.empty())
+      watcher.update(touched, false, elapsed);
+  }
+  return 0;
+}
+
+#endif // __linux__
+
+} // namespace watch
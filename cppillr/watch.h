@@ -0,0 +1,22 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#pragma once
+
+class thread_pool;
+struct Options;
+
+namespace watch {
+
+// "watch" command: lexes/parses all the C/C++ files of the given
+// directories (recursively), and then waits file changes (inotify)
+// to lex/parse only the modified files, updating the totals of
+// -counttokens/-countlines/-keywordstats and the functions index
+// (subtracting the old stats of each file and adding the new ones).
+// Events are coalesced, so a burst of changes (e.g. a git checkout)
+// is processed as one update. It runs until it's interrupted.
+int run(const Options& options, thread_pool& pool);
+
+} // namespace watch
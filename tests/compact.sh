@@ -0,0 +1,73 @@
+#! /bin/bash
+#
+# Tests of -compacttokens: the output of each command must be the same
+# with the compact and the plain layout of the tokens (the sources of
+# cppillr are used as input, and generated files for -showfunctions,
+# because the parser stops at the first comment, and for docs). And
+# TokenCursor seeks across the blocks of compressed tokens
+# (token_cursor_test).
+#
+#   CPPILLR=path/to/cppillr TOKEN_CURSOR_TEST=path/to/token_cursor_test \
+#     bash compact.sh
+
+if [[ "$CPPILLR" == "" ]] ; then
+    CPPILLR="cppillr"
+fi
+if [[ "$TOKEN_CURSOR_TEST" == "" ]] ; then
+    TOKEN_CURSOR_TEST="token_cursor_test"
+fi
+
+this=$(cd $(dirname "$0") && pwd)/compact.sh
+src=$(cd $(dirname "$0")/.. && pwd)/cppillr
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+fail() {
+    echo "$this:1: failed $1"
+    exit 1
+}
+
+# same_output "name" cppillr-args... (compares the output with and
+# without -compacttokens)
+same_output() {
+    local name="$1"
+    shift
+    $CPPILLR "$@" >$tmp/plain.txt 2>&1
+    $CPPILLR "$@" -compacttokens >$tmp/compact.txt 2>&1
+    if [[ ! -s $tmp/plain.txt ]] ; then
+        fail "$name (empty output)"
+    fi
+    diff -u $tmp/plain.txt $tmp/compact.txt >/dev/null || fail "$name"
+    echo "$this: ok $name"
+}
+
+# Functions with more than 64 tokens (several blocks per function)
+for i in $(seq 1 50) ; do
+    echo "int f$i(int a, int b) {"
+    echo "  int c = a + b * $i - (a << 2) + (b >> 1);"
+    echo "  if (c > $i) { return c - a * b + $i; }"
+    echo "  return f$i(a - 1, b + 1) + c * (a + b);"
+    echo "}"
+done >$tmp/f.cpp
+
+# The same functions with comments
+for i in $(seq 1 50) ; do
+    echo "// Returns the value number $i"
+    echo "// computed from a and b"
+    echo "int f$i(int a, int b) {"
+    echo "  return a * $i + b; // Comment inside the function"
+    echo "}"
+    echo "/* Structure number $i */"
+    echo "struct s$i { int a, b; };"
+done >$tmp/d.cpp
+
+same_output "-showtokens" -showtokens $src/*.cpp $src/*.h
+same_output "-showtokens -format jsonl" -showtokens -format jsonl $src/*.cpp
+same_output "-showincludes" -showincludes $src/*.cpp $src/*.h
+same_output "-showfunctions" -showfunctions $tmp/f.cpp
+same_output "counters" -counttokens -countlines -keywordstats $src/*.cpp $src/*.h
+same_output "docs" docs -print '{line} {id}: {desc}' $tmp/d.cpp $src/*.cpp
+
+$TOKEN_CURSOR_TEST $src/lexer.cpp $src/parser.cpp $tmp/f.cpp >$tmp/out.txt || \
+    { cat $tmp/out.txt ; fail "token_cursor_test" ; }
+echo "$this: ok TokenCursor seek"
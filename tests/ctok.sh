@@ -0,0 +1,64 @@
+#! /bin/bash
+#
+# Test of the -dumptokens file: the tokens read with CtokReader (the
+# ctok_dump program) must be the same ones printed by -showtokens, and
+# truncated or corrupted dumps must be rejected.
+#
+#   CPPILLR=path/to/cppillr CTOK_DUMP=path/to/ctok_dump bash ctok.sh
+
+if [[ "$CPPILLR" == "" ]] ; then
+    CPPILLR="cppillr"
+fi
+if [[ "$CTOK_DUMP" == "" ]] ; then
+    CTOK_DUMP="ctok_dump"
+fi
+
+this=$(cd $(dirname "$0") && pwd)/ctok.sh
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+fail() {
+    echo "$this:1: failed $1"
+    exit 1
+}
+
+cat >$tmp/a.cpp <<EOF
+#include "b.h" // comment
+#define STR(x) #x
+int f(int a, char b) { return a <<= 2, 'c'; }
+/* block
+   comment */
+const char* s = STR(hi) "lit";
+EOF
+cat >$tmp/b.h <<EOF
+#pragma once
+#ifndef B_H
+#define B_H
+double g(...);
+#endif
+EOF
+
+cd $tmp
+$CPPILLR -showtokens -dumptokens t.ctok a.cpp b.h | \
+    grep -v "^running command" >expected.txt || fail "cppillr -dumptokens"
+$CTOK_DUMP t.ctok >dump.txt || fail "ctok_dump"
+# -showtokens doesn't print a new line after the Eof token, grep adds
+# the one at the end of the output in both cases
+grep -v "^running command" dump.txt >actual.txt
+diff -u expected.txt actual.txt || fail "-showtokens vs CtokReader"
+echo "$this: ok round trip"
+
+# A truncated file is rejected
+head -c 200 t.ctok >truncated.ctok
+$CTOK_DUMP truncated.ctok >/dev/null && fail "truncated file"
+echo "$this: ok truncated file"
+
+# A file entry pointing after the tokens is rejected (first_token of
+# the first entry)
+files_offset=$(od -An -t u8 -j 32 -N 8 t.ctok | tr -d ' ')
+cp t.ctok corrupted.ctok
+printf '\xff\xff\xff\x7f' | \
+    dd of=corrupted.ctok bs=1 seek=$files_offset conv=notrunc 2>/dev/null
+$CTOK_DUMP corrupted.ctok >/dev/null && fail "corrupted file entry"
+echo "$this: ok corrupted file entry"
+exit 0
@@ -0,0 +1,99 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+// Test of the header-only CtokReader (see cppillr/ctok.h):
+//
+//   ctok_dump file.ctok
+//
+// Prints the tokens of each file of the dump with the same format as
+// "cppillr -showtokens", so both outputs can be compared. Returns 1
+// if the file cannot be opened or is invalid.
+
+#include "cppillr/ctok.h"
+
+#include <cstdio>
+
+static void print_text(const std::string& text)
+{
+  std::fwrite(text.data(), 1, text.size(), stdout);
+}
+
+static void print_file(const CtokReader& reader, const CtokFileView& file)
+{
+  std::printf("%s: tokens=%d\n", file.fn(), file.ntokens());
+
+  for (int i=0; i<file.ntokens(); ++i) {
+    const CtokToken& tok = file[i];
+    std::printf("%s:%d:%d: [%d] ", file.fn(), tok.line, tok.col, i);
+    switch (tok.kind) {
+      case ctok_pp_begin:
+        std::printf("PP { \n");
+        break;
+      case ctok_pp_keyword:
+        std::printf("PPKEY %s\n", reader.pp_keyword(tok.i));
+        break;
+      case ctok_pp_header_name:
+        std::printf("PP.H ");
+        print_text(file.id_text(tok));
+        std::printf("\n");
+        break;
+      case ctok_pp_end:
+        std::printf("} PP\n");
+        break;
+      case ctok_comment:
+        std::printf("COMMENT ");
+        print_text(file.comment_text(tok));
+        std::printf("\n");
+        break;
+      case ctok_identifier:
+        std::printf("ID ");
+        print_text(file.id_text(tok));
+        std::printf("\n");
+        break;
+      case ctok_literal:
+        std::printf("LIT ");
+        print_text(file.id_text(tok));
+        std::printf("\n");
+        break;
+      case ctok_char_constant:
+        std::printf("CHR ");
+        print_text(file.id_text(tok));
+        std::printf("\n");
+        break;
+      case ctok_numeric_constant:
+        std::printf("NUM ");
+        print_text(file.id_text(tok));
+        std::printf("\n");
+        break;
+      case ctok_keyword:
+        std::printf("KEY %s\n", reader.keyword(tok.i));
+        break;
+      case ctok_punctuator:
+        std::printf("OP %c", char(tok.i));
+        if (tok.j)
+          std::printf("%c", char(tok.j));
+        std::printf("\n");
+        break;
+    }
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  if (argc != 2) {
+    std::printf("usage: ctok_dump file.ctok\n");
+    return 1;
+  }
+
+  CtokReader reader;
+  if (!reader.open(argv[1])) {
+    std::printf("%s: invalid ctok file\n", argv[1]);
+    return 1;
+  }
+
+  for (int i=0; i<reader.nfiles(); ++i)
+    print_file(reader, reader.file_view(i));
+  return 0;
+}
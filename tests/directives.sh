@@ -0,0 +1,243 @@
+#! /bin/bash
+#
+# Tests of the preprocessor directives in the lexer: each case lexes a
+# small file ($tmp/t.cpp) and compares the output of cppillr with the
+# expected one.
+#
+#   CPPILLR=path/to/cppillr bash directives.sh
+
+if [[ "$CPPILLR" == "" ]] ; then
+    CPPILLR="cppillr"
+fi
+
+this=$(cd $(dirname "$0") && pwd)/directives.sh
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+check() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [[ "$actual" != "$expected" ]] ; then
+        echo "$this:1: failed $name"
+        echo "expected: $expected"
+        echo "actual: $actual"
+        exit 1
+    fi
+    echo "$this: ok $name"
+}
+
+# expect_includes "name" "expected includes" cppillr-args...
+expect_includes() {
+    local name="$1"
+    local expected="$2"
+    shift 2
+    check "$name" "$expected" \
+          "$(cd $tmp && $CPPILLR -showincludes "$@" t.cpp | grep -v "^running command")"
+}
+
+# expect_tokens "name" "expected tokens" cppillr-args... (only the
+# kind and text of each token, without positions)
+expect_tokens() {
+    local name="$1"
+    local expected="$2"
+    shift 2
+    check "$name" "$expected" \
+          "$(cd $tmp && $CPPILLR -showtokens "$@" t.cpp | \
+               grep "^t.cpp:.*\]" | \
+               sed -e 's/^[^ ]* \[[0-9]*\] //' -e 's/ *$//')"
+}
+
+# A line comment ends the directive (the next # starts a new one)
+cat >$tmp/t.cpp <<EOF
+#include "a.h" // first
+#include "b.h"
+EOF
+expect_includes "line comment after #include" 't.cpp: includes
+  "a.h"
+  "b.h"'
+
+# # and ## are operators only inside #define
+cat >$tmp/t.cpp <<EOF
+#define S(x) #x // stringize
+#define P(a, b) a ## b
+#include "c.h"
+EOF
+expect_includes "# and ## in #define" 't.cpp: includes
+  "c.h"'
+expect_tokens "# and ## tokens" 'PP {
+PPKEY define
+ID S
+OP (
+ID x
+OP )
+OP #
+ID x
+} PP
+COMMENT stringize
+PP {
+PPKEY define
+ID P
+OP (
+ID a
+OP ,
+ID b
+OP )
+ID a
+OP ##
+ID b
+} PP
+PP {
+PPKEY include
+PP.H "c.h"
+} PP'
+
+# -preprocess evaluates the #if groups with the macros defined at
+# that point (other macros are undefined)
+cat >$tmp/t.cpp <<EOF
+#ifndef _WIN32
+#define SEP 1
+#else
+#define SEP 2
+#endif
+#if SEP == 2 || defined(FOO)
+int f() { return 0; }
+#elif 0
+#else
+int g() { return SEP; }
+#endif
+EOF
+expect_tokens "-preprocess #if groups" 'PP {
+PPKEY ifndef
+ID _WIN32
+} PP
+PP {
+PPKEY else
+} PP
+PP {
+PPKEY endif
+} PP
+PP {
+PPKEY if
+ID SEP
+OP ==
+NUM 2
+OP ||
+ID defined
+OP (
+ID FOO
+OP )
+} PP
+PP {
+PPKEY else
+} PP
+KEY int
+ID g
+OP (
+OP )
+OP {
+KEY return
+NUM 1
+OP ;
+OP }
+PP {
+PPKEY endif
+} PP' -preprocess
+
+# Stringized literals escape their quotes, and -D macros can be
+# named like keywords
+cat >$tmp/t.cpp <<EOF
+#define STR(x) #x
+int f() { return STR("hi") + while; }
+EOF
+expect_tokens "-preprocess # and -D keyword" 'KEY int
+ID f
+OP (
+OP )
+OP {
+KEY return
+LIT \"hi\"
+OP +
+NUM 7
+OP ;
+OP }' -preprocess -Dwhile=7
+
+# -skipdisabled with comments after the condition, and comments,
+# literals and line continuations with a # inside disabled regions
+cat >$tmp/t.cpp <<EOF
+#if 0 // off
+int bad1;
+#endif
+#if 0 /* off */
+int bad2;
+#endif
+#if 0
+/*
+#endif
+*/
+const char* s = "/*";
+#define A 1 \\
+#endif
+int bad3;
+#endif
+#if 0x7fffffffffffffff + 1 < 0 && -(-9223372036854775807 - 1) / -1 > 0
+int bad4;
+#endif
+int f() { return 0; }
+EOF
+expect_tokens "-skipdisabled with comments" 'PP {
+PPKEY if
+NUM 0
+} PP
+COMMENT off
+PP {
+PPKEY endif
+} PP
+PP {
+PPKEY if
+NUM 0
+COMMENT off
+} PP
+PP {
+PPKEY endif
+} PP
+PP {
+PPKEY if
+NUM 0
+} PP
+PP {
+PPKEY endif
+} PP
+PP {
+PPKEY if
+NUM 0x7fffffffffffffff
+OP +
+NUM 1
+OP <
+NUM 0
+OP &&
+OP -
+OP (
+OP -
+NUM 9223372036854775807
+OP -
+NUM 1
+OP )
+OP /
+OP -
+NUM 1
+OP >
+NUM 0
+} PP
+PP {
+PPKEY endif
+} PP
+KEY int
+ID f
+OP (
+OP )
+OP {
+KEY return
+NUM 0
+OP ;
+OP }' -skipdisabled
@@ -0,0 +1,132 @@
+#! /bin/bash
+#
+# Tests of the "docs" command with a cache file (-doccache): the
+# output must be the same with or without the cache, and only the
+# modified files must be extracted again. And tests of the index
+# generated with "docs -index" and the "docs-query" command.
+#
+#   CPPILLR=path/to/cppillr bash docs.sh
+
+if [[ "$CPPILLR" == "" ]] ; then
+    CPPILLR="cppillr"
+fi
+
+this=$(cd $(dirname "$0") && pwd)/docs.sh
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+check() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [[ "$actual" != "$expected" ]] ; then
+        echo "$this:1: failed $name"
+        echo "expected: $expected"
+        echo "actual: $actual"
+        exit 1
+    fi
+    echo "$this: ok $name"
+}
+
+print='{line} {id}: {desc}'
+
+# docs_cached "files re-extracted" files... (checks the output and the
+# number of files extracted again)
+docs_cached() {
+    local name="$1"
+    local expected="$2"
+    shift 2
+    check "$name" \
+          "$(cd $tmp && $CPPILLR docs -print "$print" "$@" | grep -v "^running command")" \
+          "$(cd $tmp && $CPPILLR docs -print "$print" -doccache docs.cache "$@" | grep -v "^running command")"
+    check "$name (re-extracted files)" "docs cache: $expected files re-extracted" \
+          "$(cd $tmp && $CPPILLR docs -print "$print" -doccache docs.cache -showtime "$@" | \
+               grep "^docs cache:")"
+}
+
+# Files modified some time ago (files modified just before the cache
+# is written are extracted again in the next execution)
+cat >$tmp/a.cpp <<EOF
+// Adds two numbers
+int add(int a, int b) { return a+b; }
+EOF
+cat >$tmp/b.cpp <<EOF
+// Returns zero
+int zero() { return 0; }
+EOF
+touch -d "2020-01-01 00:00:00" $tmp/a.cpp $tmp/b.cpp
+
+docs_cached "new cache" "0/2" a.cpp b.cpp
+
+# Same size, different modification time and content
+cat >$tmp/b.cpp <<EOF
+// Returns one!
+int one() { return 1; }
+EOF
+touch -d "2020-01-02 00:00:00" $tmp/b.cpp
+(cd $tmp && $CPPILLR docs -print "$print" -doccache docs.cache -showtime a.cpp b.cpp) >$tmp/out
+check "edited file" "a.cpp:2:0 add: Adds two numbers
+b.cpp:2:0 one: Returns one!" "$(grep "^[ab].cpp:" $tmp/out)"
+check "edited file (re-extracted files)" "docs cache: 1/2 files re-extracted" \
+      "$(grep "^docs cache:" $tmp/out)"
+docs_cached "cache hit" "0/2" a.cpp b.cpp
+
+# A different -print template discards the cache
+check "different template" "docs cache: 2/2 files re-extracted" \
+      "$(cd $tmp && $CPPILLR docs -print '{id}' -doccache docs.cache -showtime a.cpp b.cpp | \
+           grep "^docs cache:")"
+
+# A file modified just before the cache was written is checked again
+# even if its size and modification time are the same
+cat >$tmp/b.cpp <<EOF
+// Returns two!
+int two() { return 2; }
+EOF
+touch -r $tmp/b.cpp $tmp/b.ref
+(cd $tmp && $CPPILLR docs -print "$print" -doccache docs.cache a.cpp b.cpp) >/dev/null
+cat >$tmp/b.cpp <<EOF
+// Returns six!
+int six() { return 6; }
+EOF
+touch -r $tmp/b.ref $tmp/b.cpp
+check "racy file" "a.cpp:2:0 add: Adds two numbers
+b.cpp:2:0 six: Returns six!" \
+      "$(cd $tmp && $CPPILLR docs -print "$print" -doccache docs.cache a.cpp b.cpp | \
+           grep -v "^running command")"
+
+# docs-query returns the sections that contain all the terms (in the
+# order of the input files)
+cat >$tmp/c.cpp <<EOF
+// Subtracts two numbers
+int sub(int a, int b) { return a-b; }
+// Multiplies two numbers
+int mul(int a, int b) { return a*b; }
+EOF
+(cd $tmp && $CPPILLR docs -index docs.idx c.cpp a.cpp b.cpp) >/dev/null
+
+# query "expected sections" terms...
+query() {
+    local expected="$1"
+    shift
+    check "docs-query $*" "$expected" \
+          "$(cd $tmp && $CPPILLR docs-query -index docs.idx -print '{line} {id}' "$@" | \
+               grep -v "^running command")"
+}
+query "c.cpp:2:0 sub
+c.cpp:4:0 mul
+a.cpp:2:0 add" two numbers
+query "c.cpp:4:0 mul" Multiplies NUMBERS
+query "b.cpp:2:0 six" six
+query "" two six
+
+# A corrupted index is rejected (postings of the first term out of
+# the file, terms_offset is at byte 20 and IndexTerm::postings at 12)
+terms_offset=$(od -An -t u4 -j 20 -N 4 $tmp/docs.idx | tr -d ' ')
+cp $tmp/docs.idx $tmp/corrupted.idx
+printf '\xff\xff\xff\x0f' | \
+    dd of=$tmp/corrupted.idx bs=1 seek=$((terms_offset + 12)) conv=notrunc 2>/dev/null
+check "corrupted index" "corrupted.idx: invalid index file" \
+      "$(cd $tmp && $CPPILLR docs-query -index corrupted.idx two | grep -v "^running command")"
+head -c 100 $tmp/docs.idx >$tmp/truncated.idx
+check "truncated index" "truncated.idx: invalid index file" \
+      "$(cd $tmp && $CPPILLR docs-query -index truncated.idx two | grep -v "^running command")"
@@ -0,0 +1,102 @@
+#! /bin/bash
+#
+# Tests of the "find" command: errors compiling patterns, matches of
+# each kind of element ($* gaps, #directives, token classes) with
+# comments between the tokens, and the files skipped without lexing
+# them because they don't contain the words of the pattern.
+#
+#   CPPILLR=path/to/cppillr bash find.sh
+
+if [[ "$CPPILLR" == "" ]] ; then
+    CPPILLR="cppillr"
+fi
+
+this=$(cd $(dirname "$0") && pwd)/find.sh
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+check() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [[ "$actual" != "$expected" ]] ; then
+        echo "$this:1: failed $name"
+        echo "expected: $expected"
+        echo "actual: $actual"
+        exit 1
+    fi
+    echo "$this: ok $name"
+}
+
+# find "expected output" "pattern" files... (from $tmp)
+find() {
+    local expected="$1"
+    local pattern="$2"
+    shift 2
+    check "find '$pattern'" "$expected" \
+          "$(cd $tmp && $CPPILLR find "$pattern" "$@" | grep -v "^running command")"
+}
+
+cat >$tmp/a.cpp <<EOF
+#include <vector>
+#include "a.h"
+int main() {
+  foo(1, x);
+  foo(/* comment */ 2 // comment
+      );
+  foo("s");
+  int* p = new int[10];
+  bar(a, b, c);
+  bar();
+  return 0;
+}
+EOF
+# Without the words of the patterns
+cat >$tmp/b.cpp <<EOF
+int g() { return 1; }
+EOF
+# With "foo" only in a comment
+cat >$tmp/c.cpp <<EOF
+// foo(3)
+int h() { return 2; }
+EOF
+
+# Invalid patterns
+find "find: unknown token class \$foo at column 5" 'foo $foo'
+find "find: unknown directive #nodirective at column 1" '#nodirective'
+find "find: unterminated literal at column 5" 'foo "text'
+find "find: unterminated char constant at column 5" "foo 'c"
+find "find: \$* must be between two elements" '$* foo'
+find "find: \$* must be between two elements" 'foo $*'
+find "find: empty pattern" ' '
+(cd $tmp && $CPPILLR find '$foo' a.cpp >/dev/null)
+check "invalid pattern (exit code)" "1" "$?"
+
+# Token classes and comments between the matched tokens
+find "a.cpp:4:6: foo ( 1
+a.cpp:5:6: foo ( 2
+a.cpp:7:6: foo ( \"s\"
+find: 3 matches in 1 files (2/3 files lexed)" 'foo ( $const' a.cpp b.cpp c.cpp
+find "a.cpp:5:6: foo ( 2 )
+find: 1 matches in 1 files (1/1 files lexed)" 'foo ( $number )' a.cpp
+find "a.cpp:8:15: new int [
+find: 1 matches in 1 files (1/1 files lexed)" 'new $keyword [' a.cpp
+
+# $* matches the shortest sequence (zero or more tokens)
+find "a.cpp:9:6: bar ( a , b , c )
+a.cpp:10:6: bar ( )
+find: 2 matches in 1 files (1/1 files lexed)" 'bar ( $* )' a.cpp
+find "a.cpp:4:6: foo ( 1 , x
+a.cpp:5:6: foo ( 2 ) ; foo
+find: 2 matches in 1 files (1/1 files lexed)" 'foo ( $* $id' a.cpp
+
+# Directives
+find "a.cpp:1:1: # include <vector>
+a.cpp:2:1: # include \"a.h\"
+find: 2 matches in 1 files (1/1 files lexed)" '#include $header' a.cpp
+
+# No matches (b.cpp is not lexed, c.cpp is lexed because it contains
+# "foo" in a comment)
+find "find: 0 matches in 0 files (2/3 files lexed)" 'foo ( 3 )' a.cpp b.cpp c.cpp
+(cd $tmp && $CPPILLR find 'foo ( 3 )' a.cpp b.cpp c.cpp >/dev/null)
+check "no matches (exit code)" "1" "$?"
@@ -0,0 +1,174 @@
+#! /bin/bash
+#
+# Tests of the include graph: each case creates some files in $tmp and
+# compares the output of cppillr with the expected one.
+#
+#   CPPILLR=path/to/cppillr bash includes.sh
+
+if [[ "$CPPILLR" == "" ]] ; then
+    CPPILLR="cppillr"
+fi
+
+this=$(cd $(dirname "$0") && pwd)/includes.sh
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+check() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [[ "$actual" != "$expected" ]] ; then
+        echo "$this:1: failed $name"
+        echo "expected: $expected"
+        echo "actual: $actual"
+        exit 1
+    fi
+    echo "$this: ok $name"
+}
+
+# run "name" "expected output" cppillr-args... (from $tmp)
+run() {
+    local name="$1"
+    local expected="$2"
+    shift 2
+    check "$name" "$expected" \
+          "$(cd $tmp && $CPPILLR "$@" | grep -v "^running command")"
+}
+
+mkdir $tmp/inc
+cat >$tmp/t.cpp <<EOF
+#include "a.h"
+#include <b.h>
+#include "missing.h"
+int main() { return 0; }
+EOF
+cat >$tmp/a.h <<EOF
+#include "inc/b.h"
+EOF
+cat >$tmp/inc/b.h <<EOF
+int b();
+EOF
+
+# "file.h" is searched in the directory of the includer, <file.h> in
+# the -I paths
+run "includes" 't.cpp: 2 includes
+  a.h (no include guard)
+  inc/b.h (no include guard)
+  unresolved "missing.h" (from t.cpp)' includes -I inc t.cpp
+
+# The same input file twice is scanned once
+run "same input file twice" 't.cpp: 2 includes
+  a.h (no include guard)
+  inc/b.h (no include guard)
+  unresolved "missing.h" (from t.cpp)' includes -I inc t.cpp t.cpp
+
+# includecost: transitive bytes/tokens of each translation unit, and
+# the cost of each header with the include chain from the first unit
+# (in the order of the input files) that includes it
+cat >$tmp/u.cpp <<EOF
+#include "a.h"
+int main() { return 1; }
+EOF
+# (inc/b.h has no include guard, so it is counted twice in t.cpp)
+run "includecost" 'translation units: 2, included bytes 65, included tokens 28
+       bytes     tokens  files  translation unit
+          37         17      2  t.cpp
+          28         11      2  u.cpp
+
+          cost      bytes  count  header
+            38         19      2  a.h
+                          chain: u.cpp -> a.h
+            27          9      3  inc/b.h
+                          chain: u.cpp -> a.h -> inc/b.h' includecost -I inc u.cpp t.cpp
+
+# A header without guard included twice is counted twice, a guarded
+# one (include guard or #pragma once) only once
+cat >$tmp/g.cpp <<EOF
+#include "u.h"
+#include "u.h"
+#include "p.h"
+#include "p.h"
+#include "w.h"
+#include "w.h"
+EOF
+cat >$tmp/u.h <<EOF
+int u();
+EOF
+cat >$tmp/p.h <<EOF
+#pragma once
+int p();
+EOF
+cat >$tmp/w.h <<EOF
+#ifndef W_H
+#define W_H
+int w();
+#endif
+EOF
+run "guarded headers" 'g.cpp: 3 includes
+  u.h (no include guard)
+  p.h
+  w.h' includes g.cpp
+run "guarded headers (includecost)" 'translation units: 1, included bytes 80, included tokens 39
+       bytes     tokens  files  translation unit
+          80         39      3  g.cpp
+
+          cost      bytes  count  header
+            40         40      1  w.h
+                          chain: g.cpp -> w.h
+            22         22      1  p.h
+                          chain: g.cpp -> p.h
+            18          9      2  u.h
+                          chain: g.cpp -> u.h' includecost g.cpp
+
+# depindex/dependents: the index is updated lexing only the modified
+# files (modified some time ago, see the "racy file" case below)
+touch -d "2020-01-01 00:00:00" $tmp/*.cpp $tmp/*.h $tmp/inc/b.h
+run "depindex" 'deps.dep: 8 files, 8 lexed' depindex -depindex deps.dep -I inc t.cpp u.cpp g.cpp
+run "dependents" 'inc/b.h: 3 dependents, 2 translation units
+  t.cpp
+  u.cpp' dependents -depindex deps.dep inc/b.h
+run "depindex (no changes)" 'deps.dep: 8 files, 0 lexed' depindex -depindex deps.dep -I inc t.cpp u.cpp g.cpp
+
+cat >$tmp/u.cpp <<EOF
+#include "w.h"
+int main() { return 1; }
+EOF
+touch -d "2020-01-02 00:00:00" $tmp/u.cpp
+run "depindex (modified file)" 'deps.dep: 8 files, 1 lexed' depindex -depindex deps.dep -I inc t.cpp u.cpp g.cpp
+run "dependents (modified file)" 'inc/b.h: 2 dependents, 1 translation units
+  t.cpp
+w.h: 2 dependents, 2 translation units
+  u.cpp
+  g.cpp' dependents -depindex deps.dep inc/b.h w.h
+
+# A file modified just before the index was written is checked again
+# even if its size and modification time are the same
+cat >$tmp/r.cpp <<EOF
+#include "a.h"
+EOF
+touch -r $tmp/r.cpp $tmp/r.ref
+run "depindex (new file)" 'deps.dep: 9 files, 1 lexed' depindex -depindex deps.dep -I inc t.cpp u.cpp g.cpp r.cpp
+cat >$tmp/r.cpp <<EOF
+#include "w.h"
+EOF
+touch -r $tmp/r.ref $tmp/r.cpp
+run "depindex (racy file)" 'deps.dep: 9 files, 1 lexed' depindex -depindex deps.dep -I inc t.cpp u.cpp g.cpp r.cpp
+run "dependents (racy file)" 'w.h: 3 dependents, 3 translation units
+  u.cpp
+  g.cpp
+  r.cpp' dependents -depindex deps.dep w.h
+
+# A corrupted index is rejected (number of #includes of the first
+# node out of the edges, DepIndexNode::nincludes is at byte 44 of the
+# first node, which is at byte 48)
+cp $tmp/deps.dep $tmp/corrupted.dep
+printf '\xff\xff\xff\x0f' | \
+    dd of=$tmp/corrupted.dep bs=1 seek=$((48 + 44)) conv=notrunc 2>/dev/null
+run "corrupted index" 'dependents: cannot open index file (use -depindex file)' \
+    dependents -depindex corrupted.dep w.h
+run "corrupted index (rebuilt)" 'corrupted.dep: 9 files, 9 lexed' \
+    depindex -depindex corrupted.dep -I inc t.cpp u.cpp g.cpp r.cpp
+run "depindex (cannot write)" 'nodir/deps.dep: cannot write dependencies index' \
+    depindex -depindex nodir/deps.dep -I inc t.cpp
+(cd $tmp && $CPPILLR depindex -depindex nodir/deps.dep t.cpp >/dev/null)
+check "depindex (cannot write, exit code)" "1" "$?"
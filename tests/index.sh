@@ -0,0 +1,122 @@
+#! /bin/bash
+#
+# Tests of the token index ("index" and "index-query" commands): the
+# matches must be the same as the ones of the "find" command, only
+# the modified files must be lexed again when the index is updated,
+# and a corrupted index must be rejected.
+#
+#   CPPILLR=path/to/cppillr bash index.sh
+
+if [[ "$CPPILLR" == "" ]] ; then
+    CPPILLR="cppillr"
+fi
+
+this=$(cd $(dirname "$0") && pwd)/index.sh
+src=$(cd $(dirname "$0")/.. && pwd)/cppillr
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+check() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [[ "$actual" != "$expected" ]] ; then
+        echo "$this:1: failed $name"
+        echo "expected: $expected"
+        echo "actual: $actual"
+        exit 1
+    fi
+    echo "$this: ok $name"
+}
+
+# run "name" "expected output" cppillr-args... (from $tmp)
+run() {
+    local name="$1"
+    local expected="$2"
+    shift 2
+    check "$name" "$expected" \
+          "$(cd $tmp && $CPPILLR "$@" | grep -v "^running command")"
+}
+
+# The matches of index-query must be the same as the find ones (with
+# the sources of cppillr)
+(cd $src && $CPPILLR index -tokindex $tmp/src.tix *.cpp *.h) >/dev/null
+
+same_matches() {
+    local pattern="$1"
+    local expected=$(cd $src && $CPPILLR find "$pattern" *.cpp *.h | \
+                         grep -v "^running command\|^find:")
+    if [[ "$expected" == "" ]] ; then
+        echo "$this:1: failed '$pattern' (no matches)"
+        exit 1
+    fi
+    check "index-query '$pattern'" "$expected" \
+          "$(cd $src && $CPPILLR index-query -tokindex $tmp/src.tix "$pattern" | \
+               grep -v "^running command\|^index-query:")"
+}
+same_matches 'std :: $id'
+same_matches 'for ( int $id = 0 ;'
+same_matches 'return $* ;'
+same_matches '#include $header'
+same_matches '$id ( $const'
+
+# Only the modified files are lexed again (files modified some time
+# ago, see is_racy_stamp())
+cat >$tmp/a.cpp <<EOF
+int f() { return g(1, 2); }
+EOF
+cat >$tmp/b.cpp <<EOF
+int g(int a, int b) { return a+b; }
+EOF
+cat >$tmp/c.cpp <<EOF
+int h() { return g(3, 4); }
+EOF
+touch -d "2020-01-01 00:00:00" $tmp/*.cpp
+pattern='return g ( $number , $number )'
+run "new index" 'x.tix: 3 files, 3 lexed, 33 terms' index -tokindex x.tix a.cpp b.cpp c.cpp
+run "query" 'a.cpp:1:17: return g ( 1 , 2 )
+c.cpp:1:17: return g ( 3 , 4 )
+index-query: 2 matches in 2 files (2 candidates of 3 files)' index-query -tokindex x.tix "$pattern"
+run "no changes" 'x.tix: 3 files, 0 lexed, 33 terms' index -tokindex x.tix a.cpp b.cpp c.cpp
+
+cat >$tmp/c.cpp <<EOF
+int h() { return g(5, 6) + g(7, 8); }
+EOF
+touch -d "2020-01-02 00:00:00" $tmp/c.cpp
+run "modified file" 'x.tix: 3 files, 1 lexed, 40 terms' index -tokindex x.tix a.cpp b.cpp c.cpp
+run "query (modified file)" 'a.cpp:1:17: return g ( 1 , 2 )
+c.cpp:1:17: return g ( 5 , 6 )
+index-query: 2 matches in 2 files (2 candidates of 3 files)' index-query -tokindex x.tix "$pattern"
+
+# Removed file
+run "removed file" 'x.tix: 2 files, 0 lexed, 27 terms' index -tokindex x.tix a.cpp c.cpp
+run "query (removed file)" 'index-query: 0 matches in 0 files (0 candidates of 2 files)' \
+    index-query -tokindex x.tix 'return a + b'
+
+# Corrupted indexes are rejected: postings offset of the first term
+# out of the postings (TokIndexHeader::terms_offset is at byte 24,
+# and TokIndexTerm::postings at byte 8), invalid postings
+# (postings_offset and tokens_offset are at bytes 32 and 40), and a
+# file name without the zero terminator (the last byte of the file)
+offset() {
+    od -An -t u8 -j $1 -N 8 $tmp/x.tix | tr -d ' '
+}
+terms_offset=$(offset 24)
+postings_offset=$(offset 32)
+tokens_offset=$(offset 40)
+
+cp $tmp/x.tix $tmp/corrupted.tix
+printf '\xff\xff\xff\x0f' | \
+    dd of=$tmp/corrupted.tix bs=1 seek=$((terms_offset + 8)) conv=notrunc 2>/dev/null
+run "corrupted term" 'index-query: cannot open index file (use -tokindex file)' \
+    index-query -tokindex corrupted.tix "$pattern"
+
+cp $tmp/x.tix $tmp/corrupted.tix
+head -c $((tokens_offset - postings_offset)) /dev/zero | tr '\0' '\377' | \
+    dd of=$tmp/corrupted.tix bs=1 seek=$postings_offset conv=notrunc 2>/dev/null
+run "corrupted postings" 'corrupted.tix: invalid token index' \
+    index-query -tokindex corrupted.tix "$pattern"
+
+head -c -1 $tmp/x.tix >$tmp/corrupted.tix
+run "file name without terminator" 'index-query: cannot open index file (use -tokindex file)' \
+    index-query -tokindex corrupted.tix "$pattern"
@@ -0,0 +1,56 @@
+#! /bin/bash
+#
+# Tests of the -format jsonl output: the text of the tokens must be
+# escaped as JSON strings (quotes, backslashes and control
+# characters), including the escapes found after runs of 16 or more
+# bytes (which are scanned in blocks of 16 bytes with SSE2).
+#
+#   CPPILLR=path/to/cppillr bash jsonl.sh
+
+if [[ "$CPPILLR" == "" ]] ; then
+    CPPILLR="cppillr"
+fi
+
+this=$(cd $(dirname "$0") && pwd)/jsonl.sh
+tmp=$(mktemp -d)
+trap 'rm -rf $tmp' EXIT
+
+check() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [[ "$actual" != "$expected" ]] ; then
+        echo "$this:1: failed $name"
+        echo "expected: $expected"
+        echo "actual: $actual"
+        exit 1
+    fi
+    echo "$this: ok $name"
+}
+
+# expect_tokens "name" "expected lines" token-kind (only the tokens of
+# the given kind)
+expect_tokens() {
+    local name="$1"
+    local expected="$2"
+    check "$name" "$expected" \
+          "$(cd $tmp && $CPPILLR -showtokens -format jsonl t.cpp | grep "\"kind\":\"$3\"")"
+}
+
+# A literal and a comment with a quote, backslash, tab and \001 after
+# 20 bytes without escapes, and a quote just at the end of the first
+# 16 bytes (the lexer keeps the text of literals without their escape
+# sequences)
+printf 'const char* s = "0123456789abcdefghij\\"quote\\\\back\tTAB";\n' >$tmp/t.cpp
+printf 'const char* t = "0123456789abcde\\"";\n' >>$tmp/t.cpp
+printf '// 0123456789abcdefghij "q" \\ \t\001 end\n' >>$tmp/t.cpp
+printf 'int x;\n' >>$tmp/t.cpp
+printf '// 0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz\n' >>$tmp/t.cpp
+
+expect_tokens "literals" \
+'{"type":"token","file":"t.cpp","line":1,"col":55,"index":5,"kind":"literal","text":"0123456789abcdefghij\"quote\\back\tTAB"}
+{"type":"token","file":"t.cpp","line":2,"col":35,"index":12,"kind":"literal","text":"0123456789abcde\""}' literal
+
+expect_tokens "comments" \
+'{"type":"token","file":"t.cpp","line":4,"col":0,"index":14,"kind":"comment","text":"0123456789abcdefghij \"q\" \\ \t\u0001 end"}
+{"type":"token","file":"t.cpp","line":6,"col":0,"index":18,"kind":"comment","text":"0123456789abcdefghijklmnopqrstuvwxyz0123456789abcdefghijklmnopqrstuvwxyz"}' comment
@@ -0,0 +1,92 @@
+#! /bin/bash
+#
+# Performance regression test: runs cppillr_bench with a fixed
+# synthetic corpus and compares the speed of each phase and the peak
+# RSS with the values in perf_baseline.json (with the tolerances
+# specified in the same file). Exits with 1 if there is a regression.
+#
+#   CPPILLR_BENCH=path/to/cppillr_bench bash perf.sh [--update]
+#
+# The speed of each phase is relative to the "calibrate" phase of the
+# same run (a simple hash loop over the same files), so the baseline
+# can be compared with the results of a different machine. Use
+# --update to write a new baseline.
+
+if [[ "$CPPILLR_BENCH" == "" ]] ; then
+    CPPILLR_BENCH="cppillr_bench"
+fi
+
+baseline=$(cd $(dirname "$0") && pwd)/perf_baseline.json
+phases="lex fast-parse body-parse docs"
+
+tmp=$(mktemp -d)
+trap "rm -rf $tmp" EXIT
+
+# Same corpus and options of the baseline
+if ! $CPPILLR_BENCH -files 100 -seed 1 -threads 1 -repeat 5 \
+     -corpus $tmp/corpus -json $tmp/result.json >$tmp/stdout ; then
+    cat $tmp/stdout
+    echo "$baseline:1: failed running $CPPILLR_BENCH"
+    exit 1
+fi
+
+# Returns the number of the given key from a JSON file (the first one)
+json_number() {
+    grep "\"$2\":" "$1" | head -1 | sed -e "s@.*\"$2\": *{*[^0-9]*\([0-9.]*\).*@\1@"
+}
+
+tokens_s() {
+    grep "\"$2\": {" "$1" | head -1 | sed -e 's@.*"tokens_s": *\([0-9.]*\).*@\1@'
+}
+
+# Speed of the given phase relative to the calibration phase
+relative_speed() {
+    awk -v a="$(tokens_s $1 $2)" -v c="$(tokens_s $1 calibrate)" \
+        'BEGIN { printf "%.4f", a / c }'
+}
+
+if [[ "$1" == "--update" ]] ; then
+    {
+        echo "{"
+        echo "  \"tolerance\": 0.5,"
+        echo "  \"rss_tolerance\": 0.25,"
+        for phase in $phases ; do
+            echo "  \"$phase\": $(relative_speed $tmp/result.json $phase),"
+        done
+        echo "  \"peak_rss_kb\": $(json_number $tmp/result.json peak_rss_kb)"
+        echo "}"
+    } > "$baseline"
+    cat "$baseline"
+    exit 0
+fi
+
+tolerance=$(json_number "$baseline" tolerance)
+rss_tolerance=$(json_number "$baseline" rss_tolerance)
+result=0
+
+for phase in $phases ; do
+    expected=$(json_number "$baseline" $phase)
+    actual=$(relative_speed $tmp/result.json $phase)
+
+    echo -n "$baseline: $phase $actual x calibrate (baseline $expected)"
+    if awk -v a="$actual" -v e="$expected" -v t="$tolerance" \
+           'BEGIN { exit !(a >= e*(1-t)) }' ; then
+        echo ": ok"
+    else
+        echo ":1: failed, less than $tolerance of tolerance"
+        result=1
+    fi
+done
+
+expected=$(json_number "$baseline" peak_rss_kb)
+actual=$(json_number $tmp/result.json peak_rss_kb)
+echo -n "$baseline: peak RSS $actual KB (baseline $expected KB)"
+if awk -v a="$actual" -v e="$expected" -v t="$rss_tolerance" \
+       'BEGIN { exit !(a <= e*(1+t)) }' ; then
+    echo ": ok"
+else
+    echo ":1: failed, more than $rss_tolerance of tolerance"
+    result=1
+fi
+
+exit $result
@@ -0,0 +1,113 @@
+#! /bin/bash
+#
+# Test of the "serve" command: starts a server with a couple of files,
+# sends requests with cppillr_client, modifies a file to check that
+# it's lexed again, and stops the server.
+#
+#   CPPILLR=path/to/cppillr CPPILLR_CLIENT=path/to/cppillr_client bash serve.sh
+
+if [[ "$CPPILLR" == "" ]] ; then
+    CPPILLR="cppillr"
+fi
+if [[ "$CPPILLR_CLIENT" == "" ]] ; then
+    CPPILLR_CLIENT="cppillr_client"
+fi
+
+this=$(cd $(dirname "$0") && pwd)/serve.sh
+tmp=$(mktemp -d)
+server_pid=
+trap '[[ "$server_pid" != "" ]] && kill $server_pid 2>/dev/null; rm -rf $tmp' EXIT
+
+socket=$tmp/cppillr.sock
+cat >$tmp/a.cpp <<EOF
+int f(int a, char b) { return a; }
+void g() { }
+int main() { return f(1, 2); }
+EOF
+cat >$tmp/b.h <<EOF
+#pragma once
+#include <vector>
+#include "c.h"
+EOF
+
+$CPPILLR serve -socket $socket $tmp/a.cpp $tmp/b.h >$tmp/stdout &
+server_pid=$!
+
+# Wait the server
+for i in $(seq 100) ; do
+    [[ -S $socket ]] && break
+    sleep 0.05
+done
+
+client() {
+    $CPPILLR_CLIENT -socket $socket "$@"
+}
+
+expect() {
+    expected="$1"
+    shift
+    actual=$(client "$@")
+    if [[ "$actual" != "$expected" ]] ; then
+        echo "$this:1: failed \"$*\""
+        echo "expected: $expected"
+        echo "actual: $actual"
+        exit 1
+    fi
+    echo "$this: ok $*"
+}
+
+expect "pong" ping
+expect "$tmp/a.cpp:1:6: int f(int a, char b)
+$tmp/a.cpp:2:7: void g()
+$tmp/a.cpp:3:9: int main()" functions $tmp/a.cpp
+expect "$tmp/a.cpp:2:7: void g()" find g
+expect "$tmp/b.h: #pragma once
+$tmp/b.h:2: #include <vector>
+$tmp/b.h:3: #include \"c.h\"" includes $tmp/b.h
+expect "$tmp/a.cpp: tokens=35 lines=4 functions=3 bytes=79 cached" lex $tmp/a.cpp
+
+# Modified file
+echo "int h() { return 0; }" >>$tmp/a.cpp
+expect "$tmp/a.cpp: tokens=44 lines=5 functions=4 bytes=101 lexed" lex $tmp/a.cpp
+expect "$tmp/a.cpp:4:6: int h()" find h
+
+# Errors don't stop the server
+echo "int x = 1;" >$tmp/c.cpp
+if [[ "$(client lex $tmp/c.cpp)" != "$tmp/c.cpp:1:8: expecting '('" ]] ; then
+    echo "$this:1: expecting an error parsing $tmp/c.cpp"
+    exit 1
+fi
+if client lex $tmp/missing.cpp >/dev/null ; then
+    echo "$this:1: expecting an error lexing $tmp/missing.cpp"
+    exit 1
+fi
+expect "files 4
+errors 2
+bytes 158
+tokens 63
+lines 11
+functions 4
+lexed 5
+requests 10" stats
+
+# find checks all the files (at most once every 500ms)
+sleep 0.6
+echo "int k() { return 0; }" >>$tmp/a.cpp
+sleep 0.6
+expect "$tmp/a.cpp:5:6: int k()" find k
+
+# A client sending a too long line is disconnected (a valid "ping"
+# request with 100000 spaces)
+if client "ping$(head -c 100000 /dev/zero | tr '\0' ' ')" >/dev/null 2>&1 ; then
+    echo "$this:1: expecting a disconnection with a too long line"
+    exit 1
+fi
+expect "pong" ping
+
+client shutdown >/dev/null
+wait $server_pid
+server_pid=
+if [[ -S $socket ]] ; then
+    echo "$this:1: the socket was not removed"
+    exit 1
+fi
@@ -0,0 +1,177 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+// Test client for "cppillr serve" (see cppillr/serve.h):
+//
+//   cppillr_client -socket PATH [-repeat N] request args...
+//   cppillr_client -socket PATH < requests.txt
+//
+// Prints the payload of each response, and returns 1 if some
+// response was an error. With -repeat N the request is sent N times
+// (the payload is printed once) and the min/avg/max latency is
+// printed to stderr.
+
+#include "cppillr/serve.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+class Connection {
+  int fd = -1;
+  std::string input;
+public:
+  ~Connection() {
+    if (fd >= 0)
+      close(fd);
+  }
+
+  bool open(const std::string& path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+      return false;
+    std::strcpy(addr.sun_path, path.c_str());
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    return (fd >= 0 &&
+            connect(fd, (const sockaddr*)&addr, sizeof(addr)) == 0);
+  }
+
+  // Sends the request and waits the response. Returns false if the
+  // connection was closed.
+  bool request(const std::string& line, bool& ok, std::string& payload) {
+    const std::string req = line + "\n";
+    const char* p = req.data();
+    std::size_t n = req.size();
+    while (n > 0) {
+      const ssize_t w = write(fd, p, n);
+      if (w < 0) {
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+      p += w;
+      n -= std::size_t(w);
+    }
+
+    // Header: "ok N" or "error N"
+    std::size_t eol;
+    while ((eol = input.find('\n')) == std::string::npos)
+      if (!read_more())
+        return false;
+    const std::string header = input.substr(0, eol);
+    input.erase(0, eol+1);
+
+    const std::size_t space = header.find(' ');
+    if (space == std::string::npos)
+      return false;
+    ok = (header.substr(0, space) == serve::ok_status);
+    const std::size_t size = std::strtoul(header.c_str()+space+1, nullptr, 10);
+
+    while (input.size() < size)
+      if (!read_more())
+        return false;
+    payload = input.substr(0, size);
+    input.erase(0, size);
+    return true;
+  }
+
+private:
+  bool read_more() {
+    char buf[4096];
+    ssize_t n;
+    do {
+      n = read(fd, buf, sizeof(buf));
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+      return false;
+    input.append(buf, n);
+    return true;
+  }
+};
+
+int main(int argc, char* argv[])
+{
+  std::string socket_path;
+  std::string request;
+  int repeat = 1;
+
+  for (int i=1; i<argc; ++i) {
+    if ((std::strcmp(argv[i], "-socket") == 0 ||
+         std::strcmp(argv[i], "--socket") == 0) && i+1 < argc) {
+      socket_path = argv[++i];
+    }
+    else if (std::strcmp(argv[i], "-repeat") == 0 && i+1 < argc) {
+      repeat = std::max(1, int(std::strtol(argv[++i], nullptr, 10)));
+    }
+    else {
+      if (!request.empty())
+        request.push_back(' ');
+      request += argv[i];
+    }
+  }
+
+  if (socket_path.empty()) {
+    std::printf("%s: specify the socket path with -socket PATH\n", argv[0]);
+    return 1;
+  }
+
+  Connection conn;
+  if (!conn.open(socket_path)) {
+    std::printf("%s: cannot connect (%s)\n",
+                socket_path.c_str(), std::strerror(errno));
+    return 1;
+  }
+
+  std::vector<std::string> requests;
+  if (!request.empty())
+    requests.push_back(request);
+  else {
+    std::string line;
+    while (std::getline(std::cin, line))
+      if (!line.empty())
+        requests.push_back(line);
+  }
+
+  int ret_value = 0;
+  for (const auto& req : requests) {
+    double min_ms = 0.0, max_ms = 0.0, total_ms = 0.0;
+    bool ok = false;
+    std::string payload;
+    for (int r=0; r<repeat; ++r) {
+      const auto t0 = std::chrono::steady_clock::now();
+      if (!conn.request(req, ok, payload)) {
+        std::printf("%s: connection closed\n", socket_path.c_str());
+        return 1;
+      }
+      const double ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - t0).count();
+      min_ms = (r == 0 ? ms: std::min(min_ms, ms));
+      max_ms = std::max(max_ms, ms);
+      total_ms += ms;
+    }
+
+    std::fwrite(payload.data(), 1, payload.size(), stdout);
+    if (!ok)
+      ret_value = 1;
+    if (repeat > 1) {
+      std::fprintf(stderr, "%s: %d requests, min %.3f ms, avg %.3f ms, max %.3f ms\n",
+                   req.c_str(), repeat, min_ms, total_ms / repeat, max_ms);
+    }
+  }
+  return ret_value;
+}
@@ -0,0 +1,108 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+// Test of TokenCursor with compressed tokens (see
+// cppillr/token_cursor.h):
+//
+//   token_cursor_test files...
+//
+// Lexes each file and compares the tokens decoded from the compact
+// layout with the plain ones: iterating all the tokens, and seeking
+// to each token around the CompactTokens::BlockSize boundaries (and
+// iterating from there to the next block). Returns 1 if a token is
+// different.
+
+#include "cppillr/keywords.h"
+#include "cppillr/lexer.h"
+#include "cppillr/token_cursor.h"
+
+#include <cstdio>
+
+static bool same_token(const Token& a, const Token& b)
+{
+  return (a.kind == b.kind &&
+          a.pos.line == b.pos.line &&
+          a.pos.col == b.pos.col &&
+          a.i == b.i &&
+          a.j == b.j);
+}
+
+// Compares "count" tokens from the given index of both cursors
+static bool compare(const LexData& plain, const LexData& compact,
+                    const int i, const int count)
+{
+  TokenCursor a(plain, i);
+  TokenCursor b(compact, i);
+  for (int k=0; k<count; ++k, ++a, ++b) {
+    if (a.index() != b.index() ||
+        a.at_end() != b.at_end() ||
+        !same_token(*a, *b)) {
+      std::printf("%s: different token %d (seek to %d)\n",
+                  plain.fn.c_str(), a.index(), i);
+      return false;
+    }
+    if (a.at_end())
+      break;
+  }
+  return true;
+}
+
+int main(int argc, char* argv[])
+{
+  create_keyword_tables();
+
+  const int n = CompactTokens::BlockSize;
+  int ret_value = 0;
+  for (int f=1; f<argc; ++f) {
+    Lexer lexer;
+    if (lexer.lex(argv[f]) != Lexer::Result::OK) {
+      std::printf("%s: cannot lex file\n", argv[f]);
+      return 1;
+    }
+    LexData plain = lexer.move_data();
+    LexData compact = plain;
+    compress_tokens(compact);
+
+    const int ntokens = plain.ntokens();
+    if (!compact.compact ||
+        compact.ntokens() != ntokens ||
+        ntokens < 3*n) {
+      std::printf("%s: expected at least %d compressed tokens\n",
+                  argv[f], 3*n);
+      return 1;
+    }
+
+    // All tokens
+    if (!compare(plain, compact, 0, ntokens+1))
+      ret_value = 1;
+
+    // Seek to the tokens around each block boundary (backward too)
+    for (int b=ntokens/n*n; b>=0; b-=n) {
+      for (int i=b-2; i<=b+2; ++i) {
+        if (i >= 0 && i <= ntokens &&
+            !compare(plain, compact, i, n+2))
+          ret_value = 1;
+      }
+    }
+
+    // Seek the same cursor to different blocks
+    TokenCursor it(compact);
+    for (int i : { 2*n+1, n-1, ntokens-1, 0, n, n+5, ntokens }) {
+      it.seek(i);
+      TokenCursor expected(plain, i);
+      if (it.index() != i ||
+          it.at_end() != expected.at_end() ||
+          !same_token(*it, *expected)) {
+        std::printf("%s: different token %d (seek of the same cursor)\n",
+                    argv[f], i);
+        ret_value = 1;
+      }
+    }
+
+    if (ret_value == 0)
+      std::printf("%s: ok %d tokens\n", argv[f], ntokens);
+  }
+  return ret_value;
+}
@@ -0,0 +1,99 @@
+#! /bin/bash
+#
+# Test of the "watch" command: starts watching a directory, modifies,
+# adds, and removes files (and directories), and checks the totals
+# printed after each update.
+#
+#   CPPILLR=path/to/cppillr bash watch.sh
+
+if [[ "$CPPILLR" == "" ]] ; then
+    CPPILLR="cppillr"
+fi
+
+this=$(cd $(dirname "$0") && pwd)/watch.sh
+tmp=$(mktemp -d)
+watch_pid=
+trap '[[ "$watch_pid" != "" ]] && kill $watch_pid 2>/dev/null; rm -rf $tmp' EXIT
+
+# inotify is available only on Linux
+if [[ "$(uname)" != "Linux" ]] ; then
+    echo "$this: skipped (no inotify)"
+    exit 0
+fi
+
+check() {
+    local name="$1"
+    local expected="$2"
+    local actual="$3"
+    if [[ "$actual" != "$expected" ]] ; then
+        echo "$this:1: failed $name"
+        echo "expected: $expected"
+        echo "actual: $actual"
+        exit 1
+    fi
+    echo "$this: ok $name"
+}
+
+# update "name" "expected output" (waits the next update and compares
+# its output without the "watch:" line, which contains the times; the
+# output of each update is flushed at once)
+nupdates=0
+update() {
+    local name="$1"
+    local expected="$2"
+    nupdates=$((nupdates+1))
+    for i in $(seq 100) ; do
+        [[ $(grep -c "^files " $tmp/out) -ge $nupdates ]] && break
+        sleep 0.05
+    done
+    check "$name" "$expected" \
+          "$(awk -v n=$nupdates '/^watch:/ { ++k; next } k == n' $tmp/out)"
+    check "$name (only one update)" "$nupdates" "$(grep -c "^watch:" $tmp/out)"
+}
+
+mkdir -p $tmp/w/sub
+echo "int f() { return 0; }" >$tmp/w/a.cpp
+echo "int b() { return 1; }" >$tmp/w/sub/b.h
+echo "not a source file" >$tmp/w/readme.txt
+
+(cd $tmp && exec $CPPILLR watch -showfunctions w) >$tmp/out &
+watch_pid=$!
+
+update "initial files" "files 2, errors 0, bytes 44, tokens 20, lines 4, functions 2 (2 names)"
+
+# Modified file (the old stats are subtracted)
+echo "int h() { return 2; }" >>$tmp/w/a.cpp
+update "modified file" "files 2, errors 0, bytes 66, tokens 29, lines 5, functions 3 (3 names)
++ w/a.cpp: function h()"
+
+# A burst of changes is coalesced in one update
+echo "int c() { return 3; }" >$tmp/w/c.cpp
+echo "int d() { return 4; }" >$tmp/w/d.cpp
+echo "int i() { return 5; }" >>$tmp/w/a.cpp
+update "burst of changes" "files 4, errors 0, bytes 132, tokens 58, lines 10, functions 6 (6 names)
++ w/a.cpp: function i()
++ w/c.cpp: function c()
++ w/d.cpp: function d()"
+
+# Removed file, and a file with an error
+rm $tmp/w/sub/b.h
+echo "int x = 1;" >$tmp/w/d.cpp
+update "removed file" "w/d.cpp:1:8: expecting '('
+files 3, errors 1, bytes 99, tokens 44, lines 8, functions 4 (4 names)
+- w/d.cpp: function d()
+- w/sub/b.h: function b()"
+
+# New directory (its files are found even if they were created before
+# the directory was watched) and removed directory
+mkdir $tmp/w/new
+echo "int e() { return 6; }" >$tmp/w/new/e.cpp
+update "new directory" "files 4, errors 1, bytes 121, tokens 54, lines 10, functions 5 (5 names)
++ w/new/e.cpp: function e()"
+
+rm -r $tmp/w/new
+update "removed directory" "files 3, errors 1, bytes 99, tokens 44, lines 8, functions 4 (4 names)
+- w/new/e.cpp: function e()"
+
+kill $watch_pid
+wait $watch_pid
+watch_pid=
@@ -0,0 +1,313 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#include "utils/alloc_profile.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+namespace alloc {
+
+namespace {
+
+const int MaxThreads = 256;
+
+// Header before each allocated block to know the size and who
+// allocated it when it's deleted (16 bytes to keep the alignment of
+// malloc())
+struct Header {
+  uint64_t size;
+  uint32_t phase;
+  uint32_t tag;
+};
+static_assert(sizeof(Header) == 16, "Header must keep the malloc() alignment");
+
+// Counters of each thread (no synchronization needed)
+struct ThreadStats {
+  uint64_t allocs[NumPhases][MaxTags];
+  uint64_t bytes[NumPhases][MaxTags];
+};
+
+// Counters shared by the threads after the first MaxThreads-1 ones
+struct SharedStats {
+  std::atomic<uint64_t> allocs[NumPhases][MaxTags];
+  std::atomic<uint64_t> bytes[NumPhases][MaxTags];
+};
+
+// All data is POD/zero-initialized so it can be used by operator new
+// before main() and without allocating memory itself.
+const char* tag_names[MaxTags] = { "(untagged)" };
+std::atomic<int> ntags(1);
+std::mutex tags_mutex;
+
+ThreadStats thread_stats[MaxThreads-1];
+SharedStats overflow_stats;
+std::atomic<int> nthreads(0);
+
+// Live bytes (allocated in one thread can be freed in other thread)
+std::atomic<int64_t> live[NumPhases][MaxTags];
+std::atomic<int64_t> peak[NumPhases][MaxTags];
+std::atomic<int64_t> live_phase[NumPhases];
+std::atomic<int64_t> peak_phase[NumPhases];
+
+thread_local int thread_i = -1;
+thread_local Phase current_phase = Other;
+thread_local int current_tag = 0;
+
+void update_peak(std::atomic<int64_t>& peak, const int64_t value)
+{
+  int64_t old = peak.load(std::memory_order_relaxed);
+  while (value > old &&
+         !peak.compare_exchange_weak(old, value, std::memory_order_relaxed))
+    ;
+}
+
+// Fills the header of a new block and counts it
+void* count_alloc(Header* h, std::size_t size)
+{
+  if (thread_i < 0) {
+    thread_i = nthreads++;
+    // Threads after MaxThreads-1 use the shared (atomic) counters
+    if (thread_i >= MaxThreads-1)
+      thread_i = MaxThreads-1;
+  }
+
+  h->size = size;
+  h->phase = current_phase;
+  h->tag = current_tag;
+
+  if (thread_i < MaxThreads-1) {
+    ThreadStats& s = thread_stats[thread_i];
+    ++s.allocs[h->phase][h->tag];
+    s.bytes[h->phase][h->tag] += size;
+  }
+  else {
+    overflow_stats.allocs[h->phase][h->tag].fetch_add(1, std::memory_order_relaxed);
+    overflow_stats.bytes[h->phase][h->tag].fetch_add(size, std::memory_order_relaxed);
+  }
+
+  update_peak(peak[h->phase][h->tag],
+              live[h->phase][h->tag].fetch_add(size, std::memory_order_relaxed) + size);
+  update_peak(peak_phase[h->phase],
+              live_phase[h->phase].fetch_add(size, std::memory_order_relaxed) + size);
+  return h+1;
+}
+
+void uncount(const Header* h)
+{
+  live[h->phase][h->tag].fetch_sub(h->size, std::memory_order_relaxed);
+  live_phase[h->phase].fetch_sub(h->size, std::memory_order_relaxed);
+}
+
+void* counted_alloc(std::size_t size)
+{
+  Header* h = (Header*)std::malloc(sizeof(Header) + size);
+  if (!h)
+    return nullptr;
+  return count_alloc(h, size);
+}
+
+void counted_free(void* ptr)
+{
+  if (!ptr)
+    return;
+
+  Header* h = ((Header*)ptr)-1;
+  uncount(h);
+  std::free(h);
+}
+
+#ifdef __cpp_aligned_new
+
+// Blocks with an alignment greater than the malloc() one have the
+// pointer returned by malloc() before the header:
+//
+//   [padding] [malloc() pointer] [Header] [block aligned to "align"]
+void* counted_alloc_aligned(std::size_t size, std::size_t align)
+{
+  const std::size_t extra = sizeof(void*) + sizeof(Header) + align-1;
+  char* raw = (char*)std::malloc(extra + size);
+  if (!raw)
+    return nullptr;
+
+  uintptr_t block = uintptr_t(raw + sizeof(void*) + sizeof(Header));
+  block = (block + align-1) & ~uintptr_t(align-1);
+  Header* h = ((Header*)block)-1;
+  ((void**)h)[-1] = raw;
+  return count_alloc(h, size);
+}
+
+void counted_free_aligned(void* ptr)
+{
+  if (!ptr)
+    return;
+
+  Header* h = ((Header*)ptr)-1;
+  uncount(h);
+  std::free(((void**)h)[-1]);
+}
+
+#endif // __cpp_aligned_new
+
+const char* phase_name(int phase)
+{
+  static const char* names[NumPhases] = { "other", "lex", "parse", "analysis" };
+  return names[phase];
+}
+
+} // anonymous namespace
+
+int register_tag(const char* name)
+{
+  std::unique_lock<std::mutex> lock(tags_mutex);
+  for (int i=0; i<ntags; ++i)
+    if (std::strcmp(tag_names[i], name) == 0)
+      return i;
+  if (ntags >= MaxTags)
+    return 0;
+  tag_names[ntags] = name;
+  return ntags++;
+}
+
+PhaseScope::PhaseScope(Phase phase) : old(current_phase)
+{
+  current_phase = phase;
+}
+
+PhaseScope::~PhaseScope()
+{
+  current_phase = old;
+}
+
+TagScope::TagScope(int tag) : old(current_tag)
+{
+  current_tag = tag;
+}
+
+TagScope::~TagScope()
+{
+  current_tag = old;
+}
+
+void print()
+{
+  const int n = std::min(int(nthreads), MaxThreads-1);
+  std::printf("%-9s %-20s %12s %14s %14s\n",
+              "phase", "tag", "allocs", "bytes", "peak live");
+  for (int p=0; p<NumPhases; ++p) {
+    uint64_t phase_allocs = 0, phase_bytes = 0;
+    uint64_t allocs[MaxTags] = { 0 }, bytes[MaxTags] = { 0 };
+    for (int t=0; t<ntags; ++t) {
+      for (int i=0; i<n; ++i) {
+        allocs[t] += thread_stats[i].allocs[p][t];
+        bytes[t] += thread_stats[i].bytes[p][t];
+      }
+      allocs[t] += overflow_stats.allocs[p][t].load();
+      bytes[t] += overflow_stats.bytes[p][t].load();
+      phase_allocs += allocs[t];
+      phase_bytes += bytes[t];
+    }
+    if (phase_allocs == 0)
+      continue;
+
+    std::printf("%-9s %-20s %12llu %14llu %14lld\n",
+                phase_name(p), "all",
+                (unsigned long long)phase_allocs,
+                (unsigned long long)phase_bytes,
+                (long long)peak_phase[p].load());
+    for (int t=0; t<ntags; ++t) {
+      if (allocs[t] == 0)
+        continue;
+      std::printf("%-9s %-20s %12llu %14llu %14lld\n",
+                  phase_name(p), tag_names[t],
+                  (unsigned long long)allocs[t],
+                  (unsigned long long)bytes[t],
+                  (long long)peak[p][t].load());
+    }
+  }
+}
+
+} // namespace alloc
+
+//////////////////////////////////////////////////////////////////////
+// Replacement of the global operator new/delete
+
+void* operator new(std::size_t size)
+{
+  void* ptr = alloc::counted_alloc(size);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new[](std::size_t size)
+{
+  void* ptr = alloc::counted_alloc(size);
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+  return alloc::counted_alloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+  return alloc::counted_alloc(size);
+}
+
+void operator delete(void* ptr) noexcept { alloc::counted_free(ptr); }
+void operator delete[](void* ptr) noexcept { alloc::counted_free(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { alloc::counted_free(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { alloc::counted_free(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { alloc::counted_free(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { alloc::counted_free(ptr); }
+
+// Aligned versions (C++17), used for types with an alignment greater
+// than __STDCPP_DEFAULT_NEW_ALIGNMENT__
+#ifdef __cpp_aligned_new
+
+void* operator new(std::size_t size, std::align_val_t align)
+{
+  void* ptr = alloc::counted_alloc_aligned(size, std::size_t(align));
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new[](std::size_t size, std::align_val_t align)
+{
+  void* ptr = alloc::counted_alloc_aligned(size, std::size_t(align));
+  if (!ptr)
+    throw std::bad_alloc();
+  return ptr;
+}
+
+void* operator new(std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+  return alloc::counted_alloc_aligned(size, std::size_t(align));
+}
+
+void* operator new[](std::size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+  return alloc::counted_alloc_aligned(size, std::size_t(align));
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept { alloc::counted_free_aligned(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { alloc::counted_free_aligned(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { alloc::counted_free_aligned(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { alloc::counted_free_aligned(ptr); }
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { alloc::counted_free_aligned(ptr); }
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { alloc::counted_free_aligned(ptr); }
+
+#endif
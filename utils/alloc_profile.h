@@ -0,0 +1,60 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef ALLOC_PROFILE_H_INCLUDED
+#define ALLOC_PROFILE_H_INCLUDED
+
+// Allocation profiling (only when compiled with the
+// CPPILLR_ALLOC_PROFILE CMake option). The global operator new/delete
+// are replaced with versions that count the number of allocations,
+// bytes, and live/peak bytes for the current phase and call-site tag
+// of each thread:
+//
+//   ALLOC_PHASE(alloc::Lex);   // Until the end of the scope, allocations
+//   ALLOC_TAG("lexer");        // go to the "lex" phase with "lexer" tag
+//
+// Without CPPILLR_ALLOC_PROFILE these macros do nothing.
+namespace alloc {
+
+enum Phase { Other, Lex, Parse, Analysis, NumPhases };
+
+#ifdef CPPILLR_ALLOC_PROFILE
+
+const int MaxTags = 64;
+
+// Returns an index for the given static string
+int register_tag(const char* name);
+
+struct PhaseScope {
+  Phase old;
+  PhaseScope(Phase phase);
+  ~PhaseScope();
+};
+
+struct TagScope {
+  int old;
+  TagScope(int tag);
+  ~TagScope();
+};
+
+// Prints the allocations of each phase/tag
+void print();
+
+#endif
+
+} // namespace alloc
+
+#ifdef CPPILLR_ALLOC_PROFILE
+  #define ALLOC_PHASE(phase) \
+    alloc::PhaseScope alloc_phase_scope_(phase)
+  #define ALLOC_TAG(name)                                           \
+    static const int alloc_tag_id_ = alloc::register_tag(name);    \
+    alloc::TagScope alloc_tag_scope_(alloc_tag_id_)
+#else
+  #define ALLOC_PHASE(phase)
+  #define ALLOC_TAG(name)
+#endif
+
+#endif // ALLOC_PROFILE_H_INCLUDED
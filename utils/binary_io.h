@@ -0,0 +1,84 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef BINARY_IO_H_INCLUDED
+#define BINARY_IO_H_INCLUDED
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// Helpers to write/read the little binary files (caches and indexes)
+// generated by cppillr. Values are stored in the native byte order,
+// these files are not meant to be moved between machines.
+
+inline void write_u32(std::FILE* f, uint32_t v) { std::fwrite(&v, 4, 1, f); }
+inline void write_u64(std::FILE* f, uint64_t v) { std::fwrite(&v, 8, 1, f); }
+
+inline void write_string(std::FILE* f, const std::string& s)
+{
+  write_u32(f, uint32_t(s.size()));
+  if (!s.empty())
+    std::fwrite(s.data(), 1, s.size(), f);
+}
+
+// Reads all the content of the given file in "output", returns false
+// if the file cannot be opened.
+inline bool read_file(const std::string& fn, std::vector<uint8_t>& output)
+{
+  std::FILE* f = std::fopen(fn.c_str(), "rb");
+  if (!f)
+    return false;
+  output.clear();
+  uint8_t buf[4096];
+  std::size_t n;
+  while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0)
+    output.insert(output.end(), buf, buf+n);
+  std::fclose(f);
+  return true;
+}
+
+// Reads values from a memory buffer. When we try to read past the end
+// of the buffer, ok() returns false and all next values are zero.
+class BinaryReader {
+  const uint8_t* p;
+  const uint8_t* end;
+  bool ok_ = true;
+
+  bool fetch(void* out, std::size_t n) {
+    if (!ok_ || std::size_t(end - p) < n) {
+      ok_ = false;
+      std::memset(out, 0, n);
+      return false;
+    }
+    std::memcpy(out, p, n);
+    p += n;
+    return true;
+  }
+
+public:
+  BinaryReader(const uint8_t* p, std::size_t n) : p(p), end(p+n) { }
+
+  bool ok() const { return ok_; }
+  bool at_end() const { return p == end; }
+
+  uint32_t u32() { uint32_t v; fetch(&v, 4); return v; }
+  uint64_t u64() { uint64_t v; fetch(&v, 8); return v; }
+
+  std::string string() {
+    uint32_t n = u32();
+    if (!ok_ || std::size_t(end - p) < n) {
+      ok_ = false;
+      return std::string();
+    }
+    std::string s((const char*)p, n);
+    p += n;
+    return s;
+  }
+};
+
+#endif
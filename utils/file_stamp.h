@@ -0,0 +1,71 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef FILE_STAMP_H_INCLUDED
+#define FILE_STAMP_H_INCLUDED
+
+#include "utils/binary_io.h"
+#include "utils/hash.h"
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Identifies a version of a file to know if it must be processed
+// again. The size+mtime pair is a fast check (only a stat() call),
+// and the hash of the content is used to confirm that a touched file
+// has really changed.
+struct FileStamp {
+  uint64_t size = 0;
+  int64_t mtime = 0;            // Nanoseconds since the epoch
+  uint64_t hash = 0;
+};
+
+// Current time in the same units as FileStamp::mtime
+inline int64_t file_stamp_now()
+{
+  return int64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+inline bool get_file_stamp(const std::string& fn, FileStamp& stamp)
+{
+  struct stat st;
+  if (stat(fn.c_str(), &st) != 0)
+    return false;
+  stamp.size = uint64_t(st.st_size);
+#if defined(__APPLE__)
+  stamp.mtime = int64_t(st.st_mtimespec.tv_sec)*1000000000 + st.st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+  stamp.mtime = int64_t(st.st_mtime)*1000000000;
+#else
+  stamp.mtime = int64_t(st.st_mtim.tv_sec)*1000000000 + st.st_mtim.tv_nsec;
+#endif
+  return true;
+}
+
+// True if the size+mtime of the stamp cannot be trusted because the
+// file was modified just before the stamp was taken (at the "checked"
+// time): a later modification could keep the same mtime (depending
+// on the filesystem, mtime can have a resolution of seconds), so the
+// content must be hashed to know if the file changed.
+inline bool is_racy_stamp(const FileStamp& stamp, const int64_t checked)
+{
+  return (stamp.mtime >= checked - 1000000000);
+}
+
+inline bool hash_file_content(const std::string& fn, FileStamp& stamp)
+{
+  std::vector<uint8_t> buf;
+  if (!read_file(fn, buf))
+    return false;
+  stamp.hash = fnv1a(buf.data(), buf.size());
+  return true;
+}
+
+#endif
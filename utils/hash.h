@@ -0,0 +1,34 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef HASH_H_INCLUDED
+#define HASH_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// FNV-1a 64-bit hash, used to identify file contents and strings in
+// the different caches/indexes (it's not a cryptographic hash).
+const uint64_t fnv1a_basis = 14695981039346656037ull;
+
+inline uint64_t fnv1a(const void* data, std::size_t n,
+                      uint64_t h = fnv1a_basis)
+{
+  auto p = (const uint8_t*)data;
+  for (std::size_t i=0; i<n; ++i) {
+    h ^= p[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+inline uint64_t fnv1a(const std::string& s,
+                      uint64_t h = fnv1a_basis)
+{
+  return fnv1a(s.data(), s.size(), h);
+}
+
+#endif
@@ -0,0 +1,88 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef MAPPED_FILE_H_INCLUDED
+#define MAPPED_FILE_H_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+  #include "utils/binary_io.h"
+#else
+  #include <fcntl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <unistd.h>
+#endif
+
+// Read-only view of a whole file mapped in memory (on Windows the
+// file is just read in a buffer).
+class MappedFile {
+  const uint8_t* data_ = nullptr;
+  std::size_t size_ = 0;
+#ifdef _WIN32
+  std::vector<uint8_t> buf;
+#else
+  void* map = nullptr;
+#endif
+public:
+  MappedFile() { }
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+  ~MappedFile() { close(); }
+
+  bool open(const std::string& fn) {
+    close();
+#ifdef _WIN32
+    if (!read_file(fn, buf))
+      return false;
+    data_ = buf.data();
+    size_ = buf.size();
+    return true;
+#else
+    int fd = ::open(fn.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      ::close(fd);
+      return false;
+    }
+    size_ = std::size_t(st.st_size);
+    if (size_ > 0) {
+      map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        map = nullptr;
+        size_ = 0;
+        ::close(fd);
+        return false;
+      }
+      data_ = (const uint8_t*)map;
+    }
+    ::close(fd);
+    return true;
+#endif
+  }
+
+  void close() {
+#ifdef _WIN32
+    buf.clear();
+#else
+    if (map)
+      munmap(map, size_);
+    map = nullptr;
+#endif
+    data_ = nullptr;
+    size_ = 0;
+  }
+
+  const uint8_t* data() const { return data_; }
+  std::size_t size() const { return size_; }
+};
+
+#endif
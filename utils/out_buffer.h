@@ -0,0 +1,127 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef OUT_BUFFER_H_INCLUDED
+#define OUT_BUFFER_H_INCLUDED
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+  #include <emmintrin.h>
+  #define OUT_BUFFER_SSE2 1
+#endif
+
+// Returns the first char in [p, end) that must be escaped inside a
+// JSON string (control chars, '"', and '\\'), or "end" if there is
+// none. It checks 16 chars at a time with SSE2 when it's available.
+inline const char* find_json_escape(const char* p, const char* end)
+{
+#ifdef OUT_BUFFER_SSE2
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i max_ctrl = _mm_set1_epi8(0x1f);
+  for (; end - p >= 16; p += 16) {
+    const __m128i v = _mm_loadu_si128((const __m128i*)p);
+    // v <= 0x1f (unsigned) is the same as min(v, 0x1f) == v
+    const __m128i m =
+      _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, quote),
+                                _mm_cmpeq_epi8(v, backslash)),
+                   _mm_cmpeq_epi8(_mm_min_epu8(v, max_ctrl), v));
+    if (_mm_movemask_epi8(m))
+      break;                    // The scalar loop finds the exact char
+  }
+#endif
+  for (; p < end; ++p) {
+    const uint8_t c = uint8_t(*p);
+    if (c < 0x20 || c == '"' || c == '\\')
+      return p;
+  }
+  return end;
+}
+
+// Text buffer to format big outputs without calling std::printf() for
+// each element (e.g. to format the output of each file in a worker
+// thread and then write it with just one std::fwrite()).
+class OutBuffer {
+public:
+  void reserve(std::size_t n) { buf.reserve(n); }
+  void clear() { buf.clear(); }
+  std::size_t size() const { return buf.size(); }
+  const std::string& str() const { return buf; }
+
+  void put(char c) { buf.push_back(c); }
+  void write(const char* s, std::size_t n) { buf.append(s, n); }
+  void write(const char* s) { buf.append(s, std::strlen(s)); }
+  void write(const std::string& s) { buf.append(s); }
+  void write(const uint8_t* begin, const uint8_t* end) {
+    buf.append((const char*)begin, end - begin);
+  }
+
+  // Same as printf("%d")
+  void write_int(int v) {
+    char tmp[16];
+    char* p = tmp + sizeof(tmp);
+    unsigned int u = (v < 0 ? 0u - unsigned(v): unsigned(v));
+    do {
+      *(--p) = char('0' + u % 10);
+      u /= 10;
+    } while (u);
+    if (v < 0)
+      *(--p) = '-';
+    buf.append(p, tmp + sizeof(tmp) - p);
+  }
+
+  // Writes the given text as a quoted JSON string (bytes >= 0x80 are
+  // copied as they are, the input is expected to be UTF-8)
+  void write_json_string(const char* p, const char* end) {
+    static const char hex[] = "0123456789abcdef";
+    buf.push_back('"');
+    while (true) {
+      const char* q = find_json_escape(p, end);
+      buf.append(p, q - p);
+      if (q == end)
+        break;
+      switch (*q) {
+        case '"':  buf.append("\\\"", 2); break;
+        case '\\': buf.append("\\\\", 2); break;
+        case '\n': buf.append("\\n", 2); break;
+        case '\r': buf.append("\\r", 2); break;
+        case '\t': buf.append("\\t", 2); break;
+        case '\b': buf.append("\\b", 2); break;
+        case '\f': buf.append("\\f", 2); break;
+        default: {
+          const char u[6] = { '\\', 'u', '0', '0',
+                              hex[(uint8_t(*q) >> 4) & 15],
+                              hex[uint8_t(*q) & 15] };
+          buf.append(u, 6);
+          break;
+        }
+      }
+      p = q+1;
+    }
+    buf.push_back('"');
+  }
+  void write_json_string(const std::string& s) {
+    write_json_string(s.data(), s.data() + s.size());
+  }
+  void write_json_string(const uint8_t* begin, const uint8_t* end) {
+    write_json_string((const char*)begin, (const char*)end);
+  }
+
+  // Writes the whole buffer to the given file and clears it
+  void flush(std::FILE* f) {
+    if (!buf.empty())
+      std::fwrite(buf.data(), 1, buf.size(), f);
+    buf.clear();
+  }
+
+private:
+  std::string buf;
+};
+
+#endif // OUT_BUFFER_H_INCLUDED
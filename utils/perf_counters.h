@@ -0,0 +1,333 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef PERF_COUNTERS_H_INCLUDED
+#define PERF_COUNTERS_H_INCLUDED
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef __linux__
+  #include <linux/perf_event.h>
+  #include <sys/syscall.h>
+  #include <unistd.h>
+  #include <cerrno>
+#endif
+
+// Hardware performance counters (cycles, instructions, branch and
+// cache misses) per phase and per thread using perf_event_open() on
+// Linux. Each thread opens its own group of counters the first time
+// it enters a perf::Scope, and the difference of the counters between
+// the beginning and the end of the scope is added to the phase.
+//
+// If the hardware counters cannot be used (e.g. a virtual machine
+// without PMU, or perf_event_paranoid doesn't allow it), software
+// counters are used (task clock, page faults, context switches), and
+// if those are not available either the scopes do nothing.
+namespace perf {
+
+enum Phase { Lex, Parse, Analysis, NumPhases };
+
+inline const char* phase_name(int phase) {
+  static const char* names[NumPhases] = { "lex", "parse", "analysis" };
+  return names[phase];
+}
+
+enum class Mode { Disabled, Hardware, Software };
+
+const int MaxCounters = 6;
+
+struct CounterDef {
+  const char* name;
+  uint32_t type;
+  uint64_t config;
+};
+
+struct Values {
+  uint64_t enabled = 0, running = 0; // To scale multiplexed counters
+  uint64_t v[MaxCounters] = { 0 };
+};
+
+struct ThreadCounters {
+  int tid;
+  int fds[MaxCounters];
+  int index[MaxCounters];       // Position of each counter in the group read (or -1)
+  Values phases[NumPhases];
+};
+
+class Counters {
+public:
+  static Counters& instance() {
+    static Counters counters;
+    return counters;
+  }
+
+  Mode mode = Mode::Disabled;
+
+  // Tries to open the hardware counters (or the software ones) in the
+  // main thread. Returns false if there are no counters available.
+  bool init() {
+    ThreadCounters& tc = thread_counters(); // Disabled mode: no counters opened yet
+
+    mode = Mode::Hardware;
+    if (open_group(tc))
+      return true;
+
+    std::printf("hardware counters not available: %s\n", reason.c_str());
+    mode = Mode::Software;
+    close_group(tc);
+    if (open_group(tc)) {
+      std::printf("using software counters\n");
+      return true;
+    }
+
+    std::printf("software counters not available: %s\n", reason.c_str());
+    mode = Mode::Disabled;
+    return false;
+  }
+
+  const CounterDef* defs(int& n) const {
+#ifdef __linux__
+    static const CounterDef hw[] = {
+      { "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+      { "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+      { "branches", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS },
+      { "branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+      { "L1D-misses", PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D |
+        (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+        (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+      { "LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+    };
+    static const CounterDef sw[] = {
+      { "task-clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK },
+      { "page-faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS },
+      { "context-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES },
+    };
+    if (mode == Mode::Hardware) {
+      n = int(sizeof(hw) / sizeof(hw[0]));
+      return hw;
+    }
+    else if (mode == Mode::Software) {
+      n = int(sizeof(sw) / sizeof(sw[0]));
+      return sw;
+    }
+#endif
+    n = 0;
+    return nullptr;
+  }
+
+  // Returns the counters of the current thread (the group is opened
+  // the first time)
+  ThreadCounters& thread_counters() {
+    ThreadCounters*& tc = current();
+    if (!tc) {
+      std::unique_lock<std::mutex> lock(mutex);
+      threads.emplace_back(new ThreadCounters);
+      tc = threads.back().get();
+      tc->tid = int(threads.size()-1);
+      for (int i=0; i<MaxCounters; ++i)
+        tc->fds[i] = tc->index[i] = -1;
+      lock.unlock();
+
+      if (mode != Mode::Disabled)
+        open_group(*tc);
+    }
+    return *tc;
+  }
+
+  bool read(const ThreadCounters& tc, Values& values) const {
+#ifdef __linux__
+    if (tc.fds[0] < 0)
+      return false;
+    // PERF_FORMAT_GROUP | TOTAL_TIME_ENABLED | TOTAL_TIME_RUNNING
+    uint64_t buf[3 + MaxCounters];
+    if (::read(tc.fds[0], buf, sizeof(buf)) < ssize_t(3*sizeof(uint64_t)))
+      return false;
+    const int n = int(buf[0]);
+    values.enabled = buf[1];
+    values.running = buf[2];
+    for (int i=0; i<MaxCounters; ++i)
+      values.v[i] = (tc.index[i] >= 0 && tc.index[i] < n ? buf[3+tc.index[i]]: 0);
+    return true;
+#else
+    return false;
+#endif
+  }
+
+  // Prints the counters of each phase (all threads and each thread)
+  void print() const {
+    if (mode == Mode::Disabled)
+      return;
+
+    int n;
+    const CounterDef* d = defs(n);
+    std::printf("%-9s %-6s", "phase", "thread");
+    for (int i=0; i<n; ++i)
+      std::printf(" %16s", d[i].name);
+    if (mode == Mode::Hardware)
+      std::printf(" %6s %8s %8s %8s", "IPC", "br-miss%", "L1D/Ki", "LLC/Ki");
+    std::printf("\n");
+
+    for (int p=0; p<NumPhases; ++p) {
+      double total[MaxCounters] = { 0 };
+      bool any = false;
+      for (const auto& tc : threads) {
+        double v[MaxCounters];
+        if (!scaled(tc->phases[p], v))
+          continue;
+        for (int i=0; i<n; ++i)
+          total[i] += v[i];
+        any = true;
+      }
+      if (!any)
+        continue;
+
+      print_row(phase_name(p), "all", total, n);
+      for (const auto& tc : threads) {
+        double v[MaxCounters];
+        if (scaled(tc->phases[p], v))
+          print_row(phase_name(p), std::to_string(tc->tid).c_str(), v, n);
+      }
+    }
+  }
+
+private:
+  Counters() { }
+
+  static ThreadCounters*& current() {
+    thread_local ThreadCounters* tc = nullptr;
+    return tc;
+  }
+
+  bool open_group(ThreadCounters& tc) {
+#ifdef __linux__
+    int n;
+    const CounterDef* d = defs(n);
+    int nopened = 0;
+    for (int i=0; i<n; ++i) {
+      perf_event_attr attr;
+      std::memset(&attr, 0, sizeof(attr));
+      attr.size = sizeof(attr);
+      attr.type = d[i].type;
+      attr.config = d[i].config;
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+      attr.read_format = (PERF_FORMAT_GROUP |
+                          PERF_FORMAT_TOTAL_TIME_ENABLED |
+                          PERF_FORMAT_TOTAL_TIME_RUNNING);
+      // Counters of the calling thread on any CPU
+      int fd = int(syscall(__NR_perf_event_open, &attr, 0, -1,
+                           (i == 0 ? -1: tc.fds[0]), 0));
+      if (fd < 0) {
+        // Without the group leader we cannot count anything
+        if (i == 0) {
+          set_reason(errno);
+          return false;
+        }
+        continue;
+      }
+      tc.fds[i] = fd;
+      tc.index[i] = nopened++;
+    }
+    return true;
+#else
+    reason = "perf_event_open() is only available on Linux";
+    return false;
+#endif
+  }
+
+  void close_group(ThreadCounters& tc) {
+#ifdef __linux__
+    for (int i=0; i<MaxCounters; ++i) {
+      if (tc.fds[i] >= 0)
+        ::close(tc.fds[i]);
+      tc.fds[i] = tc.index[i] = -1;
+    }
+#endif
+  }
+
+  void set_reason(int err) {
+#ifdef __linux__
+    reason = std::strerror(err);
+    if (err == EACCES || err == EPERM) {
+      int paranoid = 0;
+      if (std::FILE* f = std::fopen("/proc/sys/kernel/perf_event_paranoid", "r")) {
+        if (std::fscanf(f, "%d", &paranoid) == 1)
+          reason += " (perf_event_paranoid=" + std::to_string(paranoid) + ")";
+        std::fclose(f);
+      }
+    }
+#endif
+  }
+
+  static bool scaled(const Values& values, double v[MaxCounters]) {
+    if (values.running == 0)
+      return false;
+    const double k = double(values.enabled) / double(values.running);
+    for (int i=0; i<MaxCounters; ++i)
+      v[i] = double(values.v[i]) * k;
+    return true;
+  }
+
+  void print_row(const char* phase, const char* tid,
+                 const double v[MaxCounters], const int n) const {
+    std::printf("%-9s %-6s", phase, tid);
+    for (int i=0; i<n; ++i)
+      std::printf(" %16.0f", v[i]);
+    if (mode == Mode::Hardware) {
+      const double ki = v[1] / 1000.0;
+      std::printf(" %6.2f %8.2f %8.2f %8.2f",
+                  (v[0] > 0 ? v[1] / v[0]: 0.0),
+                  (v[2] > 0 ? 100.0 * v[3] / v[2]: 0.0),
+                  (ki > 0 ? v[4] / ki: 0.0),
+                  (ki > 0 ? v[5] / ki: 0.0));
+    }
+    std::printf("\n");
+  }
+
+  std::string reason;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<ThreadCounters>> threads;
+};
+
+// Adds the counters between the constructor and the destructor to
+// the given phase of the current thread
+class Scope {
+public:
+  Scope(const Phase phase) : phase(phase), tc(nullptr) {
+    Counters& c = Counters::instance();
+    if (c.mode != Mode::Disabled) {
+      tc = &c.thread_counters();
+      if (!c.read(*tc, start))
+        tc = nullptr;
+    }
+  }
+
+  ~Scope() {
+    Values end;
+    if (tc && Counters::instance().read(*tc, end)) {
+      Values& acc = tc->phases[phase];
+      acc.enabled += end.enabled - start.enabled;
+      acc.running += end.running - start.running;
+      for (int i=0; i<MaxCounters; ++i)
+        acc.v[i] += end.v[i] - start.v[i];
+    }
+  }
+
+private:
+  Phase phase;
+  ThreadCounters* tc;
+  Values start;
+};
+
+} // namespace perf
+
+#endif // PERF_COUNTERS_H_INCLUDED
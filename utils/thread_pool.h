@@ -6,9 +6,13 @@
 #ifndef THREAD_POOL_H_INCLUDED
 #define THREAD_POOL_H_INCLUDED
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <cstdio>
 #include <functional>
 #include <mutex>
 #include <queue>
@@ -16,15 +20,25 @@
 #include <vector>
 
 class thread_pool {
+  using clock = std::chrono::steady_clock;
 public:
-  thread_pool(const size_t n)
+  // If "metrics" is true, the pool measures the busy/idle time of each
+  // worker, lock wait times, and the queue depth (see print_metrics()).
+  thread_pool(const size_t n, const bool metrics = false)
     : m_running(true)
     , m_threads(n)
     , m_doingWork(0)
+    , m_metrics(metrics)
+    , m_workers(n)
+    , m_executeLockWait(0)
+    , m_waitAllTime(0)
+    , m_waitAllCalls(0)
   {
+    m_start = clock::now();
+    m_lastSample = m_start;
     std::unique_lock<std::mutex> lock(m_mutex);
     for (size_t i=0; i<n; ++i)
-      m_threads.push_back(std::move(std::thread([this]{ worker(); })));
+      m_threads.push_back(std::move(std::thread([this, i]{ worker(i); })));
   }
 
   ~thread_pool() {
@@ -34,19 +48,93 @@ public:
   void execute(std::function<void()>&& func) {
     assert(m_running);
 
+    const clock::time_point t0 = (m_metrics ? clock::now(): clock::time_point());
     std::unique_lock<std::mutex> lock(m_mutex);
     m_work.push(std::move(func));
+    if (m_metrics) {
+      const clock::time_point t1 = clock::now();
+      m_executeLockWait += ns(t1 - t0);
+      sample_queue(t1);
+    }
     m_cv.notify_one();
   }
 
   // Waits until the queue is empty.
   void wait_all() {
+    const clock::time_point t0 = (m_metrics ? clock::now(): clock::time_point());
+    {
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cvWait.wait(lock, [this]() -> bool {
+                            return
+                              !m_running ||
+                              (m_work.empty() && m_doingWork == 0);
+                          });
+    }
+    if (m_metrics) {
+      m_waitAllTime += ns(clock::now() - t0);
+      ++m_waitAllCalls;
+    }
+  }
+
+  // Prints the metrics collected since the pool was created (it must
+  // be called after wait_all())
+  void print_metrics() {
+    if (!m_metrics)
+      return;
+
     std::unique_lock<std::mutex> lock(m_mutex);
-    m_cvWait.wait(lock, [this]() -> bool {
-                          return
-                            !m_running ||
-                            (m_work.empty() && m_doingWork == 0);
-                        });
+    const clock::time_point now = clock::now();
+    const double total_ms = ns(now - m_start) / 1e6;
+    uint64_t tasks = 0;
+    for (const Worker& w : m_workers)
+      tasks += w.tasks;
+
+    std::printf("thread pool: %d workers, %llu tasks, %.3f ms\n",
+                int(m_workers.size()), (unsigned long long)tasks, total_ms);
+    std::printf("  wait_all: %.3f ms (%d calls)\n",
+                m_waitAllTime / 1e6, int(m_waitAllCalls));
+    std::printf("  execute lock wait: %.3f ms\n", m_executeLockWait / 1e6);
+    std::printf("  %-6s %10s %12s %12s %7s %14s\n",
+                "worker", "tasks", "busy ms", "idle ms", "util%", "lock wait ms");
+    for (size_t i=0; i<m_workers.size(); ++i) {
+      const Worker& w = m_workers[i];
+      const double busy = w.busy / 1e6;
+      // Include the current wait of idle workers
+      const double idle = (w.idle + (w.waiting ? ns(now - w.idleSince): 0)) / 1e6;
+      std::printf("  %-6d %10llu %12.3f %12.3f %7.1f %14.3f\n",
+                  int(i), (unsigned long long)w.tasks, busy, idle,
+                  (busy+idle > 0.0 ? 100.0 * busy / (busy+idle): 0.0),
+                  w.lockWait / 1e6);
+    }
+
+    size_t max_depth = 0;
+    double avg_depth = 0.0;
+    for (const QueueSample& s : m_queueSamples) {
+      max_depth = std::max(max_depth, s.depth);
+      avg_depth += double(s.depth);
+    }
+    if (!m_queueSamples.empty())
+      avg_depth /= double(m_queueSamples.size());
+    std::printf("  queue depth: max %d, avg %.1f (%d samples)\n",
+                int(max_depth), avg_depth, int(m_queueSamples.size()));
+
+    // Max depth in 10 intervals of time
+    if (!m_queueSamples.empty()) {
+      const int64_t end = m_queueSamples.back().time + 1;
+      int slots[10] = { -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 };
+      for (const QueueSample& s : m_queueSamples) {
+        int& slot = slots[s.time * 10 / end];
+        slot = std::max(slot, int(s.depth));
+      }
+      std::printf("  queue depth over time:");
+      for (int depth : slots) {
+        if (depth < 0)
+          std::printf(" -");    // No samples in this interval
+        else
+          std::printf(" %d", depth);
+      }
+      std::printf("\n");
+    }
   }
 
 private:
@@ -69,12 +157,47 @@ private:
     }
   }
 
+  struct Worker {
+    uint64_t tasks = 0;
+    int64_t busy = 0;           // Nanoseconds
+    int64_t idle = 0;
+    int64_t lockWait = 0;
+    bool waiting = false;
+    clock::time_point idleSince;
+  };
+
+  struct QueueSample {
+    int64_t time;               // Nanoseconds since the pool was created
+    size_t depth;
+  };
+
+  static int64_t ns(const clock::duration& d) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+  }
+
+  // Records the queue depth at most once per millisecond (m_mutex
+  // must be locked)
+  void sample_queue(const clock::time_point& now) {
+    if (now - m_lastSample >= std::chrono::milliseconds(1) ||
+        m_queueSamples.empty()) {
+      m_queueSamples.push_back(QueueSample{ ns(now - m_start), m_work.size() });
+      m_lastSample = now;
+    }
+  }
+
   // Called for each worker thread.
-  void worker() {
+  void worker(const size_t i) {
+    Worker& stats = m_workers[i];
     while (m_running) {
       std::function<void()> func;
       {
+        const clock::time_point t0 = (m_metrics ? clock::now(): clock::time_point());
         std::unique_lock<std::mutex> lock(m_mutex);
+        const clock::time_point t1 = (m_metrics ? clock::now(): clock::time_point());
+        if (m_metrics) {
+          stats.waiting = true;
+          stats.idleSince = t1;
+        }
         m_cv.wait(lock, [this]() -> bool {
                           return !m_running || !m_work.empty();
                         });
@@ -83,7 +206,16 @@ private:
           ++m_doingWork;
           m_work.pop();
         }
+        if (m_metrics) {
+          const clock::time_point t2 = clock::now();
+          stats.lockWait += ns(t1 - t0);
+          stats.idle += ns(t2 - t1);
+          stats.waiting = false;
+          if (func)
+            sample_queue(t2);
+        }
       }
+      const clock::time_point t3 = (m_metrics ? clock::now(): clock::time_point());
       try {
         if (func)
           func();
@@ -97,7 +229,13 @@ private:
       }
 
       {
+        const clock::time_point t4 = (m_metrics ? clock::now(): clock::time_point());
         std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_metrics && func) {
+          stats.lockWait += ns(clock::now() - t4);
+          stats.busy += ns(t4 - t3);
+          ++stats.tasks;
+        }
         --m_doingWork;
         m_cvWait.notify_all();
       }
@@ -111,6 +249,16 @@ private:
   std::condition_variable m_cvWait;
   std::queue<std::function<void()>> m_work;
   int m_doingWork;
+
+  // Metrics
+  const bool m_metrics;
+  std::vector<Worker> m_workers;
+  std::atomic<int64_t> m_executeLockWait;
+  std::atomic<int64_t> m_waitAllTime;
+  std::atomic<int> m_waitAllCalls;
+  clock::time_point m_start;
+  clock::time_point m_lastSample;
+  std::vector<QueueSample> m_queueSamples;
 };
 
 #endif
@@ -0,0 +1,290 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef TIMERS_H_INCLUDED
+#define TIMERS_H_INCLUDED
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define TIMERS_RDTSC 1
+#elif defined(_M_X64) || defined(_M_IX86)
+  #include <intrin.h>
+  #define TIMERS_RDTSC 1
+#endif
+
+// Hierarchical scoped timers: each timers::Scope adds the elapsed
+// time (rdtsc ticks) to a node of a tree of the current thread
+// (nested scopes are children of the enclosing one). At exit the
+// trees of all threads are merged by the scope names and printed with
+// the total/self time, count, and p50/p99 of each scope, plus the
+// slowest files of each scope that specifies a file.
+//
+// The memory used by each scope is bounded: the percentiles are
+// calculated from a reservoir sample of MaxSamples durations (per
+// thread), and only the MaxFiles slowest files are kept (per thread,
+// as indexes of the file names of the tree).
+namespace timers {
+
+const int MaxSamples = 1024;
+const int MaxFiles = 64;
+
+inline uint64_t ticks() {
+#ifdef TIMERS_RDTSC
+  return __rdtsc();
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+struct Node {
+  using File = std::pair<uint64_t, int>; // Ticks + index of the file name
+
+  const char* name;
+  int parent;
+  std::vector<int> children;
+  uint64_t total = 0;
+  uint64_t children_total = 0;
+  uint64_t count = 0;
+  std::vector<uint64_t> samples;
+  std::vector<File> files;      // Min-heap of the slowest files
+
+  Node(const char* name, int parent) : name(name), parent(parent) { }
+
+  static bool slower(const File& a, const File& b) {
+    return a.first > b.first;
+  }
+
+  // Algorithm R: the i-th duration replaces a random sample with
+  // probability MaxSamples/i
+  void add_sample(const uint64_t t, const uint64_t random) {
+    ++count;
+    if (samples.size() < std::size_t(MaxSamples)) {
+      if (samples.empty())
+        samples.reserve(MaxSamples);
+      samples.push_back(t);
+    }
+    else {
+      const uint64_t j = random % count;
+      if (j < uint64_t(MaxSamples))
+        samples[j] = t;
+    }
+  }
+
+  bool is_slow_file(const uint64_t t) const {
+    return (files.size() < std::size_t(MaxFiles) || t > files.front().first);
+  }
+
+  void add_file(const uint64_t t, const int file) {
+    if (files.size() < std::size_t(MaxFiles)) {
+      if (files.empty())
+        files.reserve(MaxFiles);
+    }
+    else {
+      std::pop_heap(files.begin(), files.end(), slower);
+      files.pop_back();
+    }
+    files.emplace_back(t, file);
+    std::push_heap(files.begin(), files.end(), slower);
+  }
+};
+
+struct Tree {
+  std::vector<Node> nodes = { Node("", -1) };
+  int current = 0;
+  std::vector<std::string> file_names;
+  std::unordered_map<std::string, int> file_indexes;
+  uint64_t seed = 0x9e3779b97f4a7c15ull;
+
+  // Returns the index of the given file name in file_names
+  int file_index(const std::string& fn) {
+    auto it = file_indexes.find(fn);
+    if (it != file_indexes.end())
+      return it->second;
+    int i = int(file_names.size());
+    file_names.push_back(fn);
+    file_indexes[fn] = i;
+    return i;
+  }
+
+  // xorshift64
+  uint64_t random() {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+  }
+
+  // Returns the child of "parent" with the given name (or creates it)
+  int child(const int parent, const char* name) {
+    for (int i : nodes[parent].children)
+      if (nodes[i].name == name ||
+          std::strcmp(nodes[i].name, name) == 0)
+        return i;
+    int i = int(nodes.size());
+    nodes.emplace_back(name, parent);
+    nodes[parent].children.push_back(i);
+    return i;
+  }
+};
+
+class Timers {
+  using Clock = std::chrono::steady_clock;
+public:
+  static Timers& instance() {
+    static Timers timers;
+    return timers;
+  }
+
+  bool enabled = false;
+
+  void enable() {
+    enabled = true;
+    start_ticks = ticks();
+    start_time = Clock::now();
+  }
+
+  Tree& tree() {
+    thread_local Tree* t = nullptr;
+    if (!t) {
+      std::unique_lock<std::mutex> lock(mutex);
+      trees.emplace_back(new Tree);
+      t = trees.back().get();
+    }
+    return *t;
+  }
+
+  // Prints the merged tree of all threads (it must be called when no
+  // thread is inside a scope). "top" is the number of slowest files
+  // to show for each scope.
+  void print(const int top) {
+    const double secs =
+      std::chrono::duration<double>(Clock::now() - start_time).count();
+    const uint64_t elapsed = ticks() - start_ticks;
+    ticks_per_us = (secs > 0.0 ? double(elapsed) / (secs * 1e6): 1.0);
+    if (ticks_per_us <= 0.0)
+      ticks_per_us = 1.0;
+
+    Tree merged;
+    for (const auto& t : trees)
+      merge(*t, 0, merged, 0);
+
+    std::printf("%-32s %12s %12s %8s %10s %10s\n",
+                "scope", "total ms", "self ms", "count", "p50 us", "p99 us");
+    for (int i : merged.nodes[0].children)
+      print_node(merged, i, 0);
+
+    for (Node& node : merged.nodes) {
+      if (node.files.empty())
+        continue;
+      std::sort(node.files.begin(), node.files.end(), Node::slower);
+      std::printf("slowest files (%s):\n", node.name);
+      const int n = std::min(int(node.files.size()), top);
+      for (int i=0; i<n; ++i)
+        std::printf("  %10.3f ms  %s\n",
+                    us(node.files[i].first) / 1000.0,
+                    merged.file_names[node.files[i].second].c_str());
+    }
+  }
+
+private:
+  Timers() { }
+
+  double us(uint64_t t) const {
+    return double(t) / ticks_per_us;
+  }
+
+  static void merge(const Tree& src, int src_i, Tree& dst, int dst_i) {
+    for (int i : src.nodes[src_i].children) {
+      const Node& s = src.nodes[i];
+      const int j = dst.child(dst_i, s.name);
+      Node& d = dst.nodes[j];
+      d.total += s.total;
+      d.children_total += s.children_total;
+      d.count += s.count;
+      d.samples.insert(d.samples.end(), s.samples.begin(), s.samples.end());
+      for (const auto& file : s.files)
+        d.files.emplace_back(file.first,
+                             dst.file_index(src.file_names[file.second]));
+      merge(src, i, dst, j);
+    }
+  }
+
+  void print_node(Tree& tree, int i, int depth) {
+    Node& node = tree.nodes[i];
+    std::sort(node.samples.begin(), node.samples.end());
+    const int n = int(node.samples.size());
+    auto percentile = [&node, n](int p) -> uint64_t {
+      return (n > 0 ? node.samples[std::min(n-1, n*p/100)]: 0);
+    };
+    std::string name(2*depth, ' ');
+    name += node.name;
+    std::printf("%-32s %12.3f %12.3f %8d %10.1f %10.1f\n",
+                name.c_str(),
+                us(node.total) / 1000.0,
+                us(node.total - node.children_total) / 1000.0,
+                int(node.count),
+                us(percentile(50)),
+                us(percentile(99)));
+    for (int j : node.children)
+      print_node(tree, j, depth+1);
+  }
+
+  uint64_t start_ticks = 0;
+  Clock::time_point start_time;
+  double ticks_per_us = 1.0;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Tree>> trees;
+};
+
+// Measures the time from the constructor to the destructor. The name
+// must be a static string (or live until the timers are printed).
+class Scope {
+public:
+  Scope(const char* name, const std::string* file = nullptr)
+    : tree(Timers::instance().enabled ? &Timers::instance().tree(): nullptr) {
+    if (tree) {
+      node = tree->child(tree->current, name);
+      tree->current = node;
+      this->file = file;
+      start = ticks();
+    }
+  }
+
+  ~Scope() {
+    if (tree) {
+      const uint64_t t = ticks() - start;
+      Node& n = tree->nodes[node];
+      n.total += t;
+      n.add_sample(t, tree->random());
+      if (file && n.is_slow_file(t))
+        n.add_file(t, tree->file_index(*file));
+      tree->current = n.parent;
+      if (n.parent > 0)
+        tree->nodes[n.parent].children_total += t;
+    }
+  }
+
+private:
+  Tree* tree;
+  int node;
+  const std::string* file;
+  uint64_t start;
+};
+
+} // namespace timers
+
+#endif // TIMERS_H_INCLUDED
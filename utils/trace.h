@@ -0,0 +1,173 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+#include "utils/scoped_fclose.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Records the execution of tasks (begin time + duration) to be
+// exported in the Chrome trace-event format (it can be opened with
+// chrome://tracing or https://ui.perfetto.dev/). Each thread appends
+// events to its own buffer, so there are no locks when recording
+// events (only the first time a thread records something).
+namespace trace {
+
+struct Event {
+  const char* name;             // Static string (e.g. "lex")
+  std::string file;
+  int64_t ts, dur;              // Microseconds
+  int64_t wait;                 // Time in the thread_pool queue (or -1)
+  int64_t bytes;                // Size of the file (or -1)
+};
+
+struct Buffer {
+  int tid;
+  std::vector<Event> events;
+};
+
+class Tracer {
+  using Clock = std::chrono::steady_clock;
+public:
+  static Tracer& instance() {
+    static Tracer tracer;
+    return tracer;
+  }
+
+  bool enabled = false;
+
+  int64_t now() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+      Clock::now() - start).count();
+  }
+
+  // Returns the buffer of the current thread
+  Buffer& buffer() {
+    thread_local Buffer* buf = nullptr;
+    if (!buf) {
+      std::unique_lock<std::mutex> lock(mutex);
+      buffers.emplace_back(new Buffer);
+      buf = buffers.back().get();
+      buf->tid = int(buffers.size()-1);
+    }
+    return *buf;
+  }
+
+  // Writes all the events in the Chrome trace-event format. It must
+  // be called when the threads are not recording events.
+  bool write(const std::string& fn) {
+    std::FILE* f = std::fopen(fn.c_str(), "wb");
+    if (!f)
+      return false;
+    Scoped_fclose fc(f);
+
+    const char* sep = "";
+    std::fprintf(f, "{\"traceEvents\":[\n");
+    for (const auto& buf : buffers) {
+      std::fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                   "\"args\":{\"name\":\"%s %d\"}}",
+                   sep, buf->tid,
+                   (buf->tid == 0 ? "main": "worker"), buf->tid);
+      sep = ",\n";
+      for (const Event& e : buf->events) {
+        std::fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"task\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                     "\"ts\":%lld,\"dur\":%lld,\"args\":{",
+                     sep, e.name, buf->tid,
+                     (long long)e.ts, (long long)e.dur);
+        const char* arg_sep = "";
+        if (!e.file.empty()) {
+          std::fprintf(f, "\"file\":\"");
+          write_escaped(f, e.file);
+          std::fprintf(f, "\"");
+          arg_sep = ",";
+        }
+        if (e.bytes >= 0) {
+          std::fprintf(f, "%s\"bytes\":%lld", arg_sep, (long long)e.bytes);
+          arg_sep = ",";
+        }
+        if (e.wait >= 0)
+          std::fprintf(f, "%s\"wait_us\":%lld", arg_sep, (long long)e.wait);
+        std::fprintf(f, "}}");
+      }
+    }
+    std::fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+    return true;
+  }
+
+private:
+  Tracer() : start(Clock::now()) { }
+
+  static void write_escaped(std::FILE* f, const std::string& s) {
+    for (char chr : s) {
+      if (chr == '"' || chr == '\\')
+        std::fprintf(f, "\\%c", chr);
+      else if ((unsigned char)chr < 32)
+        std::fprintf(f, "\\u%04x", chr);
+      else
+        std::fputc(chr, f);
+    }
+  }
+
+  Clock::time_point start;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<Buffer>> buffers;
+};
+
+inline bool enabled() {
+  return Tracer::instance().enabled;
+}
+
+// Timestamp to calculate the queue-wait time of a task (it must be
+// taken before adding the task to the thread_pool)
+inline int64_t queued() {
+  return (enabled() ? Tracer::instance().now(): -1);
+}
+
+// Records an event from the constructor to the destructor
+class Scope {
+public:
+  Scope(const char* name,
+        const std::string& file = std::string(),
+        int64_t queued_ts = -1)
+    : active(enabled()) {
+    if (active) {
+      Tracer& t = Tracer::instance();
+      e.name = name;
+      e.file = file;
+      e.ts = t.now();
+      e.wait = (queued_ts >= 0 ? e.ts - queued_ts: -1);
+      e.bytes = -1;
+    }
+  }
+
+  ~Scope() {
+    if (active) {
+      Tracer& t = Tracer::instance();
+      e.dur = t.now() - e.ts;
+      t.buffer().events.emplace_back(std::move(e));
+    }
+  }
+
+  void set_bytes(int64_t bytes) {
+    if (active)
+      e.bytes = bytes;
+  }
+
+private:
+  bool active;
+  Event e;
+};
+
+} // namespace trace
+
+#endif // TRACE_H_INCLUDED
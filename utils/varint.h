@@ -0,0 +1,61 @@
+// Copyright (C) 2021  David Capello
+//
+// This file is released under the terms of the MIT license.
+// Read LICENSE.txt for more information.
+
+#ifndef VARINT_H_INCLUDED
+#define VARINT_H_INCLUDED
+
+#include <cstdint>
+#include <vector>
+
+// Variable-length integers (7 bits per byte, the high bit indicates
+// that more bytes follow) used by the compressed formats (compact
+// tokens, posting lists). Signed deltas are stored with zigzag
+// encoding so small negative values use few bytes too.
+
+inline uint32_t zigzag(int32_t v)
+{
+  return (uint32_t(v) << 1) ^ uint32_t(v >> 31);
+}
+
+inline int32_t unzigzag(uint32_t v)
+{
+  return int32_t(v >> 1) ^ -int32_t(v & 1);
+}
+
+inline void write_varint(std::vector<uint8_t>& out, uint32_t v)
+{
+  while (v >= 0x80) {
+    out.push_back(uint8_t(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back(uint8_t(v));
+}
+
+inline uint32_t read_varint(const uint8_t*& p)
+{
+  uint32_t v = *p & 0x7f;
+  int shift = 7;
+  while (*(p++) & 0x80) {
+    v |= uint32_t(*p & 0x7f) << shift;
+    shift += 7;
+  }
+  return v;
+}
+
+// Reads a varint without reading past "end" (for data loaded from
+// files), returns false if it's truncated or longer than 5 bytes
+inline bool read_varint(const uint8_t*& p, const uint8_t* end, uint32_t& v)
+{
+  v = 0;
+  for (int shift=0; shift<35 && p < end; shift+=7) {
+    const uint8_t b = *(p++);
+    v |= uint32_t(b & 0x7f) << shift;
+    if (!(b & 0x80))
+      return true;
+  }
+  return false;
+}
+
+#endif // VARINT_H_INCLUDED